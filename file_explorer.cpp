@@ -5,6 +5,27 @@
 #include <cstring>
 #include <iomanip>
 #include <sstream>
+#include <fstream>
+#include <charconv>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <map>
+#include <array>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cmath>
 
 // Linux-specific headers
 #include <dirent.h>
@@ -16,6 +37,24 @@
 #include <time.h>
 #include <fcntl.h>
 #include <utime.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sys/uio.h>
+#include <regex.h>
+#include <glob.h>
+#include <sys/utsname.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -29,378 +68,9239 @@ using namespace std;
 #define MAGENTA "\033[35m"
 #define CYAN    "\033[36m"
 
+// Hot-path instrumentation. Each probe class gets a latency histogram per
+// thread: log2 buckets split into 8 linear sub-buckets (HDR style, about
+// 12% resolution from nanoseconds to hours). Only the owning thread writes
+// its histograms, so recording is a clock read and a few relaxed stores;
+// snapshots merge all threads. Recording is off unless enabled at run time
+// (setEnabled, or FILE_EXPLORER_METRICS=1 in the environment), which then
+// costs one relaxed load per probe. Building with -DFILE_EXPLORER_NO_METRICS
+// removes the probes entirely.
+enum class Probe : unsigned { Getdents, Stat, Open, Read, Write, NameLookup, Sort, Format, Count };
+
+class Metrics {
+public:
+    static constexpr unsigned kProbes = static_cast<unsigned>(Probe::Count);
+    static constexpr unsigned kBuckets = 512;
+    
+    // Merged view of one probe
+    struct Summary {
+        uint64_t count = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+        uint64_t buckets[kBuckets] = {0};
+        
+        // Upper edge of the bucket holding the p-th percentile
+        uint64_t percentile(double p) const {
+            if (count == 0) return 0;
+            uint64_t rank = static_cast<uint64_t>(ceil(p / 100.0 * count));
+            if (rank == 0) rank = 1;
+            uint64_t seen = 0;
+            for (unsigned b = 0; b < kBuckets; b++) {
+                seen += buckets[b];
+                if (seen >= rank) return min(bucketUpper(b), maxNs);
+            }
+            return maxNs;
+        }
+    };
+    
+private:
+    struct Histogram {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> totalNs{0};
+        atomic<uint64_t> maxNs{0};
+        atomic<uint64_t> buckets[kBuckets];
+        
+        Histogram() {
+            for (auto& b : buckets) b.store(0, memory_order_relaxed);
+        }
+    };
+    
+    struct ThreadSlot {
+        Histogram probes[kProbes];
+    };
+    
+    // Slots are never freed, so snapshots can't see freed memory. When a
+    // thread exits, its counts are folded into retired and its slot goes
+    // on the free list for the next thread, so short-lived workers don't
+    // grow the registry. All three are guarded by registryMtx.
+    struct Registry {
+        vector<unique_ptr<ThreadSlot>> slots;
+        vector<ThreadSlot*> free;
+        ThreadSlot retired;
+        size_t threads = 0;     // that ever recorded, live or not
+    };
+    
+    // Returns the thread's slot to the registry when the thread exits
+    struct Lease {
+        ThreadSlot* slot = nullptr;
+        ~Lease() {
+            if (!slot) return;
+            lock_guard<mutex> lock(registryMtx);
+            Registry& r = registry();
+            for (unsigned p = 0; p < kProbes; p++) {
+                fold(r.retired.probes[p], slot->probes[p]);
+                clear(slot->probes[p]);
+            }
+            r.free.push_back(slot);
+        }
+    };
+    
+    static atomic<bool> enabled;
+    static mutex registryMtx;
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+    
+    static ThreadSlot& slot() {
+        thread_local Lease lease;
+        if (!lease.slot) {
+            lock_guard<mutex> lock(registryMtx);
+            Registry& r = registry();
+            r.threads++;
+            if (!r.free.empty()) {
+                lease.slot = r.free.back();
+                r.free.pop_back();
+            } else {
+                r.slots.push_back(make_unique<ThreadSlot>());
+                lease.slot = r.slots.back().get();
+            }
+        }
+        return *lease.slot;
+    }
+    
+    // Adds from into the running totals of into (both read under the lock)
+    static void fold(Histogram& into, const Histogram& from) {
+        bump(into.count, from.count.load(memory_order_relaxed));
+        bump(into.totalNs, from.totalNs.load(memory_order_relaxed));
+        into.maxNs.store(max(into.maxNs.load(memory_order_relaxed), from.maxNs.load(memory_order_relaxed)),
+                         memory_order_relaxed);
+        for (unsigned b = 0; b < kBuckets; b++) bump(into.buckets[b], from.buckets[b].load(memory_order_relaxed));
+    }
+    
+    static void clear(Histogram& h) {
+        h.count.store(0, memory_order_relaxed);
+        h.totalNs.store(0, memory_order_relaxed);
+        h.maxNs.store(0, memory_order_relaxed);
+        for (auto& b : h.buckets) b.store(0, memory_order_relaxed);
+    }
+    
+    // Single writer per histogram: plain load + store, no locked instructions
+    static void bump(atomic<uint64_t>& a, uint64_t by) {
+        a.store(a.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+    
+    static unsigned bucketOf(uint64_t ns) {
+        if (ns < 8) return static_cast<unsigned>(ns);
+        unsigned msb = 63 - __builtin_clzll(ns);
+        return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+    }
+    
+    static uint64_t bucketUpper(unsigned b) {
+        if (b < 8) return b;
+        unsigned msb = b / 8 + 2;
+        uint64_t sub = b % 8;
+        return ((8 + sub + 1) << (msb - 3)) - 1;
+    }
+    
+public:
+    static const char* name(Probe p) {
+        switch (p) {
+            case Probe::Getdents: return "getdents";
+            case Probe::Stat: return "stat";
+            case Probe::Open: return "open";
+            case Probe::Read: return "read";
+            case Probe::Write: return "write";
+            case Probe::NameLookup: return "getpwuid";
+            case Probe::Sort: return "sort";
+            case Probe::Format: return "format";
+            default: return "?";
+        }
+    }
+    
+    static bool on() {
+        return enabled.load(memory_order_relaxed);
+    }
+    
+    static void setEnabled(bool value) {
+        enabled.store(value, memory_order_relaxed);
+    }
+    
+    static void record(Probe p, uint64_t ns) {
+        Histogram& h = slot().probes[static_cast<unsigned>(p)];
+        bump(h.count, 1);
+        bump(h.totalNs, ns);
+        bump(h.buckets[bucketOf(ns)], 1);
+        if (ns > h.maxNs.load(memory_order_relaxed)) h.maxNs.store(ns, memory_order_relaxed);
+    }
+    
+    static Summary summary(Probe p) {
+        Summary s;
+        lock_guard<mutex> lock(registryMtx);
+        Registry& r = registry();
+        auto add = [&](const Histogram& h) {
+            s.count += h.count.load(memory_order_relaxed);
+            s.totalNs += h.totalNs.load(memory_order_relaxed);
+            s.maxNs = max(s.maxNs, h.maxNs.load(memory_order_relaxed));
+            for (unsigned b = 0; b < kBuckets; b++) s.buckets[b] += h.buckets[b].load(memory_order_relaxed);
+        };
+        // Free slots were cleared when they were retired
+        for (const auto& t : r.slots) add(t->probes[static_cast<unsigned>(p)]);
+        add(r.retired.probes[static_cast<unsigned>(p)]);
+        return s;
+    }
+    
+    static size_t threads() {
+        lock_guard<mutex> lock(registryMtx);
+        return registry().threads;
+    }
+    
+    // Zeroes every histogram; racing recorders may keep a few samples
+    static void reset() {
+        lock_guard<mutex> lock(registryMtx);
+        Registry& r = registry();
+        for (const auto& t : r.slots) {
+            for (auto& h : t->probes) clear(h);
+        }
+        for (auto& h : r.retired.probes) clear(h);
+    }
+    
+    static void writeJson(ostream& out) {
+        out << "{\"enabled\": " << (on() ? "true" : "false") << ", \"threads\": " << threads() << ", \"probes\": {";
+        for (unsigned p = 0; p < kProbes; p++) {
+            Summary s = summary(static_cast<Probe>(p));
+            out << (p ? ", " : "") << "\"" << name(static_cast<Probe>(p)) << "\": {\"count\": " << s.count
+                << ", \"total_ns\": " << s.totalNs << ", \"p50_ns\": " << s.percentile(50)
+                << ", \"p90_ns\": " << s.percentile(90) << ", \"p99_ns\": " << s.percentile(99)
+                << ", \"max_ns\": " << s.maxNs << "}";
+        }
+        out << "}}\n";
+    }
+    
+    // Times its own lifetime into one probe when recording is on
+    class Scope {
+    private:
+        Probe probe;
+        bool active;
+        chrono::steady_clock::time_point start;
+        
+    public:
+        explicit Scope(Probe p) : probe(p), active(on()) {
+            if (active) start = chrono::steady_clock::now();
+        }
+        
+        ~Scope() {
+            if (active) {
+                auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                record(probe, static_cast<uint64_t>(ns));
+            }
+        }
+        
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+atomic<bool> Metrics::enabled{getenv("FILE_EXPLORER_METRICS") != nullptr &&
+                              strcmp(getenv("FILE_EXPLORER_METRICS"), "0") != 0};
+mutex Metrics::registryMtx;
+
+#define FE_PROBE_CONCAT2(a, b) a##b
+#define FE_PROBE_CONCAT(a, b) FE_PROBE_CONCAT2(a, b)
+#ifdef FILE_EXPLORER_NO_METRICS
+#define FE_PROBE(kind) ((void)0)
+#define FE_TIMED(kind, expr) (expr)
+#else
+// FE_PROBE times the rest of the enclosing block; FE_TIMED one expression
+#define FE_PROBE(kind) Metrics::Scope FE_PROBE_CONCAT(probeScope_, __LINE__)(Probe::kind)
+#define FE_TIMED(kind, expr) ([&] { FE_PROBE(kind); return (expr); }())
+#endif
+
+// Bulk directory reader built directly on getdents64. One syscall fills a
+// large buffer with many entries; names are handed out as views into that
+// buffer, so iterating a directory allocates nothing. The buffer is kept
+// across open() calls so a reader can be reused for many directories.
+class DirReader {
+public:
+    struct Entry {
+        string_view name;       // NUL-terminated, valid until the next refill
+        unsigned char type;     // d_type, may be DT_UNKNOWN
+        ino_t ino;
+    };
+    
+private:
+    // Kernel record layout for getdents64
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    
+    int fd = -1;
+    vector<char> buffer;
+    size_t pos = 0;
+    size_t len = 0;
+    bool keepParent = false;
+    
+    bool refill() {
+        FE_PROBE(Getdents);
+        long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (n <= 0) return false;
+        pos = 0;
+        len = static_cast<size_t>(n);
+        return true;
+    }
+    
+public:
+    explicit DirReader(size_t bufferSize = 1 << 20) : buffer(bufferSize) {}
+    
+    ~DirReader() {
+        close();
+    }
+    
+    DirReader(const DirReader&) = delete;
+    DirReader& operator=(const DirReader&) = delete;
+    
+    // withParent makes next() return ".." as well, for listings that show it
+    bool open(const string& path, bool withParent = false) {
+        close();
+        keepParent = withParent;
+        FE_PROBE(Open);
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return fd >= 0;
+    }
+    
+    int fdNum() const {
+        return fd;
+    }
+    
+    // Opens name relative to dirFd, failing if a symlink sits in its place;
+    // "." gives a fresh descriptor for dirFd itself with its own read position
+    bool openAt(int dirFd, const char* name, bool withParent = false) {
+        close();
+        keepParent = withParent;
+        FE_PROBE(Open);
+        fd = ::openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        return fd >= 0;
+    }
+    
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        pos = len = 0;
+    }
+    
+    // Advances to the next entry, skipping "." (and ".." unless requested).
+    bool next(Entry& out) {
+        while (true) {
+            if (pos >= len && !refill()) return false;
+            auto* d = reinterpret_cast<LinuxDirent64*>(buffer.data() + pos);
+            pos += d->d_reclen;
+            
+            const char* name = d->d_name;
+            if (name[0] == '.') {
+                if (name[1] == '\0') continue;
+                if (name[1] == '.' && name[2] == '\0' && !keepParent) continue;
+            }
+            
+            out.name = string_view(name, strlen(name));
+            out.type = d->d_type;
+            out.ino = static_cast<ino_t>(d->d_ino);
+            return true;
+        }
+    }
+};
+
+// Metadata for one directory entry; only the fields requested from the
+// MetaFetcher that produced it are meaningful
+struct EntryMeta {
+    mode_t mode = 0;
+    uid_t uid = 0;
+    gid_t gid = 0;
+    uint64_t size = 0;
+    uint64_t blocks = 0;
+    nlink_t nlink = 0;
+    ino_t ino = 0;
+    dev_t dev = 0;
+    struct timespec mtime = {0, 0};
+};
+
+// Metadata layer built on statx. A fetcher is created with the fields a
+// view needs and asks the kernel for exactly those, which lets network
+// filesystems skip attributes nobody will print. When only the file type is
+// needed and the directory entry already carries d_type, no syscall is made
+// at all; statx is issued only for DT_UNKNOWN. Kernels without statx fall
+// back to fstatat.
+class MetaFetcher {
+public:
+    enum Field : unsigned {
+        Type = STATX_TYPE,
+        Mode = STATX_TYPE | STATX_MODE,
+        Owner = STATX_UID | STATX_GID,
+        Size = STATX_SIZE,
+        Blocks = STATX_BLOCKS,
+        Links = STATX_NLINK,
+        Inode = STATX_INO,
+        MTime = STATX_MTIME,
+    };
+    
+private:
+    unsigned mask;
+    static atomic<bool> statxMissing;
+    
+    static void fromStat(const struct stat& st, EntryMeta& out) {
+        out.mode = st.st_mode;
+        out.uid = st.st_uid;
+        out.gid = st.st_gid;
+        out.size = st.st_size;
+        out.blocks = st.st_blocks;
+        out.nlink = st.st_nlink;
+        out.ino = st.st_ino;
+        out.dev = st.st_dev;
+        out.mtime = st.st_mtim;
+    }
+    
+public:
+    explicit MetaFetcher(unsigned fields) : mask(fields | STATX_TYPE) {}
+    
+    bool typeOnly() const {
+        return mask == STATX_TYPE;
+    }
+    
+    // Fetches metadata for name (relative to dirFd, symlinks not followed).
+    // dtype is the entry's d_type, or DT_UNKNOWN if not known.
+    bool fetch(int dirFd, const char* name, unsigned char dtype, EntryMeta& out) const {
+        if (typeOnly() && dtype != DT_UNKNOWN) {
+            out.mode = DTTOIF(dtype);
+            return true;
+        }
+        
+        FE_PROBE(Stat);
+        if (!statxMissing.load(memory_order_relaxed)) {
+            struct statx stx;
+            if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, mask, &stx) == 0) {
+                out.mode = stx.stx_mode;
+                out.uid = stx.stx_uid;
+                out.gid = stx.stx_gid;
+                out.size = stx.stx_size;
+                out.blocks = stx.stx_blocks;
+                out.nlink = stx.stx_nlink;
+                out.ino = stx.stx_ino;
+                out.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+                out.mtime.tv_sec = stx.stx_mtime.tv_sec;
+                out.mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+                return true;
+            }
+            if (errno != ENOSYS) return false;
+            statxMissing.store(true, memory_order_relaxed);
+        }
+        
+        struct stat st;
+        if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return false;
+        fromStat(st, out);
+        return true;
+    }
+};
+
+atomic<bool> MetaFetcher::statxMissing{false};
+
+// Process-wide uid/gid -> name cache. With LDAP or SSSD behind NSS every
+// getpwuid can be a network round trip, so each id is resolved once and
+// kept in a flat open-addressing table (cache-friendly linear probing).
+// Entries can expire after a TTL so renamed accounts show up eventually.
+// Lookups take a shared lock and may run from any thread; prefetch()
+// resolves the distinct unknown ids of a whole listing concurrently.
+class IdNameCache {
+private:
+    struct Slot {
+        uint32_t id = 0;
+        bool used = false;
+        int64_t expires = 0;    // steady-clock seconds, 0 = never
+        string name;
+    };
+    
+    // One open-addressing table; capacity is a power of two
+    struct FlatTable {
+        vector<Slot> slots = vector<Slot>(64);
+        size_t count = 0;
+        
+        static size_t hash(uint32_t id) {
+            uint64_t h = id * 0x9E3779B97F4A7C15ULL;
+            return static_cast<size_t>(h >> 32);
+        }
+        
+        const Slot* find(uint32_t id) const {
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash(id) & mask;; i = (i + 1) & mask) {
+                const Slot& s = slots[i];
+                if (!s.used) return nullptr;
+                if (s.id == id) return &s;
+            }
+        }
+        
+        void insert(uint32_t id, string name, int64_t expires) {
+            if ((count + 1) * 10 > slots.size() * 7) grow();
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash(id) & mask;; i = (i + 1) & mask) {
+                Slot& s = slots[i];
+                if (s.used && s.id != id) continue;
+                if (!s.used) count++;
+                s.used = true;
+                s.id = id;
+                s.name = move(name);
+                s.expires = expires;
+                return;
+            }
+        }
+        
+        void grow() {
+            vector<Slot> old = move(slots);
+            slots = vector<Slot>(old.size() * 2);
+            count = 0;
+            for (auto& s : old) {
+                if (s.used) insert(s.id, move(s.name), s.expires);
+            }
+        }
+    };
+    
+    mutable shared_mutex mtx;
+    FlatTable users;
+    FlatTable groups;
+    int64_t ttlSeconds = 0;
+    
+    static int64_t nowSeconds() {
+        return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    static string lookupUser(uid_t uid) {
+        FE_PROBE(NameLookup);
+        struct passwd pw, *result = nullptr;
+        vector<char> buf(1024);
+        while (getpwuid_r(uid, &pw, buf.data(), buf.size(), &result) == ERANGE) buf.resize(buf.size() * 2);
+        return result ? string(result->pw_name) : to_string(uid);
+    }
+    
+    static string lookupGroup(gid_t gid) {
+        FE_PROBE(NameLookup);
+        struct group gr, *result = nullptr;
+        vector<char> buf(1024);
+        while (getgrgid_r(gid, &gr, buf.data(), buf.size(), &result) == ERANGE) buf.resize(buf.size() * 2);
+        return result ? string(result->gr_name) : to_string(gid);
+    }
+    
+    bool cached(const FlatTable& table, uint32_t id, string* out) const {
+        shared_lock<shared_mutex> lock(mtx);
+        const Slot* s = table.find(id);
+        if (!s || (s->expires && s->expires <= nowSeconds())) return false;
+        if (out) *out = s->name;
+        return true;
+    }
+    
+    void store(FlatTable& table, uint32_t id, string name) {
+        unique_lock<shared_mutex> lock(mtx);
+        table.insert(id, move(name), ttlSeconds ? nowSeconds() + ttlSeconds : 0);
+    }
+    
+    // Resolves ids missing from table, several NSS lookups at a time
+    template <typename Lookup>
+    void prefetchInto(FlatTable& table, vector<uint32_t> ids, Lookup lookup) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        ids.erase(remove_if(ids.begin(), ids.end(), [&](uint32_t id) { return cached(table, id, nullptr); }), ids.end());
+        if (ids.empty()) return;
+        
+        vector<string> names(ids.size());
+        atomic<size_t> next{0};
+        auto work = [&] {
+            size_t i;
+            while ((i = next.fetch_add(1)) < ids.size()) names[i] = lookup(ids[i]);
+        };
+        unsigned n = static_cast<unsigned>(min<size_t>(ids.size(), 8));
+        vector<thread> threads;
+        for (unsigned t = 1; t < n; t++) threads.emplace_back(work);
+        work();
+        for (auto& t : threads) t.join();
+        
+        unique_lock<shared_mutex> lock(mtx);
+        int64_t expires = ttlSeconds ? nowSeconds() + ttlSeconds : 0;
+        for (size_t i = 0; i < ids.size(); i++) table.insert(ids[i], move(names[i]), expires);
+    }
+    
+    IdNameCache() = default;
+    
+public:
+    static IdNameCache& instance() {
+        static IdNameCache cache;
+        return cache;
+    }
+    
+    // 0 keeps names forever
+    void setTtl(int64_t seconds) {
+        unique_lock<shared_mutex> lock(mtx);
+        ttlSeconds = seconds;
+    }
+    
+    string userName(uid_t uid) {
+        string name;
+        if (cached(users, uid, &name)) return name;
+        name = lookupUser(uid);
+        store(users, uid, name);
+        return name;
+    }
+    
+    string groupName(gid_t gid) {
+        string name;
+        if (cached(groups, gid, &name)) return name;
+        name = lookupGroup(gid);
+        store(groups, gid, name);
+        return name;
+    }
+    
+    void prefetch(vector<uint32_t> uids, vector<uint32_t> gids) {
+        prefetchInto(users, move(uids), lookupUser);
+        prefetchInto(groups, move(gids), lookupGroup);
+    }
+};
+
+// Buffered output renderer for large listings. Rows are formatted straight
+// into fixed-size blocks (std::to_chars for numbers, lookup tables for
+// permission strings) and the blocks go out with one writev per batch, so
+// a million-row listing costs a few hundred syscalls instead of one flush
+// per line. Color codes are dropped when the descriptor is not a terminal.
+class OutputBuffer {
+private:
+    static constexpr size_t kBlockSize = 64 << 10;
+    static constexpr size_t kBatchBlocks = 16;
+    
+    int fd;
+    bool colors;
+    vector<unique_ptr<char[]>> blocks;     // kept across batches and reused
+    size_t fills[kBatchBlocks] = {0};       // bytes used in each active block
+    size_t active = 0;          // blocks holding unwritten data
+    size_t used = 0;            // bytes used in the last active block
+    bool writeFailed = false;   // a write error dropped data, sticky
+    
+    // Cache for the last formatted timestamp; listings are often clustered
+    int64_t lastMinute = INT64_MIN;
+    char lastTime[20] = {0};
+    size_t lastTimeLen = 0;
+    
+    char* reserve(size_t n) {
+        if (active == 0 || used + n > kBlockSize) {
+            if (active > 0) fills[active - 1] = used;
+            if (active == kBatchBlocks) flush();
+            if (active == blocks.size()) blocks.push_back(make_unique<char[]>(kBlockSize));
+            active++;
+            used = 0;
+        }
+        return blocks[active - 1].get() + used;
+    }
+    
+public:
+    explicit OutputBuffer(int outFd = STDOUT_FILENO) : fd(outFd), colors(isatty(outFd)) {
+        // Anything already queued in iostreams must land first
+        cout.flush();
+    }
+    
+    ~OutputBuffer() {
+        flush();
+    }
+    
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    
+    bool colorEnabled() const {
+        return colors;
+    }
+    
+    void setColor(bool enabled) {
+        colors = enabled;
+    }
+    
+    OutputBuffer& put(const char* data, size_t n) {
+        while (n > 0) {
+            size_t chunk = min(n, kBlockSize);
+            char* dst = reserve(chunk);
+            memcpy(dst, data, chunk);
+            used += chunk;
+            data += chunk;
+            n -= chunk;
+        }
+        return *this;
+    }
+    
+    OutputBuffer& put(string_view s) {
+        return put(s.data(), s.size());
+    }
+    
+    OutputBuffer& put(char c) {
+        *reserve(1) = c;
+        used++;
+        return *this;
+    }
+    
+    OutputBuffer& fill(char c, size_t n) {
+        while (n > 0) {
+            size_t chunk = min(n, kBlockSize);
+            memset(reserve(chunk), c, chunk);
+            used += chunk;
+            n -= chunk;
+        }
+        return *this;
+    }
+    
+    // Writes s left-justified in a field of width columns (like setw + left)
+    OutputBuffer& padded(string_view s, size_t width) {
+        put(s);
+        if (s.size() < width) fill(' ', width - s.size());
+        return *this;
+    }
+    
+    OutputBuffer& color(const char* code) {
+        if (colors) put(string_view(code));
+        return *this;
+    }
+    
+    OutputBuffer& number(uint64_t v) {
+        char buf[24];
+        auto r = to_chars(buf, buf + sizeof(buf), v);
+        return put(buf, r.ptr - buf);
+    }
+    
+    // "12.34 KB" into buf, which must hold kSizeText bytes; returns the length
+    static constexpr size_t kSizeText = 48;
+    static size_t sizeText(uint64_t bytes, char* buf) {
+        static const char* const units[] = {"B", "KB", "MB", "GB", "TB"};
+        double d = static_cast<double>(bytes);
+        int unit = 0;
+        while (d >= 1024 && unit < 4) {
+            d /= 1024;
+            unit++;
+        }
+        auto r = to_chars(buf, buf + 32, d, chars_format::fixed, 2);
+        char* p = r.ptr;
+        *p++ = ' ';
+        for (const char* u = units[unit]; *u;) *p++ = *u++;
+        return p - buf;
+    }
+    
+    // "drwxr-xr-x" from a mode into buf[10], via a table of the eight rwx triplets
+    static void permissionText(mode_t mode, char* buf) {
+        static const char triplets[8][4] = {"---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx"};
+        buf[0] = S_ISDIR(mode) ? 'd' : (S_ISLNK(mode) ? 'l' : '-');
+        memcpy(buf + 1, triplets[(mode >> 6) & 7], 3);
+        memcpy(buf + 4, triplets[(mode >> 3) & 7], 3);
+        memcpy(buf + 7, triplets[mode & 7], 3);
+    }
+    
+    // The same texts as strings, for messages written through iostreams
+    static string sizeString(uint64_t bytes) {
+        char buf[kSizeText];
+        return string(buf, sizeText(bytes, buf));
+    }
+    
+    static string permissionString(mode_t mode) {
+        char buf[10];
+        permissionText(mode, buf);
+        return string(buf, 10);
+    }
+    
+    OutputBuffer& size(uint64_t bytes, size_t width = 0) {
+        char buf[kSizeText];
+        return padded(string_view(buf, sizeText(bytes, buf)), width);
+    }
+    
+    OutputBuffer& permissions(mode_t mode, size_t width = 0) {
+        char buf[10];
+        permissionText(mode, buf);
+        return padded(string_view(buf, 10), width);
+    }
+    
+    // "%Y-%m-%d %H:%M", reformatted only when the minute changes
+    OutputBuffer& minuteTime(time_t t, size_t width = 0) {
+        int64_t minute = t / 60;
+        if (minute != lastMinute) {
+            lastMinute = minute;
+            lastTimeLen = strftime(lastTime, sizeof(lastTime), "%Y-%m-%d %H:%M", localtime(&t));
+        }
+        return padded(string_view(lastTime, lastTimeLen), width);
+    }
+    
+    OutputBuffer& newline() {
+        return put('\n');
+    }
+    
+    // Writes every pending block with a single writev (more only if the
+    // kernel accepts a partial write). False once any write has failed,
+    // including those of flushes made while filling the buffer.
+    bool flush() {
+        if (active == 0) return !writeFailed;
+        fills[active - 1] = used;
+        struct iovec iov[kBatchBlocks];
+        for (size_t i = 0; i < active; i++) {
+            iov[i].iov_base = blocks[i].get();
+            iov[i].iov_len = fills[i];
+        }
+        FE_PROBE(Write);
+        size_t first = 0;
+        while (first < active) {
+            ssize_t n = writev(fd, iov + first, static_cast<int>(active - first));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                writeFailed = true;
+                break;
+            }
+            while (n > 0 && first < active) {
+                if (static_cast<size_t>(n) >= iov[first].iov_len) {
+                    n -= iov[first].iov_len;
+                    first++;
+                } else {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                    iov[first].iov_len -= n;
+                    n = 0;
+                }
+            }
+        }
+        active = 0;
+        used = 0;
+        return !writeFailed;
+    }
+};
+
+// Sorts an unbounded stream of records within a fixed memory budget. Once
+// the in-memory run reaches the budget it is sorted and spilled to an
+// unlinked temporary file; finish() then k-way merges the spilled runs and
+// the final in-memory run through a heap, reading each run through its own
+// small buffer. Records are compared bytewise and must not contain NUL.
+class ExternalSorter {
+private:
+    struct RunReader {
+        int fd = -1;
+        vector<char> buf;
+        size_t pos = 0;
+        size_t len = 0;
+        string record;
+        int error = 0;          // errno of a failed read
+        
+        bool next() {
+            record.clear();
+            while (true) {
+                if (pos >= len) {
+                    ssize_t n = read(fd, buf.data(), buf.size());
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n < 0) {
+                        // The rest of the run is lost; not the same as its end
+                        error = errno;
+                        return false;
+                    }
+                    if (n == 0) return !record.empty();
+                    pos = 0;
+                    len = n;
+                }
+                const char* start = buf.data() + pos;
+                const char* end = static_cast<const char*>(memchr(start, '\0', len - pos));
+                if (end) {
+                    record.append(start, end - start);
+                    pos += (end - start) + 1;
+                    return true;
+                }
+                record.append(start, len - pos);
+                pos = len;
+            }
+        }
+    };
+    
+    size_t budget;
+    vector<string> current;
+    size_t currentBytes = 0;
+    vector<int> runs;
+    size_t total = 0;
+    
+    // Merge state
+    vector<unique_ptr<RunReader>> readers;
+    size_t memPos = 0;
+    using HeapItem = pair<const string*, size_t>;   // record, source (SIZE_MAX = memory)
+    struct Greater {
+        bool operator()(const HeapItem& a, const HeapItem& b) const { return *a.first > *b.first; }
+    };
+    vector<HeapItem> heap;
+    size_t lastSource = SIZE_MAX - 1;
+    
+    bool spill() {
+        const char* dir = getenv("TMPDIR");
+        int fd = open(dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            // No anonymous temp files there: stay in memory for good rather
+            // than retrying (and re-sorting the growing run) on every add()
+            budget = SIZE_MAX;
+            return false;
+        }
+        {
+            FE_PROBE(Sort);
+            sort(current.begin(), current.end());
+        }
+        OutputBuffer out(fd);
+        out.setColor(false);
+        for (const auto& r : current) out.put(r).put('\0');
+        if (!out.flush()) {
+            // TMPDIR is full or failing: the records are still here, so
+            // keep them and stop spilling, as when the open fails
+            close(fd);
+            budget = SIZE_MAX;
+            return false;
+        }
+        lseek(fd, 0, SEEK_SET);
+        runs.push_back(fd);
+        current.clear();
+        currentBytes = 0;
+        return true;
+    }
+    
+    void advance(size_t source) {
+        if (source == SIZE_MAX) {
+            if (memPos < current.size()) {
+                heap.push_back({&current[memPos++], SIZE_MAX});
+                push_heap(heap.begin(), heap.end(), Greater());
+            }
+        } else if (readers[source]->next()) {
+            heap.push_back({&readers[source]->record, source});
+            push_heap(heap.begin(), heap.end(), Greater());
+        }
+    }
+    
+public:
+    explicit ExternalSorter(size_t memoryBudget = 64 << 20) : budget(memoryBudget) {}
+    
+    ~ExternalSorter() {
+        for (int fd : runs) close(fd);
+    }
+    
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+    
+    void add(string_view record) {
+        current.emplace_back(record);
+        currentBytes += record.size() + sizeof(string);
+        total++;
+        // If spilling fails we simply keep going in memory
+        if (currentBytes >= budget) spill();
+    }
+    
+    size_t size() const {
+        return total;
+    }
+    
+    size_t spilledRuns() const {
+        return runs.size();
+    }
+    
+    // errno of a spilled run that failed to read back (next() then ended
+    // early), or 0
+    int readError() const {
+        for (const auto& r : readers) {
+            if (r->error) return r->error;
+        }
+        return 0;
+    }
+    
+    // Ends input; records can then be pulled in order with next()
+    void finish() {
+        {
+            FE_PROBE(Sort);
+            sort(current.begin(), current.end());
+        }
+        for (int fd : runs) {
+            auto r = make_unique<RunReader>();
+            r->fd = fd;
+            r->buf.resize(256 << 10);
+            readers.push_back(move(r));
+        }
+        advance(SIZE_MAX);
+        for (size_t i = 0; i < readers.size(); i++) advance(i);
+    }
+    
+    // The returned view stays valid until the following call
+    bool next(string_view& out) {
+        // The source of the previous record is refilled lazily so its
+        // buffer is not overwritten while the caller still holds the view
+        if (lastSource != SIZE_MAX - 1) {
+            advance(lastSource);
+            lastSource = SIZE_MAX - 1;
+        }
+        if (heap.empty()) return false;
+        pop_heap(heap.begin(), heap.end(), Greater());
+        HeapItem top = heap.back();
+        heap.pop_back();
+        out = *top.first;
+        lastSource = top.second;
+        return true;
+    }
+};
+
+// Column store for one directory listing. Names are packed back to back in
+// a single arena and addressed by offset; the metadata a view fetched lives
+// in parallel arrays. Sorting and filtering work on index permutations, so
+// a captured snapshot can be re-ordered any number of times without
+// touching the filesystem again. Integer keys are LSD radix sorted; names
+// are radix sorted on an 8-byte prefix and only ties compare full strings.
+class DirSnapshot {
+public:
+    enum class Key { Name, Size, MTime, Owner, Group };
+    
+private:
+    string arena;
+    vector<uint32_t> offsets;   // size() + 1 entries, last one is arena.size()
+    vector<mode_t> modes;
+    vector<uint64_t> sizes;
+    vector<int64_t> mtimes;     // nanoseconds
+    vector<uint32_t> uids;
+    vector<uint32_t> gids;
+    vector<uint64_t> blockCounts;   // these three only when fetched
+    vector<uint32_t> linkCounts;
+    vector<uint64_t> inodes;
+    unsigned fieldMask = MetaFetcher::Type;
+    bool extended = false;
+    
+    // Stable LSD radix sort of perm by keys[perm[i]], one byte per pass.
+    // Passes where every key shares the same byte are skipped.
+    static void radixSort(vector<uint32_t>& perm, const vector<uint64_t>& keys) {
+        vector<uint32_t> scratch(perm.size());
+        for (unsigned shift = 0; shift < 64; shift += 8) {
+            size_t counts[257] = {0};
+            for (uint32_t i : perm) counts[((keys[i] >> shift) & 0xff) + 1]++;
+            bool trivial = false;
+            for (int b = 1; b <= 256; b++) {
+                if (counts[b] == perm.size()) trivial = true;
+            }
+            if (trivial) continue;
+            for (int b = 1; b <= 256; b++) counts[b] += counts[b - 1];
+            for (uint32_t i : perm) scratch[counts[(keys[i] >> shift) & 0xff]++] = i;
+            perm.swap(scratch);
+        }
+    }
+    
+    uint64_t nameKey(uint32_t i) const {
+        string_view n = name(i);
+        uint64_t key = 0;
+        for (size_t b = 0; b < 8; b++) {
+            key = (key << 8) | (b < n.size() ? static_cast<unsigned char>(n[b]) : 0);
+        }
+        return key;
+    }
+    
+    uint64_t sortKey(Key key, uint32_t i) const {
+        switch (key) {
+            case Key::Name: return nameKey(i);
+            case Key::Size: return sizes[i];
+            // Flip the sign bit so negative times order before positive ones
+            case Key::MTime: return static_cast<uint64_t>(mtimes[i]) ^ (1ULL << 63);
+            case Key::Owner: return uids[i];
+            case Key::Group: return gids[i];
+        }
+        return 0;
+    }
+    
+public:
+    DirSnapshot() {
+        offsets.push_back(0);
+    }
+    
+    // MetaFetcher fields the columns were filled from
+    unsigned fields() const { return fieldMask; }
+    void setFields(unsigned mask) {
+        fieldMask = mask;
+        unsigned extra = MetaFetcher::Blocks | MetaFetcher::Links | MetaFetcher::Inode;
+        extended = (mask & extra) == extra;
+    }
+    
+    bool hasFields(unsigned mask) const {
+        return (fieldMask & mask) == mask;
+    }
+    
+    // Approximate heap footprint, for cache budgeting
+    size_t memoryBytes() const {
+        return sizeof(*this) + arena.capacity() + offsets.capacity() * sizeof(uint32_t) +
+               modes.capacity() * sizeof(mode_t) + sizes.capacity() * sizeof(uint64_t) +
+               mtimes.capacity() * sizeof(int64_t) + (uids.capacity() + gids.capacity()) * sizeof(uint32_t) +
+               (blockCounts.capacity() + inodes.capacity()) * sizeof(uint64_t) + linkCounts.capacity() * sizeof(uint32_t);
+    }
+    
+    void clear() {
+        arena.clear();
+        offsets.assign(1, 0);
+        modes.clear();
+        sizes.clear();
+        mtimes.clear();
+        uids.clear();
+        gids.clear();
+        blockCounts.clear();
+        linkCounts.clear();
+        inodes.clear();
+    }
+    
+    void reserve(size_t entries, size_t nameBytes) {
+        arena.reserve(nameBytes);
+        offsets.reserve(entries + 1);
+        modes.reserve(entries);
+        sizes.reserve(entries);
+        mtimes.reserve(entries);
+        uids.reserve(entries);
+        gids.reserve(entries);
+        if (extended) {
+            blockCounts.reserve(entries);
+            linkCounts.reserve(entries);
+            inodes.reserve(entries);
+        }
+    }
+    
+    void add(string_view entryName, const EntryMeta& info) {
+        arena.append(entryName);
+        offsets.push_back(arena.size());
+        modes.push_back(info.mode);
+        sizes.push_back(info.size);
+        mtimes.push_back(static_cast<int64_t>(info.mtime.tv_sec) * 1000000000LL + info.mtime.tv_nsec);
+        uids.push_back(info.uid);
+        gids.push_back(info.gid);
+        if (extended) {
+            blockCounts.push_back(info.blocks);
+            linkCounts.push_back(info.nlink);
+            inodes.push_back(info.ino);
+        }
+    }
+    
+    size_t size() const {
+        return modes.size();
+    }
+    
+    bool empty() const {
+        return modes.empty();
+    }
+    
+    string_view name(uint32_t i) const {
+        return string_view(arena.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    
+    mode_t mode(uint32_t i) const { return modes[i]; }
+    uint64_t fileSize(uint32_t i) const { return sizes[i]; }
+    int64_t mtimeNs(uint32_t i) const { return mtimes[i]; }
+    uint32_t uid(uint32_t i) const { return uids[i]; }
+    uint32_t gid(uint32_t i) const { return gids[i]; }
+    
+    // Reassembles the row as an EntryMeta for renderers
+    EntryMeta meta(uint32_t i) const {
+        EntryMeta info;
+        info.mode = modes[i];
+        info.size = sizes[i];
+        info.uid = uids[i];
+        info.gid = gids[i];
+        info.mtime.tv_sec = mtimes[i] / 1000000000LL;
+        info.mtime.tv_nsec = mtimes[i] % 1000000000LL;
+        if (info.mtime.tv_nsec < 0) {
+            info.mtime.tv_sec--;
+            info.mtime.tv_nsec += 1000000000LL;
+        }
+        if (extended) {
+            info.blocks = blockCounts[i];
+            info.nlink = linkCounts[i];
+            info.ino = inodes[i];
+        }
+        return info;
+    }
+    
+    // Entries in capture order
+    vector<uint32_t> all() const {
+        vector<uint32_t> perm(size());
+        for (uint32_t i = 0; i < perm.size(); i++) perm[i] = i;
+        return perm;
+    }
+    
+    // Entries for which keep(i) is true, in capture order
+    template <typename Pred>
+    vector<uint32_t> select(Pred keep) const {
+        vector<uint32_t> perm;
+        for (uint32_t i = 0; i < size(); i++) {
+            if (keep(i)) perm.push_back(i);
+        }
+        return perm;
+    }
+    
+    // Stable-sorts a permutation in place. With dirsFirst, directories keep
+    // their relative order ahead of everything else.
+    void sort(vector<uint32_t>& perm, Key key, bool descending = false, bool dirsFirst = true) const {
+        FE_PROBE(Sort);
+        vector<uint64_t> keys(size());
+        for (uint32_t i : perm) {
+            uint64_t k = sortKey(key, i);
+            keys[i] = descending ? ~k : k;
+        }
+        radixSort(perm, keys);
+        
+        if (key == Key::Name) {
+            // Only names sharing an 8-byte prefix still need a real compare
+            for (size_t start = 0; start < perm.size();) {
+                size_t end = start + 1;
+                while (end < perm.size() && keys[perm[end]] == keys[perm[start]]) end++;
+                if (end - start > 1) {
+                    std::stable_sort(perm.begin() + start, perm.begin() + end, [&](uint32_t a, uint32_t b) {
+                        return descending ? name(b) < name(a) : name(a) < name(b);
+                    });
+                }
+                start = end;
+            }
+        }
+        
+        if (dirsFirst) {
+            stable_partition(perm.begin(), perm.end(), [&](uint32_t i) { return S_ISDIR(modes[i]); });
+        }
+    }
+};
+
+// LRU cache of directory snapshots keyed by (device, inode). An entry is
+// only served while the directory's mtime and ctime still match what was
+// recorded, so a revisit costs one fstat. Directories modified in the same
+// timestamp tick as their capture are not cached, since a later change in
+// that tick would be invisible. Note that edits to a file's contents do not
+// touch its directory; callers invalidate after their own operations.
+// Memory is bounded by a byte budget; the least recently used snapshots go
+// first. All methods are thread-safe.
+class ListingCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stale = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+    
+private:
+    struct Key {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const Key& o) const { return dev == o.dev && ino == o.ino; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return hash<uint64_t>()(static_cast<uint64_t>(k.ino) * 0x9e3779b97f4a7c15ULL ^ k.dev);
+        }
+    };
+    struct Slot {
+        Key key;
+        struct timespec mtime;
+        struct timespec ctime;
+        shared_ptr<const DirSnapshot> snap;
+        size_t bytes;
+    };
+    
+    mutable mutex mtx;
+    list<Slot> lru;             // front = most recently used
+    unordered_map<Key, list<Slot>::iterator, KeyHash> slots;
+    size_t budget;
+    size_t bytes = 0;
+    Stats counters;
+    
+    static bool sameTime(const struct timespec& a, const struct timespec& b) {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+    
+    void eraseLocked(list<Slot>::iterator it) {
+        bytes -= it->bytes;
+        slots.erase(it->key);
+        lru.erase(it);
+    }
+    
+    void trimLocked() {
+        while (bytes > budget && !lru.empty()) {
+            eraseLocked(prev(lru.end()));
+            counters.evictions++;
+        }
+    }
+    
+public:
+    explicit ListingCache(size_t byteBudget = 128 << 20) : budget(byteBudget) {}
+    
+    // Returns the cached snapshot for the directory open at fd if it is
+    // still current and carries the wanted fields; st receives the fstat
+    shared_ptr<const DirSnapshot> lookup(int fd, unsigned fields, struct stat& st) {
+        if (fstat(fd, &st) != 0) return nullptr;
+        lock_guard<mutex> lock(mtx);
+        auto it = slots.find(Key{st.st_dev, st.st_ino});
+        if (it == slots.end()) {
+            counters.misses++;
+            return nullptr;
+        }
+        Slot& slot = *it->second;
+        if (!sameTime(slot.mtime, st.st_mtim) || !sameTime(slot.ctime, st.st_ctim)) {
+            eraseLocked(it->second);
+            counters.stale++;
+            counters.misses++;
+            return nullptr;
+        }
+        if (!slot.snap->hasFields(fields)) {
+            counters.misses++;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        counters.hits++;
+        return slot.snap;
+    }
+    
+    // True if a current snapshot with the wanted fields is held for the
+    // directory described by st. Leaves the counters and LRU order alone.
+    bool holds(const struct stat& st, unsigned fields) const {
+        lock_guard<mutex> lock(mtx);
+        auto it = slots.find(Key{st.st_dev, st.st_ino});
+        if (it == slots.end()) return false;
+        const Slot& slot = *it->second;
+        return sameTime(slot.mtime, st.st_mtim) && sameTime(slot.ctime, st.st_ctim) && slot.snap->hasFields(fields);
+    }
+    
+    // Stores a snapshot taken of the directory described by st (fstat done
+    // before reading it). captureStart is the realtime clock at that point.
+    void store(const struct stat& st, const struct timespec& captureStart, shared_ptr<const DirSnapshot> snap) {
+        // Changed within the capture tick: a follow-up change could keep the same mtime
+        if (st.st_mtim.tv_sec >= captureStart.tv_sec || st.st_ctim.tv_sec >= captureStart.tv_sec) return;
+        size_t size = snap->memoryBytes();
+        lock_guard<mutex> lock(mtx);
+        if (size > budget) return;
+        
+        Key key{st.st_dev, st.st_ino};
+        auto it = slots.find(key);
+        if (it != slots.end()) eraseLocked(it->second);
+        lru.push_front(Slot{key, st.st_mtim, st.st_ctim, move(snap), size});
+        slots[key] = lru.begin();
+        bytes += size;
+        trimLocked();
+    }
+    
+    void invalidate(dev_t dev, ino_t ino) {
+        lock_guard<mutex> lock(mtx);
+        auto it = slots.find(Key{dev, ino});
+        if (it != slots.end()) eraseLocked(it->second);
+    }
+    
+    void invalidate(int dirFd, const char* path) {
+        struct stat st;
+        if (fstatat(dirFd, path, &st, 0) == 0) invalidate(st.st_dev, st.st_ino);
+    }
+    
+    void clear() {
+        lock_guard<mutex> lock(mtx);
+        lru.clear();
+        slots.clear();
+        bytes = 0;
+    }
+    
+    void setBudget(size_t byteBudget) {
+        lock_guard<mutex> lock(mtx);
+        budget = byteBudget;
+        trimLocked();
+    }
+    
+    Stats stats() const {
+        lock_guard<mutex> lock(mtx);
+        Stats s = counters;
+        s.entries = lru.size();
+        s.bytes = bytes;
+        s.budget = budget;
+        return s;
+    }
+};
+
+// Output encodings for listings and searches. Text is the coloured,
+// aligned display; the others are for programs: NUL-terminated names,
+// JSON Lines with every stat field that was fetched, and a binary stream
+// of length-prefixed records. Records are encoded directly into any sink
+// with put(string_view) and put(char) (OutputBuffer, or the arena batch a
+// worker thread hands on). JSON strings escape quotes, backslashes and
+// control bytes, and each byte that is not part of valid UTF-8 becomes
+// \ufffd; use the NUL or binary format where names must be exact.
+enum class OutputFormat { Text, Nul, JsonLines, Binary };
+
+struct RecordFormat {
+    // Binary stream: this 8-byte magic, then per entry a little-endian
+    // u32 length of the rest of the record, u32 mode, uid, gid, nlink,
+    // u64 size, blocks, inode, i64 mtime in ns, and the name bytes
+    static constexpr char kMagic[9] = "FEREC\x01\0\0";
+    static constexpr size_t kFixed = 4 * 4 + 8 * 4;
+    
+    static bool parse(const string& name, OutputFormat& format) {
+        if (name == "text") format = OutputFormat::Text;
+        else if (name == "nul" || name == "0") format = OutputFormat::Nul;
+        else if (name == "json" || name == "jsonl") format = OutputFormat::JsonLines;
+        else if (name == "binary" || name == "bin") format = OutputFormat::Binary;
+        else return false;
+        return true;
+    }
+    
+    template <class Sink>
+    static void number(Sink& out, int64_t v) {
+        char buf[24];
+        auto r = to_chars(buf, buf + sizeof(buf), v);
+        out.put(string_view(buf, r.ptr - buf));
+    }
+    
+    // Length of the well-formed UTF-8 sequence starting at s[i], or 0
+    // (overlong forms, surrogates and code points past U+10FFFF included)
+    static size_t utf8Length(string_view s, size_t i) {
+        auto byte = [&](size_t k) { return static_cast<unsigned char>(s[k]); };
+        unsigned char c = byte(i);
+        size_t len;
+        unsigned char lo = 0x80, hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) len = 2;
+        else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            if (c == 0xe0) lo = 0xa0;
+            else if (c == 0xed) hi = 0x9f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            if (c == 0xf0) lo = 0x90;
+            else if (c == 0xf4) hi = 0x8f;
+        } else {
+            return 0;
+        }
+        if (i + len > s.size()) return 0;
+        if (byte(i + 1) < lo || byte(i + 1) > hi) return 0;
+        for (size_t k = 2; k < len; k++) {
+            if ((byte(i + k) & 0xc0) != 0x80) return 0;
+        }
+        return len;
+    }
+    
+    template <class Sink>
+    static void jsonString(Sink& out, string_view s) {
+        static const char hex[] = "0123456789abcdef";
+        out.put('"');
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); i++) {
+            unsigned char c = s[i];
+            if (c >= 0x80) {
+                size_t len = utf8Length(s, i);
+                if (len > 0) {
+                    i += len - 1;
+                    continue;
+                }
+                out.put(s.substr(run, i - run));
+                run = i + 1;
+                out.put(string_view("\\ufffd", 6));
+                continue;
+            }
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            out.put(s.substr(run, i - run));
+            run = i + 1;
+            char esc[6] = {'\\', static_cast<char>(c), 0, 0, 0, 0};
+            size_t len = 2;
+            if (c == '\n') esc[1] = 'n';
+            else if (c == '\t') esc[1] = 't';
+            else if (c < 0x20) {
+                esc[1] = 'u';
+                esc[2] = esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 15];
+                len = 6;
+            }
+            out.put(string_view(esc, len));
+        }
+        out.put(s.substr(run));
+        out.put('"');
+    }
+    
+    static const char* typeName(mode_t mode) {
+        switch (mode & S_IFMT) {
+            case S_IFDIR: return "dir";
+            case S_IFREG: return "file";
+            case S_IFLNK: return "link";
+            case S_IFIFO: return "fifo";
+            case S_IFSOCK: return "socket";
+            case S_IFCHR: return "char";
+            case S_IFBLK: return "block";
+            default: return "unknown";
+        }
+    }
+    
+    template <class Sink>
+    static void nul(Sink& out, string_view name) {
+        out.put(name);
+        out.put('\0');
+    }
+    
+    // One JSON object and a newline; key is "name" or "path". fields says
+    // which MetaFetcher fields info holds; the rest are left out.
+    template <class Sink>
+    static void json(Sink& out, string_view key, string_view name, const EntryMeta& info, unsigned fields) {
+        out.put("{\"");
+        out.put(key);
+        out.put("\":");
+        jsonString(out, name);
+        out.put(",\"type\":\"");
+        out.put(string_view(typeName(info.mode)));
+        out.put('"');
+        auto field = [&](unsigned need, string_view label, int64_t v) {
+            if ((fields & need) != need) return;
+            out.put(label);
+            number(out, v);
+        };
+        field(MetaFetcher::Mode, ",\"mode\":", info.mode & 07777);
+        field(MetaFetcher::Size, ",\"size\":", info.size);
+        field(MetaFetcher::Blocks, ",\"blocks\":", info.blocks);
+        field(MetaFetcher::Links, ",\"nlink\":", info.nlink);
+        field(MetaFetcher::Inode, ",\"ino\":", info.ino);
+        field(STATX_UID, ",\"uid\":", info.uid);
+        field(STATX_GID, ",\"gid\":", info.gid);
+        field(MetaFetcher::MTime, ",\"mtime_ns\":", static_cast<int64_t>(info.mtime.tv_sec) * 1000000000LL + info.mtime.tv_nsec);
+        out.put("}\n");
+    }
+    
+    template <class Sink>
+    static void binary(Sink& out, string_view name, const EntryMeta& info) {
+        unsigned char rec[4 + kFixed];
+        size_t at = 0;
+        auto le = [&](uint64_t v, int bytes) {
+            for (int b = 0; b < bytes; b++) rec[at++] = static_cast<unsigned char>(v >> (8 * b));
+        };
+        le(kFixed + name.size(), 4);
+        le(info.mode, 4);
+        le(info.uid, 4);
+        le(info.gid, 4);
+        le(info.nlink, 4);
+        le(info.size, 8);
+        le(info.blocks, 8);
+        le(info.ino, 8);
+        le(static_cast<uint64_t>(static_cast<int64_t>(info.mtime.tv_sec) * 1000000000LL + info.mtime.tv_nsec), 8);
+        out.put(string_view(reinterpret_cast<const char*>(rec), sizeof(rec)));
+        out.put(name);
+    }
+};
+
+// Listing pipeline: reader -> metadata fetch -> filter -> sort -> render,
+// with each stage a policy type picked at compile time. A view bundles
+// one policy per stage; ListingPipeline<View> checks that the fetch
+// stage supplies every field the later stages read and instantiates one
+// loop for that combination, so the simple view is built without any
+// stat or NSS code in its path and a new view is a new typedef rather
+// than another branch per entry.
+//
+// Fetch policies: kFields (MetaFetcher bits they fill in), fetch().
+
+// File type from d_type; only filesystems that leave d_type unset pay
+// for a (type-only) statx, in an out-of-line fallback
+struct TypeFetch {
+    static constexpr unsigned kFields = MetaFetcher::Type;
+    
+    static bool fetch(int dirFd, const DirReader::Entry& entry, EntryMeta& out) {
+        if (__builtin_expect(entry.type != DT_UNKNOWN, 1)) {
+            out.mode = DTTOIF(entry.type);
+            return true;
+        }
+        return fallback(dirFd, entry.name.data(), out);
+    }
+    
+    __attribute__((noinline, cold)) static bool fallback(int dirFd, const char* name, EntryMeta& out) {
+        return MetaFetcher(kFields).fetch(dirFd, name, DT_UNKNOWN, out);
+    }
+};
+
+// statx asking for exactly Fields
+template <unsigned Fields>
+struct StatFetch {
+    static constexpr unsigned kFields = Fields | MetaFetcher::Type;
+    
+    static bool fetch(int dirFd, const DirReader::Entry& entry, EntryMeta& out) {
+        return MetaFetcher(kFields).fetch(dirFd, entry.name.data(), entry.type, out);
+    }
+};
+
+// Filter policies: a callable on (name, meta); kAll lets the pipeline skip
+// the selection pass entirely
+struct KeepAll {
+    static constexpr bool kAll = true;
+    bool operator()(string_view, const EntryMeta&) const { return true; }
+};
+
+// Keeps names containing a substring
+struct NameContains {
+    static constexpr bool kAll = false;
+    string text;
+    bool operator()(string_view name, const EntryMeta&) const { return name.find(text) != string_view::npos; }
+};
+
+// Order policies: kFields they sort on, arrange() over snapshot rows.
+// kSpillable orders can also be produced by the external sorter from
+// "0name"/"1name" records when a directory is too big to snapshot.
+struct NameOrder {
+    static constexpr unsigned kFields = MetaFetcher::Type;
+    static constexpr bool kSpillable = true;
+    static void arrange(const DirSnapshot& snap, vector<uint32_t>& rows) {
+        snap.sort(rows, DirSnapshot::Key::Name);
+    }
+};
+
+// Directory order, as captured
+struct CaptureOrder {
+    static constexpr unsigned kFields = 0;
+    static constexpr bool kSpillable = false;
+    static void arrange(const DirSnapshot&, vector<uint32_t>&) {}
+};
+
+// Largest first, directories on top
+struct SizeOrder {
+    static constexpr unsigned kFields = MetaFetcher::Size;
+    static constexpr bool kSpillable = false;
+    static void arrange(const DirSnapshot& snap, vector<uint32_t>& rows) {
+        snap.sort(rows, DirSnapshot::Key::Size, true);
+    }
+};
+
+// Row policies: kFields they print, kDecorated (banner and footer
+// around the rows), header(), prepare() before the rows of a snapshot are
+// rendered, and row()
+struct SimpleRows {
+    static constexpr unsigned kFields = MetaFetcher::Type;
+    static constexpr bool kDecorated = true;
+    
+    static void header(OutputBuffer&) {}
+    static void prepare(const DirSnapshot&, const vector<uint32_t>&) {}
+    
+    static void row(OutputBuffer& out, string_view name, const EntryMeta& info) {
+        if (S_ISDIR(info.mode)) {
+            out.color(BLUE).put("[DIR]  ").put(name).color(RESET).newline();
+        } else {
+            out.put("       ").put(name).newline();
+        }
+    }
+};
+
+// Permissions, owner, group, size, mtime and name
+struct DetailedRows {
+    static constexpr unsigned kFields = MetaFetcher::Mode | MetaFetcher::Owner | MetaFetcher::Size | MetaFetcher::MTime;
+    static constexpr bool kDecorated = true;
+    
+    static void header(OutputBuffer& out) {
+        out.padded("Permissions", 12)
+           .padded("Owner", 10)
+           .padded("Group", 10)
+           .padded("Size", 12)
+           .padded("Modified", 20)
+           .put("Name").newline();
+        out.fill('-', 80).newline();
+    }
+    
+    // Resolves every distinct owner and group once, up front
+    static void prepare(const DirSnapshot& snap, const vector<uint32_t>& rows) {
+        vector<uint32_t> uids, gids;
+        uids.reserve(rows.size());
+        gids.reserve(rows.size());
+        for (uint32_t i : rows) {
+            uids.push_back(snap.uid(i));
+            gids.push_back(snap.gid(i));
+        }
+        IdNameCache::instance().prefetch(move(uids), move(gids));
+    }
+    
+    static void row(OutputBuffer& out, string_view name, const EntryMeta& info) {
+        IdNameCache& ids = IdNameCache::instance();
+        const char* color = S_ISDIR(info.mode) ? BLUE
+                          : S_ISLNK(info.mode) ? CYAN
+                          : (info.mode & S_IXUSR ? GREEN : RESET);
+        
+        out.permissions(info.mode, 12)
+           .padded(ids.userName(info.uid), 10)
+           .padded(ids.groupName(info.gid), 10);
+        if (S_ISDIR(info.mode)) {
+            out.padded("<DIR>", 12);
+        } else {
+            out.size(info.size, 12);
+        }
+        out.minuteTime(info.mtime.tv_sec, 20)
+           .color(color).put(name).color(RESET).newline();
+    }
+};
+
+// Machine-readable rows: no banner, colour or padding
+struct NulRows {
+    static constexpr unsigned kFields = MetaFetcher::Type;
+    static constexpr bool kDecorated = false;
+    
+    static void header(OutputBuffer&) {}
+    static void prepare(const DirSnapshot&, const vector<uint32_t>&) {}
+    
+    static void row(OutputBuffer& out, string_view name, const EntryMeta&) {
+        RecordFormat::nul(out, name);
+    }
+};
+
+// Every stat field the machine formats carry
+constexpr unsigned kAllStatFields = DetailedRows::kFields | MetaFetcher::Blocks | MetaFetcher::Links | MetaFetcher::Inode;
+
+struct JsonRows {
+    static constexpr unsigned kFields = kAllStatFields;
+    static constexpr bool kDecorated = false;
+    
+    static void header(OutputBuffer&) {}
+    static void prepare(const DirSnapshot&, const vector<uint32_t>&) {}
+    
+    static void row(OutputBuffer& out, string_view name, const EntryMeta& info) {
+        RecordFormat::json(out, "name", name, info, kFields);
+    }
+};
+
+struct BinaryRows {
+    static constexpr unsigned kFields = kAllStatFields;
+    static constexpr bool kDecorated = false;
+    
+    static void header(OutputBuffer& out) {
+        out.put(string_view(RecordFormat::kMagic, 8));
+    }
+    static void prepare(const DirSnapshot&, const vector<uint32_t>&) {}
+    
+    static void row(OutputBuffer& out, string_view name, const EntryMeta& info) {
+        RecordFormat::binary(out, name, info);
+    }
+};
+
+template <class FetchPolicy, class OrderPolicy, class RowsPolicy>
+struct ListingView {
+    using Fetch = FetchPolicy;
+    using Order = OrderPolicy;
+    using Rows = RowsPolicy;
+};
+
+using SimpleListing = ListingView<TypeFetch, NameOrder, SimpleRows>;
+using DetailedListing = ListingView<StatFetch<DetailedRows::kFields>, CaptureOrder, DetailedRows>;
+using SizeListing = ListingView<StatFetch<DetailedRows::kFields>, SizeOrder, DetailedRows>;
+using NulListing = ListingView<TypeFetch, NameOrder, NulRows>;
+using JsonListing = ListingView<StatFetch<kAllStatFields>, NameOrder, JsonRows>;
+using BinaryListing = ListingView<StatFetch<kAllStatFields>, NameOrder, BinaryRows>;
+
+template <class View>
+class ListingPipeline {
+public:
+    using Fetch = typename View::Fetch;
+    using Order = typename View::Order;
+    using Rows = typename View::Rows;
+    
+    static constexpr unsigned kFields = Fetch::kFields;
+    static_assert((Order::kFields & ~kFields) == 0, "order policy sorts on a field the fetch policy does not supply");
+    static_assert((Rows::kFields & ~kFields) == 0, "row policy prints a field the fetch policy does not supply");
+    
+    // Name-only listings of huge directories go through the external sorter
+    static constexpr bool kSpillable = Order::kSpillable && kFields == MetaFetcher::Type;
+    
+    struct Context {
+        ListingCache& cache;
+        size_t sortBudget;
+        function<void(OutputBuffer&)> banner;   // printed before the column header of decorated rows
+    };
+    
+private:
+    template <class Filter>
+    static void renderRows(OutputBuffer& out, const DirSnapshot& snap, const Filter& filter) {
+        vector<uint32_t> rows = Filter::kAll ? snap.all()
+            : snap.select([&](uint32_t i) { return filter(snap.name(i), snap.meta(i)); });
+        Order::arrange(snap, rows);
+        Rows::prepare(snap, rows);
+        FE_PROBE(Format);
+        for (uint32_t i : rows) Rows::row(out, snap.name(i), snap.meta(i));
+    }
+    
+    // Moves what was captured so far into the sorter and frees the snapshot
+    static void spill(DirSnapshot& snap, ExternalSorter& sorted, string& record) {
+        for (uint32_t i = 0; i < snap.size(); i++) {
+            record.assign(1, S_ISDIR(snap.mode(i)) ? '0' : '1');
+            record.append(snap.name(i));
+            sorted.add(record);
+        }
+        snap.clear();
+    }
+    
+public:
+    // Lists the directory open as dirFd into out, served from the cache
+    // when it holds a current snapshot with the needed fields. Returns the
+    // snapshot that was shown, or null when the directory was streamed
+    // through the external sorter. ok is false if it cannot be read, or if
+    // a spilled run could not be read back and the listing is incomplete.
+    template <class Filter = KeepAll>
+    static shared_ptr<const DirSnapshot> run(int dirFd, Context& ctx, OutputBuffer& out, bool& ok,
+                                             const Filter& filter = Filter()) {
+        ok = true;
+        struct stat dirStat;
+        shared_ptr<const DirSnapshot> cached = ctx.cache.lookup(dirFd, kFields, dirStat);
+        if (cached) {
+            if (Rows::kDecorated) ctx.banner(out);
+            Rows::header(out);
+            renderRows(out, *cached, filter);
+            return cached;
+        }
+        
+        struct timespec captureStart;
+        clock_gettime(CLOCK_REALTIME, &captureStart);
+        DirReader reader;
+        if (!reader.openAt(dirFd, ".", true)) {
+            ok = false;
+            return nullptr;
+        }
+        if (Rows::kDecorated) ctx.banner(out);
+        Rows::header(out);
+        
+        auto snap = make_shared<DirSnapshot>();
+        snap->setFields(kFields);
+        size_t cacheLimit = ctx.cache.stats().budget / 4;
+        bool spilled = false;
+        unique_ptr<ExternalSorter> sorted;
+        string record;
+        
+        DirReader::Entry entry;
+        EntryMeta info;
+        while (reader.next(entry)) {
+            if (!Fetch::fetch(reader.fdNum(), entry, info)) continue;
+            if constexpr (kSpillable) {
+                if (spilled) {
+                    record.assign(1, S_ISDIR(info.mode) ? '0' : '1');
+                    record.append(entry.name);
+                    sorted->add(record);
+                    continue;
+                }
+                snap->add(entry.name, info);
+                if ((snap->size() & 1023) == 0 && snap->memoryBytes() > cacheLimit) {
+                    sorted = make_unique<ExternalSorter>(ctx.sortBudget);
+                    spill(*snap, *sorted, record);
+                    spilled = true;
+                }
+            } else {
+                snap->add(entry.name, info);
+            }
+        }
+        
+        if constexpr (kSpillable) {
+            if (spilled) {
+                // Merge the sorted runs and display
+                sorted->finish();
+                FE_PROBE(Format);
+                string_view r;
+                EntryMeta shown;
+                while (sorted->next(r)) {
+                    shown.mode = r[0] == '0' ? S_IFDIR : S_IFREG;
+                    if (filter(r.substr(1), shown)) Rows::row(out, r.substr(1), shown);
+                }
+                if (int err = sorted->readError()) {
+                    errno = err;
+                    ok = false;
+                }
+                return nullptr;
+            }
+        }
+        
+        renderRows(out, *snap, filter);
+        ctx.cache.store(dirStat, captureStart, snap);
+        return snap;
+    }
+    
+    // Reads the directory open as dirFd into the cache without showing it.
+    // Gives up, storing nothing, once stop() turns true or the snapshot
+    // outgrows what run() would cache. Returns true if a snapshot was stored.
+    template <class StopPolicy>
+    static bool capture(int dirFd, ListingCache& cache, StopPolicy stop) {
+        struct stat dirStat;
+        if (fstat(dirFd, &dirStat) != 0 || cache.holds(dirStat, kFields)) return false;
+        
+        struct timespec captureStart;
+        clock_gettime(CLOCK_REALTIME, &captureStart);
+        DirReader reader;
+        if (!reader.openAt(dirFd, ".", true)) return false;
+        
+        auto snap = make_shared<DirSnapshot>();
+        snap->setFields(kFields);
+        size_t cacheLimit = cache.stats().budget / 4;
+        DirReader::Entry entry;
+        EntryMeta info;
+        while (reader.next(entry)) {
+            if (stop()) return false;
+            if (!Fetch::fetch(reader.fdNum(), entry, info)) continue;
+            snap->add(entry.name, info);
+            if ((snap->size() & 1023) == 0 && snap->memoryBytes() > cacheLimit) return false;
+        }
+        if (stop()) return false;
+        cache.store(dirStat, captureStart, snap);
+        return true;
+    }
+    
+    // Rows in directory order as they are read, nothing held in memory.
+    // flushEvery() decides after each row whether to push output out now;
+    // more() is asked every pageSize rows (0: never) and ends the listing
+    // by returning false. Returns the number of rows shown.
+    template <class FlushPolicy>
+    static size_t stream(DirReader& reader, OutputBuffer& out, FlushPolicy flushEvery,
+                         size_t pageSize, const function<bool()>& more, bool& stopped) {
+        DirReader::Entry entry;
+        EntryMeta info;
+        size_t shown = 0, onPage = 0;
+        stopped = false;
+        while (reader.next(entry)) {
+            if (pageSize && onPage == pageSize) {
+                out.flush();
+                if (!more()) {
+                    stopped = true;
+                    break;
+                }
+                onPage = 0;
+            }
+            if (!Fetch::fetch(reader.fdNum(), entry, info)) continue;
+            Rows::row(out, entry.name, info);
+            onPage++;
+            if (flushEvery(++shown)) out.flush();
+        }
+        return shown;
+    }
+};
+
+// Warms the listing cache with the subdirectories of a listing while the
+// user is reading it, so the cd that usually follows lists from memory
+// instead of starting cold (worst on NFS). A few worker threads capture
+// detailed snapshots, which also serve the simple view, at idle I/O
+// priority so they only use the disk when nothing else wants it. Every
+// schedule() or cancel() starts a new generation: queued jobs are dropped
+// and a capture in flight stops at its next entry without storing.
+class ListingPrefetcher {
+public:
+    struct Stats {
+        uint64_t stored = 0;        // snapshots added to the cache
+        uint64_t skipped = 0;       // already cached, unreadable or too big
+        uint64_t cancelled = 0;     // dropped because the user moved on
+    };
+    
+    static constexpr size_t kMaxDirs = 64;      // subdirectories queued per listing
+    
+private:
+    using View = DetailedListing;
+    
+    // Descriptor of the listed directory, shared by its jobs
+    struct Parent {
+        int fd;
+        explicit Parent(int f) : fd(f) {}
+        ~Parent() { if (fd >= 0) ::close(fd); }
+    };
+    struct Job {
+        shared_ptr<Parent> parent;
+        string name;
+        uint64_t generation;
+    };
+    
+    ListingCache& cache;
+    mutable mutex mtx;
+    condition_variable wake;
+    deque<Job> queue;
+    vector<thread> workers;
+    atomic<uint64_t> generation{0};
+    bool stopping = false;
+    Stats counters;
+    
+    // Best effort: without ioprio_set the workers run at normal priority
+    static void lowerPriority() {
+        constexpr int kWhoProcess = 1, kClassIdle = 3, kClassShift = 13;
+        syscall(SYS_ioprio_set, kWhoProcess, 0, kClassIdle << kClassShift);
+    }
+    
+    void run() {
+        lowerPriority();
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            Job job = move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            
+            auto stale = [&] { return generation.load(memory_order_relaxed) != job.generation; };
+            bool stored = false;
+            int fd = openat(job.parent->fd, job.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                stored = ListingPipeline<View>::capture(fd, cache, stale);
+                ::close(fd);
+            }
+            bool dropped = stale();
+            job.parent.reset();
+            
+            lock.lock();
+            if (dropped) counters.cancelled++;
+            else if (stored) counters.stored++;
+            else counters.skipped++;
+        }
+    }
+    
+public:
+    explicit ListingPrefetcher(ListingCache& listingCache, unsigned threads = 2) : cache(listingCache) {
+        for (unsigned i = 0; i < max(1u, threads); i++) workers.emplace_back([this] { run(); });
+    }
+    
+    ~ListingPrefetcher() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+            queue.clear();
+        }
+        generation++;
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+    
+    ListingPrefetcher(const ListingPrefetcher&) = delete;
+    ListingPrefetcher& operator=(const ListingPrefetcher&) = delete;
+    
+    // Replaces any outstanding work with the subdirectories of snap, the
+    // listing just shown of the directory open as dirFd
+    void schedule(int dirFd, const DirSnapshot& snap) {
+        cancel();
+        int fd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) return;
+        auto parent = make_shared<Parent>(fd);
+        uint64_t gen = generation.load();
+        {
+            lock_guard<mutex> lock(mtx);
+            for (uint32_t i = 0; i < snap.size() && queue.size() < kMaxDirs; i++) {
+                string_view name = snap.name(i);
+                if (!S_ISDIR(snap.mode(i)) || name == "." || name == "..") continue;
+                queue.push_back(Job{parent, string(name), gen});
+            }
+        }
+        wake.notify_all();
+    }
+    
+    // Drops queued jobs and tells running captures to stop
+    void cancel() {
+        lock_guard<mutex> lock(mtx);
+        counters.cancelled += queue.size();
+        queue.clear();
+        generation++;
+    }
+    
+    Stats stats() const {
+        lock_guard<mutex> lock(mtx);
+        return counters;
+    }
+};
+
+// Compiled name pattern. A pattern is analysed once and reduced to the
+// cheapest test that decides it: exact, prefix, suffix or substring
+// compares for literals and simple globs, a token program for the rest of
+// glob syntax (*, ?, [a-z], [!x], backslash escapes), and POSIX extended
+// regex otherwise. Matching runs on the name bytes as they sit in the
+// dirent or index buffer; nothing is copied. Substring search uses an SSE2
+// first/last byte filter with a memcmp confirm. Case folding is ASCII only.
+// glibc serialises regexec on one regex_t, so threads should each compile
+// their own matcher when using regex syntax.
+class NameMatcher {
+public:
+    enum class Syntax { Substring, Glob, Regex };
+    
+private:
+    enum class Kind { All, Exact, Prefix, Suffix, PrefixSuffix, Contains, Program, Regex, Invalid };
+    enum TokenOp : unsigned char { Lit, Any, Class, Star };
+    struct Token {
+        TokenOp op;
+        unsigned char ch;
+        uint32_t cls;           // index into classes for Class tokens
+    };
+    
+    Kind kind = Kind::Invalid;
+    bool fold = false;
+    string prefix;              // literal parts, folded when fold is set
+    string suffix;
+    string needle;
+    vector<Token> program;
+    vector<array<uint64_t, 4>> classes;
+    regex_t regex;
+    bool regexCompiled = false;
+    string requiredText;        // literal every match must contain, for index prefiltering
+    string errorText;
+    
+    static unsigned char lower(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    }
+    
+    static string folded(string s) {
+        for (auto& c : s) c = lower(c);
+        return s;
+    }
+    
+    static bool sameBytes(const char* a, const char* b, size_t n, bool fold) {
+        if (!fold) return memcmp(a, b, n) == 0;
+        for (size_t i = 0; i < n; i++) {
+            if (lower(a[i]) != static_cast<unsigned char>(b[i])) return false;
+        }
+        return true;
+    }
+    
+    bool sameBytes(const char* a, const char* b, size_t n) const {
+        return sameBytes(a, b, n, fold);
+    }
+    
+    size_t find(const char* hay, size_t n) const {
+        return findLiteral(hay, n, needle.data(), needle.size(), fold);
+    }
+    
+    bool classHas(uint32_t cls, unsigned char c) const {
+        return (classes[cls][c >> 6] >> (c & 63)) & 1;
+    }
+    
+    // Iterative glob matching; a mismatch retries from the last star
+    bool runProgram(const char* s, size_t n) const {
+        size_t p = 0, i = 0;
+        size_t starP = SIZE_MAX, starI = 0;
+        while (i < n) {
+            if (p < program.size()) {
+                const Token& t = program[p];
+                unsigned char c = fold ? lower(s[i]) : s[i];
+                if (t.op == Star) {
+                    starP = p++;
+                    starI = i;
+                    continue;
+                }
+                if ((t.op == Lit && t.ch == c) || t.op == Any || (t.op == Class && classHas(t.cls, c))) {
+                    p++;
+                    i++;
+                    continue;
+                }
+            }
+            if (starP == SIZE_MAX) return false;
+            p = starP + 1;
+            i = ++starI;
+        }
+        while (p < program.size() && program[p].op == Star) p++;
+        return p == program.size();
+    }
+    
+    // Parses [...] at pattern[pos]; pos ends past the closing bracket
+    bool parseClass(const string& pat, size_t& pos, array<uint64_t, 4>& bits) {
+        bits = {0, 0, 0, 0};
+        size_t i = pos + 1;
+        bool negate = i < pat.size() && (pat[i] == '!' || pat[i] == '^');
+        if (negate) i++;
+        bool firstChar = true;
+        auto set = [&](unsigned char c) {
+            if (fold) c = lower(c);
+            bits[c >> 6] |= 1ULL << (c & 63);
+        };
+        while (i < pat.size() && (pat[i] != ']' || firstChar)) {
+            unsigned char lo = pat[i];
+            if (lo == '\\' && i + 1 < pat.size()) lo = pat[++i];
+            unsigned char hi = lo;
+            if (i + 2 < pat.size() && pat[i + 1] == '-' && pat[i + 2] != ']') {
+                hi = pat[i + 2];
+                i += 2;
+            }
+            for (unsigned c = lo; c <= hi; c++) set(static_cast<unsigned char>(c));
+            i++;
+            firstChar = false;
+        }
+        if (i >= pat.size()) return false;
+        if (negate) {
+            for (auto& w : bits) w = ~w;
+        }
+        pos = i + 1;
+        return true;
+    }
+    
+    void compileGlob(const string& pat) {
+        for (size_t i = 0; i < pat.size();) {
+            char c = pat[i];
+            if (c == '*') {
+                while (i < pat.size() && pat[i] == '*') i++;
+                program.push_back(Token{Star, 0, 0});
+            } else if (c == '?') {
+                program.push_back(Token{Any, 0, 0});
+                i++;
+            } else if (c == '[') {
+                array<uint64_t, 4> bits;
+                size_t next = i;
+                if (parseClass(pat, next, bits)) {
+                    classes.push_back(bits);
+                    program.push_back(Token{Class, 0, static_cast<uint32_t>(classes.size() - 1)});
+                    i = next;
+                } else {
+                    program.push_back(Token{Lit, static_cast<unsigned char>(fold ? lower('[') : '['), 0});
+                    i++;
+                }
+            } else {
+                if (c == '\\' && i + 1 < pat.size()) c = pat[++i];
+                program.push_back(Token{Lit, fold ? lower(c) : static_cast<unsigned char>(c), 0});
+                i++;
+            }
+        }
+        
+        // Longest literal run, which every match has to contain
+        string run;
+        for (size_t t = 0; t <= program.size(); t++) {
+            if (t < program.size() && program[t].op == Lit) {
+                run += static_cast<char>(program[t].ch);
+                continue;
+            }
+            if (run.size() > requiredText.size()) requiredText = run;
+            run.clear();
+        }
+        
+        // Reduce the common shapes to plain compares
+        auto literalBetween = [&](size_t from, size_t to, string& out) {
+            out.clear();
+            for (size_t t = from; t < to; t++) {
+                if (program[t].op != Lit) return false;
+                out += static_cast<char>(program[t].ch);
+            }
+            return true;
+        };
+        size_t stars = 0, starAt = 0;
+        for (size_t t = 0; t < program.size(); t++) {
+            if (program[t].op == Star) {
+                stars++;
+                starAt = t;
+            }
+        }
+        if (stars == 0 && literalBetween(0, program.size(), needle)) {
+            kind = Kind::Exact;
+        } else if (stars == 1 && literalBetween(0, starAt, prefix) && literalBetween(starAt + 1, program.size(), suffix)) {
+            kind = prefix.empty() ? (suffix.empty() ? Kind::All : Kind::Suffix)
+                 : (suffix.empty() ? Kind::Prefix : Kind::PrefixSuffix);
+        } else if (stars == 2 && program.front().op == Star && program.back().op == Star &&
+                   literalBetween(1, program.size() - 1, needle)) {
+            kind = Kind::Contains;
+        } else {
+            kind = Kind::Program;
+        }
+    }
+    
+    // Longest literal run outside groups and not made optional by a
+    // quantifier; empty when alternation makes nothing mandatory
+    static string regexLiteral(const string& pat) {
+        if (pat.find('|') != string::npos) return "";
+        string best, run;
+        int depth = 0;
+        auto close = [&]() {
+            if (run.size() > best.size()) best = run;
+            run.clear();
+        };
+        for (size_t i = 0; i < pat.size(); i++) {
+            char c = pat[i];
+            if (c == '(') { depth++; close(); continue; }
+            if (c == ')') { depth--; close(); continue; }
+            if (depth > 0) continue;
+            if (c == '*' || c == '?' || c == '{' || c == '+') {
+                if (c != '+' && !run.empty()) run.pop_back();
+                close();
+                if (c == '{') {
+                    while (i < pat.size() && pat[i] != '}') i++;
+                }
+                continue;
+            }
+            if (c == '[') {
+                close();
+                i++;
+                if (i < pat.size() && pat[i] == '^') i++;
+                if (i < pat.size() && pat[i] == ']') i++;
+                while (i < pat.size() && pat[i] != ']') i++;
+                continue;
+            }
+            if (c == '.' || c == '^' || c == '$') { close(); continue; }
+            if (c == '\\' && i + 1 < pat.size()) {
+                c = pat[++i];
+                if (isalnum(static_cast<unsigned char>(c))) { close(); continue; }
+            }
+            run += c;
+        }
+        close();
+        return best;
+    }
+    
+public:
+    // Position of needle in hay, or npos. With fold, needle must already be
+    // lower case and hay is compared ASCII case-insensitively.
+    static size_t findLiteral(const char* hay, size_t n, const char* nd, size_t m, bool fold) {
+        if (m == 0) return 0;
+        if (n < m) return string_view::npos;
+        size_t i = 0;
+#if defined(__SSE2__)
+        if (m > 1) {
+            unsigned char f = nd[0], l = nd[m - 1];
+            __m128i first = _mm_set1_epi8(f), last = _mm_set1_epi8(l);
+            __m128i firstAlt = _mm_set1_epi8(fold && f >= 'a' && f <= 'z' ? f - 32 : f);
+            __m128i lastAlt = _mm_set1_epi8(fold && l >= 'a' && l <= 'z' ? l - 32 : l);
+            for (; i + m - 1 + 16 <= n; i += 16) {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay + i + m - 1));
+                __m128i hitA = _mm_or_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(a, firstAlt));
+                __m128i hitB = _mm_or_si128(_mm_cmpeq_epi8(b, last), _mm_cmpeq_epi8(b, lastAlt));
+                unsigned mask = _mm_movemask_epi8(_mm_and_si128(hitA, hitB));
+                while (mask) {
+                    unsigned bit = __builtin_ctz(mask);
+                    if (sameBytes(hay + i + bit + 1, nd + 1, m - 2, fold)) return i + bit;
+                    mask &= mask - 1;
+                }
+            }
+        }
+#endif
+        if (!fold) {
+            // Short inputs and tails: memchr for the first byte, memcmp the rest
+            while (i + m <= n) {
+                const char* p = static_cast<const char*>(memchr(hay + i, nd[0], n - m + 1 - i));
+                if (!p) return string_view::npos;
+                if (memcmp(p + 1, nd + 1, m - 1) == 0) return p - hay;
+                i = p - hay + 1;
+            }
+            return string_view::npos;
+        }
+        for (; i + m <= n; i++) {
+            if (sameBytes(hay + i, nd, m, true)) return i;
+        }
+        return string_view::npos;
+    }
+    
+    static string lowerCase(string s) {
+        return folded(move(s));
+    }
+    
+    explicit NameMatcher(const string& pattern, Syntax syntax = Syntax::Substring, bool ignoreCase = false)
+        : fold(ignoreCase) {
+        switch (syntax) {
+            case Syntax::Substring:
+                needle = fold ? folded(pattern) : pattern;
+                requiredText = needle;
+                kind = needle.empty() ? Kind::All : Kind::Contains;
+                break;
+            case Syntax::Glob:
+                compileGlob(pattern);
+                break;
+            case Syntax::Regex: {
+                int flags = REG_EXTENDED | REG_NOSUB | (fold ? REG_ICASE : 0);
+                int rc = regcomp(&regex, pattern.c_str(), flags);
+                if (rc != 0) {
+                    char buf[256];
+                    regerror(rc, &regex, buf, sizeof(buf));
+                    errorText = buf;
+                    kind = Kind::Invalid;
+                    return;
+                }
+                regexCompiled = true;
+                needle = regexLiteral(pattern);
+                if (fold) needle = folded(needle);
+                requiredText = needle;
+                kind = Kind::Regex;
+                break;
+            }
+        }
+    }
+    
+    ~NameMatcher() {
+        if (regexCompiled) regfree(&regex);
+    }
+    
+    NameMatcher(const NameMatcher&) = delete;
+    NameMatcher& operator=(const NameMatcher&) = delete;
+    
+    bool ok() const {
+        return kind != Kind::Invalid;
+    }
+    
+    const string& error() const {
+        return errorText;
+    }
+    
+    // A literal every matching name contains; compared case-insensitively
+    // when foldsCase() is true. Empty if the pattern has none.
+    const string& requiredLiteral() const {
+        return requiredText;
+    }
+    
+    bool foldsCase() const {
+        return fold;
+    }
+    
+    bool matches(string_view name) const {
+        const char* s = name.data();
+        size_t n = name.size();
+        switch (kind) {
+            case Kind::All:
+                return true;
+            case Kind::Exact:
+                return n == needle.size() && sameBytes(s, needle.data(), n);
+            case Kind::Prefix:
+                return n >= prefix.size() && sameBytes(s, prefix.data(), prefix.size());
+            case Kind::Suffix:
+                return n >= suffix.size() && sameBytes(s + n - suffix.size(), suffix.data(), suffix.size());
+            case Kind::PrefixSuffix:
+                return n >= prefix.size() + suffix.size() && sameBytes(s, prefix.data(), prefix.size()) &&
+                       sameBytes(s + n - suffix.size(), suffix.data(), suffix.size());
+            case Kind::Contains:
+                return find(s, n) != string_view::npos;
+            case Kind::Program:
+                return runProgram(s, n);
+            case Kind::Regex: {
+                if (!needle.empty() && find(s, n) == string_view::npos) return false;
+                // REG_STARTEND bounds the match, so the name needs no terminator
+                regmatch_t range[1];
+                range[0].rm_so = 0;
+                range[0].rm_eo = n;
+                return regexec(&regex, s, 1, range, REG_STARTEND) == 0;
+            }
+            case Kind::Invalid:
+                return false;
+        }
+        return false;
+    }
+};
+
+// Listing filter policy (see NameContains) keeping names a pattern matches
+struct NameMatches {
+    static constexpr bool kAll = false;
+    const NameMatcher& matcher;
+    bool operator()(string_view name, const EntryMeta&) const { return matcher.matches(name); }
+};
+
+// Bump allocator over chunks that double from 4 KiB up to 64 KiB, so
+// small arenas stay small. Allocation is a pointer increment;
+// nothing is freed individually and everything goes at once when the
+// arena is released or destroyed. Chunks never move, so pointers and
+// views into the arena stay valid until then. One arena is used by one
+// thread at a time. A piece of unknown length can be built in place
+// between begin() and end(); if it outgrows the chunk it is moved once.
+class BumpArena {
+private:
+    static constexpr size_t kFirstChunk = 4 << 10;
+    static constexpr size_t kMaxChunk = 64 << 10;
+    static_assert(kFirstChunk << 4 == kMaxChunk, "grow() doubles the first chunk four times");
+    
+    vector<unique_ptr<char[]>> chunks;
+    char* cur = nullptr;
+    size_t used = 0;
+    size_t cap = 0;
+    size_t openStart = 0;
+    bool building = false;
+    size_t reserved = 0;
+    
+    void grow(size_t need) {
+        size_t keep = building ? used - openStart : 0;
+        // Doubling stops at kMaxChunk; shifting further would overflow
+        size_t step = chunks.size() < 4 ? kFirstChunk << chunks.size() : kMaxChunk;
+        size_t size = max(step, keep + need);
+        unique_ptr<char[]> chunk(new char[size]);
+        if (keep) memcpy(chunk.get(), cur + openStart, keep);
+        chunks.push_back(move(chunk));
+        cur = chunks.back().get();
+        cap = size;
+        used = keep;
+        openStart = 0;
+        reserved += size;
+    }
+    
+public:
+    BumpArena() = default;
+    
+    // The moved-from arena is left empty and usable
+    BumpArena(BumpArena&& other) noexcept {
+        *this = move(other);
+    }
+    
+    BumpArena& operator=(BumpArena&& other) noexcept {
+        chunks = move(other.chunks);
+        cur = other.cur;
+        used = other.used;
+        cap = other.cap;
+        openStart = other.openStart;
+        building = other.building;
+        reserved = other.reserved;
+        other.chunks.clear();
+        other.cur = nullptr;
+        other.used = other.cap = other.openStart = other.reserved = 0;
+        other.building = false;
+        return *this;
+    }
+    
+    void* allocate(size_t n, size_t align = alignof(max_align_t)) {
+        size_t pad = (align - (reinterpret_cast<uintptr_t>(cur + used) & (align - 1))) & (align - 1);
+        if (cap - used < n + pad) {
+            grow(n + align);
+            pad = (align - (reinterpret_cast<uintptr_t>(cur + used) & (align - 1))) & (align - 1);
+        }
+        void* p = cur + used + pad;
+        used += pad + n;
+        return p;
+    }
+    
+    string_view copy(string_view s) {
+        char* p = static_cast<char*>(allocate(s.size(), 1));
+        memcpy(p, s.data(), s.size());
+        return string_view(p, s.size());
+    }
+    
+    void begin() {
+        openStart = used;
+        building = true;
+    }
+    
+    void put(string_view s) {
+        if (cap - used < s.size()) grow(s.size());
+        memcpy(cur + used, s.data(), s.size());
+        used += s.size();
+    }
+    
+    void put(char c) {
+        if (cap == used) grow(1);
+        cur[used++] = c;
+    }
+    
+    string_view end() {
+        building = false;
+        return string_view(cur + openStart, used - openStart);
+    }
+    
+    // Bytes of chunk memory held
+    size_t bytes() const { return reserved; }
+    
+    void release() {
+        chunks.clear();
+        cur = nullptr;
+        used = cap = reserved = 0;
+        building = false;
+    }
+};
+
+// Walker results in bulk: each result is a view into the batch's own
+// arena, so producing one costs a bump allocation instead of a heap string
+// and a batch (with everything in it) is freed in one go.
+class ResultBatch {
+private:
+    BumpArena arena;
+    vector<string_view> items;
+    
+public:
+    ResultBatch() = default;
+    
+    ResultBatch(ResultBatch&& other) noexcept : arena(move(other.arena)), items(move(other.items)) {
+        other.items.clear();
+    }
+    
+    ResultBatch& operator=(ResultBatch&& other) noexcept {
+        arena = move(other.arena);
+        items = move(other.items);
+        other.items.clear();
+        return *this;
+    }
+    
+    // Appends the concatenation of parts as one result
+    void add(initializer_list<string_view> parts) {
+        arena.begin();
+        for (string_view p : parts) arena.put(p);
+        items.push_back(arena.end());
+    }
+    
+    // Builds one result from arbitrary put() calls (any RecordFormat sink)
+    void begin() { arena.begin(); }
+    void put(string_view s) { arena.put(s); }
+    void put(char c) { arena.put(c); }
+    void end() { items.push_back(arena.end()); }
+    
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    const vector<string_view>& results() const { return items; }
+    
+    void clear() {
+        items.clear();
+        arena.release();
+    }
+};
+
+// Entry handed to a walker visitor. dirPath and name are only valid for the
+// duration of the callback.
+struct WalkEntry {
+    const string& dirPath;
+    string_view name;       // NUL-terminated
+    unsigned char type;     // d_type from the directory entry
+    unsigned depth;         // 0 for entries directly inside the root
+    unsigned worker;        // index of the worker thread running the visitor
+    int dirFd;              // open descriptor of dirPath, for *at() calls
+};
+
+// Collects results produced by walker threads and hands them to a consumer
+// running on the calling thread. Workers push batches so the lock is taken
+// once per batch, not once per result. In ordered mode everything is held
+// back and sorted so repeated runs print the same sequence.
+class ResultMerger {
+private:
+    mutex mtx;
+    condition_variable cv;
+    deque<ResultBatch> batches;
+    bool finished = false;
+    bool ordered;
+    
+public:
+    explicit ResultMerger(bool ordered) : ordered(ordered) {}
+    
+    // Takes over batch's results (and their memory); batch is left empty
+    void push(ResultBatch&& batch) {
+        if (batch.empty()) return;
+        {
+            lock_guard<mutex> lock(mtx);
+            batches.push_back(move(batch));
+        }
+        cv.notify_one();
+    }
+    
+    void finish() {
+        {
+            lock_guard<mutex> lock(mtx);
+            finished = true;
+        }
+        cv.notify_one();
+    }
+    
+    // Blocks until finish() is called, feeding every result to consume.
+    // Returns the number of results delivered. In ordered mode the batches
+    // are kept until the end and only their views are sorted; all result
+    // memory is released together when drain returns.
+    size_t drain(const function<void(string_view)>& consume) {
+        size_t count = 0;
+        vector<ResultBatch> held;
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return finished || !batches.empty(); });
+            while (!batches.empty()) {
+                ResultBatch batch = move(batches.front());
+                batches.pop_front();
+                lock.unlock();
+                if (ordered) {
+                    held.push_back(move(batch));
+                } else {
+                    for (string_view r : batch.results()) consume(r);
+                    count += batch.size();
+                }
+                lock.lock();
+            }
+            if (finished && batches.empty()) break;
+        }
+        lock.unlock();
+        
+        if (ordered) {
+            vector<string_view> all;
+            for (const auto& b : held) all.insert(all.end(), b.results().begin(), b.results().end());
+            sort(all.begin(), all.end());
+            for (string_view r : all) consume(r);
+            count += all.size();
+        }
+        return count;
+    }
+};
+
+// Parallel directory walker. Each worker owns a deque of pending directories:
+// it pushes and pops at the back (depth-first, good locality) and, when its
+// own deque runs dry, steals from the front of another worker's deque.
+// Shared by every recursive operation in FileExplorer.
+class ParallelWalker {
+public:
+    // Return true from the visitor to descend into a directory entry.
+    using Visitor = function<bool(const WalkEntry&)>;
+    // Called on the worker that is about to list a directory, before any of
+    // its entries are visited (and again after the last one when passed as
+    // leaveDir). depth is the depth its entries will carry.
+    using DirHook = function<void(const string& path, unsigned depth, unsigned worker, int dirFd)>;
+    // Extra work queued with spawn(); runs on whichever worker gets to it
+    using Task = function<void(unsigned worker)>;
+    // Called by walkTree() once a directory and everything below it have
+    // been walked, with the descriptor of its parent and its name
+    using DoneHook = function<void(int parentFd, const char* name)>;
+    
+private:
+    // A queued directory: its name and a pointer to its parent, allocated
+    // in the arena of the worker that found it. Full paths are spelled out
+    // only when a directory is opened, into that worker's reused buffer.
+    struct PathNode {
+        const PathNode* parent;
+        const char* name;       // NUL-terminated
+        uint32_t nameLen;
+        uint32_t pathLen;       // length of the full path
+        bool slash;             // a '/' separates name from the parent's path
+    };
+    
+    // An open directory, shared by the subdirectories queued from it so each
+    // is opened relative to it with O_NOFOLLOW: a directory swapped for a
+    // symlink mid-walk is never entered. The last reference goes once the
+    // directory and everything below it have been walked.
+    struct DirRef {
+        int fd = -1;
+        shared_ptr<DirRef> parent;
+        const char* name = nullptr;
+        const DoneHook* done = nullptr;
+        ~DirRef() {
+            if (fd >= 0) close(fd);
+            if (done && parent) (*done)(parent->fd, name);
+        }
+    };
+    
+    struct WorkItem {
+        const PathNode* node = nullptr;
+        unsigned depth = 0;
+        Task task;          // set for spawned tasks instead of a directory
+        shared_ptr<DirRef> parent;      // unset only for the root of walk()
+    };
+    
+    struct WorkQueue {
+        mutex mtx;
+        deque<WorkItem> items;
+    };
+    
+    unsigned threadCount;
+    vector<WorkQueue> queues;
+    vector<unique_ptr<DirReader>> readers;
+    vector<BumpArena> arenas;       // per worker, released after each walk
+    vector<string> dirPaths;        // per worker, path of the open directory
+    atomic<size_t> pending{0};      // queued or running items
+    atomic<size_t> queued{0};       // items sitting in some deque
+    // Idle workers sleep here until a push or the end of the walk; pushers
+    // only take the lock when someone sleeps
+    mutex idleMtx;
+    condition_variable idleCv;
+    atomic<unsigned> sleepers{0};
+    const DirHook* enterHook = nullptr;
+    const DirHook* leaveHook = nullptr;
+    const DoneHook* doneHook = nullptr;
+    MetaFetcher typeFetcher{MetaFetcher::Type};
+    
+    bool popLocal(unsigned self, WorkItem& out) {
+        WorkQueue& q = queues[self];
+        lock_guard<mutex> lock(q.mtx);
+        if (q.items.empty()) return false;
+        out = move(q.items.back());
+        q.items.pop_back();
+        queued.fetch_sub(1);
+        return true;
+    }
+    
+    bool steal(unsigned self, WorkItem& out) {
+        for (unsigned i = 1; i < threadCount; i++) {
+            WorkQueue& q = queues[(self + i) % threadCount];
+            lock_guard<mutex> lock(q.mtx);
+            if (q.items.empty()) continue;
+            out = move(q.items.front());
+            q.items.pop_front();
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+    
+    void push(unsigned self, WorkItem&& item) {
+        pending.fetch_add(1, memory_order_relaxed);
+        {
+            WorkQueue& q = queues[self];
+            lock_guard<mutex> lock(q.mtx);
+            q.items.push_back(move(item));
+            queued.fetch_add(1);
+        }
+        wake(false);
+    }
+    
+    // The counter a sleeper waits on was changed before this is called; a
+    // sleeper checks it after announcing itself, so one side always sees
+    // the other and no wakeup is lost
+    void wake(bool all) {
+        if (sleepers.load() == 0) return;
+        { lock_guard<mutex> lock(idleMtx); }
+        if (all) idleCv.notify_all();
+        else idleCv.notify_one();
+    }
+    
+    const PathNode* makeNode(unsigned self, const PathNode* parent, string_view name) {
+        BumpArena& arena = arenas[self];
+        PathNode* node = static_cast<PathNode*>(arena.allocate(sizeof(PathNode), alignof(PathNode)));
+        char* copy = static_cast<char*>(arena.allocate(name.size() + 1, 1));
+        memcpy(copy, name.data(), name.size());
+        copy[name.size()] = '\0';
+        node->parent = parent;
+        node->name = copy;
+        node->nameLen = name.size();
+        node->slash = parent && parent->pathLen > 0 && parent->name[parent->nameLen - 1] != '/';
+        node->pathLen = (parent ? parent->pathLen + node->slash : 0) + name.size();
+        return node;
+    }
+    
+    static void spell(const PathNode* node, string& out) {
+        out.resize(node->pathLen);
+        size_t pos = node->pathLen;
+        for (const PathNode* n = node; n; n = n->parent) {
+            pos -= n->nameLen;
+            memcpy(&out[pos], n->name, n->nameLen);
+            if (n->slash) out[--pos] = '/';
+        }
+    }
+    
+    // Takes over item's parent reference, so the DirRef chain stays intact
+    shared_ptr<DirRef> share(WorkItem& item, int fd) {
+        auto ref = make_shared<DirRef>();
+        ref->fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+        ref->parent = move(item.parent);
+        ref->name = item.node->name;
+        ref->done = doneHook;
+        return ref;
+    }
+    
+    void processDirectory(unsigned self, WorkItem& item, const Visitor& visit) {
+        DirReader& reader = *readers[self];
+        string& path = dirPaths[self];
+        spell(item.node, path);
+        // Only the root of walk() is opened by path
+        bool opened = item.parent ? reader.openAt(item.parent->fd, item.node->name) : reader.open(path);
+        shared_ptr<DirRef> ref;
+        if (doneHook) ref = share(item, opened ? reader.fdNum() : -1);
+        if (!opened) return;
+        if (enterHook && *enterHook) (*enterHook)(path, item.depth, self, reader.fdNum());
+        
+        DirReader::Entry entry;
+        while (reader.next(entry)) {
+            if (entry.type == DT_UNKNOWN) {
+                // Some filesystems don't fill d_type; a type-only statx settles it
+                EntryMeta info;
+                if (typeFetcher.fetch(reader.fdNum(), entry.name.data(), DT_UNKNOWN, info)) {
+                    entry.type = IFTODT(info.mode);
+                }
+            }
+            WalkEntry e{path, entry.name, entry.type, item.depth, self, reader.fdNum()};
+            if (visit(e) && entry.type == DT_DIR) {
+                if (!ref) ref = share(item, reader.fdNum());
+                push(self, WorkItem{makeNode(self, item.node, entry.name), item.depth + 1, nullptr, ref});
+            }
+        }
+        if (leaveHook && *leaveHook) (*leaveHook)(path, item.depth, self, reader.fdNum());
+        reader.close();
+    }
+    
+    void workerLoop(unsigned self, const Visitor& visit) {
+        WorkItem item;
+        while (true) {
+            if (popLocal(self, item) || steal(self, item)) {
+                if (item.task) {
+                    item.task(self);
+                    item.task = nullptr;
+                } else {
+                    processDirectory(self, item, visit);
+                    item.parent.reset();
+                }
+                if (pending.fetch_sub(1) == 1) wake(true);
+                continue;
+            }
+            if (pending.load() == 0) break;
+            // Someone is still expanding a directory; sleep until it queues
+            // more or the walk ends
+            unique_lock<mutex> lock(idleMtx);
+            sleepers.fetch_add(1);
+            idleCv.wait(lock, [this] { return queued.load() > 0 || pending.load() == 0; });
+            sleepers.fetch_sub(1);
+        }
+    }
+    
+    void run(WorkItem&& root, const Visitor& visit, const DirHook& enterDir, const DirHook& leaveDir) {
+        enterHook = &enterDir;
+        leaveHook = &leaveDir;
+        push(0, move(root));
+        
+        vector<thread> threads;
+        for (unsigned i = 1; i < threadCount; i++) {
+            threads.emplace_back(&ParallelWalker::workerLoop, this, i, cref(visit));
+        }
+        workerLoop(0, visit);
+        for (auto& t : threads) t.join();
+        enterHook = nullptr;
+        leaveHook = nullptr;
+        for (auto& arena : arenas) arena.release();
+    }
+    
+public:
+    explicit ParallelWalker(unsigned threads = 0) {
+        threadCount = threads ? threads : thread::hardware_concurrency();
+        if (threadCount == 0) threadCount = 1;
+        queues = vector<WorkQueue>(threadCount);
+        arenas = vector<BumpArena>(threadCount);
+        dirPaths = vector<string>(threadCount);
+        for (unsigned i = 0; i < threadCount; i++) {
+            readers.push_back(make_unique<DirReader>(256 << 10));
+        }
+    }
+    
+    unsigned workers() const {
+        return threadCount;
+    }
+    
+    // Queues a task on the given worker's deque, from inside a visitor, hook
+    // or another task. Idle workers steal tasks just like directories, so
+    // per-file work fans out across the pool. The walk waits for all tasks.
+    void spawn(unsigned worker, Task task) {
+        push(worker, WorkItem{nullptr, 0, move(task), nullptr});
+    }
+    
+    // Walks everything below root, calling visit from worker threads.
+    // Returns once the whole tree has been visited.
+    void walk(const string& root, const Visitor& visit, const DirHook& enterDir = nullptr,
+              const DirHook& leaveDir = nullptr) {
+        run(WorkItem{makeNode(0, nullptr, root), 0, nullptr, nullptr}, visit, enterDir, leaveDir);
+    }
+    
+    // Walk for deletes: root itself is opened relative to its parent
+    // directory without following a symlink, and done is called for every
+    // directory, root included, as soon as everything below it has been
+    // walked. Returns false if the parent of root can't be opened.
+    bool walkTree(const string& root, const Visitor& visit, const DoneHook& done) {
+        size_t slash = root.find_last_of('/');
+        string name = slash == string::npos ? root : root.substr(slash + 1);
+        string dir = slash == string::npos ? "." : slash == 0 ? "/" : root.substr(0, slash);
+        if (name.empty() || name == "." || name == "..") {
+            errno = EINVAL;
+            return false;
+        }
+        auto parent = make_shared<DirRef>();
+        parent->fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent->fd < 0) return false;
+        
+        const PathNode* top = makeNode(0, nullptr, slash == string::npos ? string_view() : string_view(dir));
+        doneHook = done ? &done : nullptr;
+        run(WorkItem{makeNode(0, top, name), 0, nullptr, move(parent)}, visit, nullptr, nullptr);
+        doneHook = nullptr;
+        return true;
+    }
+    
+    // Runs walk on background threads while the caller drains results from
+    // merger. produce is called per entry with a per-worker batch to append
+    // matches to; full batches are flushed to the merger as the walk goes.
+    size_t walkAndMerge(const string& root, ResultMerger& merger,
+                        const function<bool(const WalkEntry&, ResultBatch&)>& produce,
+                        const function<void(string_view)>& consume) {
+        const size_t batchSize = 256;
+        vector<ResultBatch> buffers(threadCount);
+        
+        thread runner([&] {
+            walk(root, [&](const WalkEntry& e) {
+                ResultBatch& buf = buffers[e.worker];
+                bool descend = produce(e, buf);
+                if (buf.size() >= batchSize) merger.push(move(buf));
+                return descend;
+            });
+            for (auto& buf : buffers) merger.push(move(buf));
+            merger.finish();
+        });
+        
+        size_t count = merger.drain(consume);
+        runner.join();
+        return count;
+    }
+};
+
+// Persistent filename index over one directory tree. The on-disk file is
+// memory-mapped and queried in place:
+//   - directory paths are sorted and front-coded (shared prefix length +
+//     suffix), with a restart point every 16 paths for random access
+//   - basenames live in one blob addressed by an offset table
+//   - a trigram table maps every 3-byte sequence of a basename to a
+//     delta-encoded posting list of entry ids
+// Substring queries intersect the posting lists of the pattern's trigrams
+// and only verify the surviving candidates. Each directory's mtime is kept
+// so refresh() can rescan just the directories that changed.
+class FileIndex {
+public:
+    struct DirRecord {
+        int64_t mtimeNs = 0;
+        vector<string> names;
+        vector<unsigned char> types;
+    };
+    
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t rootLen;
+        uint64_t dirCount;
+        uint64_t entryCount;
+        uint64_t trigramCount;
+        uint64_t dirPathsOff;
+        uint64_t dirRestartsOff;
+        uint64_t dirMtimesOff;
+        uint64_t dirFirstOff;
+        uint64_t nameOffsetsOff;
+        uint64_t nameBlobOff;
+        uint64_t typesOff;
+        uint64_t trigramsOff;
+        uint64_t postingsOff;
+        uint64_t totalSize;
+    };
+    
+    struct TrigramSlot {
+        uint32_t trigram;
+        uint32_t count;
+        uint64_t offset;    // relative to the postings section
+    };
+    
+    static constexpr char kMagic[8] = {'F', 'E', 'I', 'D', 'X', 0, 0, 1};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kRestartInterval = 16;
+    
+    string root;
+    string indexFile;
+    
+    // Editable model, ordered by path so a subtree is one contiguous range
+    map<string, DirRecord> dirs;
+    bool modelLoaded = false;
+    bool modelDirty = false;    // model changed since the file was written
+    bool damaged = false;       // the last mapFile() rejected an existing file
+    
+    // Guards everything below; the watcher thread updates the index while
+    // the UI thread queries it
+    mutable mutex mtx;
+    
+    // Mapped index file
+    const char* mapBase = nullptr;
+    size_t mapSize = 0;
+    const Header* header = nullptr;
+    
+    static void putVarint(string& out, uint64_t v) {
+        while (v >= 0x80) {
+            out += static_cast<char>((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        out += static_cast<char>(v);
+    }
+    
+    // Reads a varint of the mapped file; false if it runs past end or past
+    // 64 bits, which only a damaged file does
+    static bool getVarint(const unsigned char*& p, const unsigned char* end, uint64_t& v) {
+        v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            unsigned char b = *p++;
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+    
+    template <typename T>
+    static void putRaw(string& out, const T& v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+    
+    static uint32_t trigramAt(const char* p) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16) |
+               (static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8) |
+               static_cast<uint32_t>(static_cast<unsigned char>(p[2]));
+    }
+    
+    static int64_t mtimeOf(const struct stat& st) {
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    
+    template <typename T>
+    const T* section(uint64_t off) const {
+        return reinterpret_cast<const T*>(mapBase + off);
+    }
+    
+    const unsigned char* bytesAt(uint64_t off) const {
+        return reinterpret_cast<const unsigned char*>(mapBase + off);
+    }
+    
+    static string childPath(const string& dir, string_view name) {
+        string p = dir;
+        if (p.back() != '/') p += '/';
+        p += name;
+        return p;
+    }
+    
+    static string parentOf(const string& path) {
+        size_t pos = path.find_last_of('/');
+        return (pos == 0 || pos == string::npos) ? "/" : path.substr(0, pos);
+    }
+    
+    static unsigned char typeFromMode(mode_t mode) {
+        if (S_ISDIR(mode)) return DT_DIR;
+        if (S_ISREG(mode)) return DT_REG;
+        if (S_ISLNK(mode)) return DT_LNK;
+        if (S_ISFIFO(mode)) return DT_FIFO;
+        if (S_ISSOCK(mode)) return DT_SOCK;
+        if (S_ISCHR(mode)) return DT_CHR;
+        if (S_ISBLK(mode)) return DT_BLK;
+        return DT_UNKNOWN;
+    }
+    
+    static bool isUnder(const string& path, const string& dir) {
+        if (path.compare(0, dir.size(), dir) != 0) return false;
+        return path.size() == dir.size() || dir.back() == '/' || path[dir.size()] == '/';
+    }
+    
+    // Walks the subtree at top in parallel and adds a record per directory
+    void scanSubtree(const string& top) {
+        ParallelWalker walker;
+        vector<vector<pair<string, DirRecord>>> perWorker(walker.workers());
+        
+        walker.walk(top,
+            [&](const WalkEntry& e) {
+                DirRecord& rec = perWorker[e.worker].back().second;
+                rec.names.emplace_back(e.name);
+                rec.types.push_back(e.type);
+                return true;
+            },
+            [&](const string& path, unsigned, unsigned worker, int dirFd) {
+                DirRecord rec;
+                struct stat st;
+                if (fstat(dirFd, &st) == 0) rec.mtimeNs = mtimeOf(st);
+                perWorker[worker].emplace_back(path, move(rec));
+            });
+        
+        for (auto& recs : perWorker) {
+            for (auto& r : recs) dirs[r.first] = move(r.second);
+        }
+    }
+    
+    // Re-reads the entries of one directory (not recursive)
+    bool rescanDirectory(const string& path, DirRecord& rec) {
+        DirReader reader(64 << 10);
+        if (!reader.open(path)) return false;
+        struct stat st;
+        if (fstat(reader.fdNum(), &st) != 0) return false;
+        
+        rec.mtimeNs = mtimeOf(st);
+        rec.names.clear();
+        rec.types.clear();
+        DirReader::Entry entry;
+        MetaFetcher typeFetcher(MetaFetcher::Type);
+        while (reader.next(entry)) {
+            if (entry.type == DT_UNKNOWN) {
+                // Resolved like the walker does, so rescans and full scans
+                // agree on which entries are subdirectories
+                EntryMeta info;
+                if (typeFetcher.fetch(reader.fdNum(), entry.name.data(), DT_UNKNOWN, info)) {
+                    entry.type = IFTODT(info.mode);
+                }
+            }
+            rec.names.emplace_back(entry.name);
+            rec.types.push_back(entry.type);
+        }
+        return true;
+    }
+    
+    void eraseSubtree(const string& path) {
+        auto it = dirs.find(path);
+        if (it == dirs.end()) return;
+        string prefix = childPath(path, "");
+        auto end = dirs.lower_bound(prefix);
+        while (end != dirs.end() && end->first.compare(0, prefix.size(), prefix) == 0) ++end;
+        // The directory itself sorts before its children but not necessarily
+        // adjacent to them, so erase it separately.
+        dirs.erase(dirs.lower_bound(prefix), end);
+        dirs.erase(path);
+    }
+    
+    void unmap() {
+        if (mapBase) munmap(const_cast<char*>(mapBase), mapSize);
+        mapBase = nullptr;
+        mapSize = 0;
+        header = nullptr;
+    }
+    
+    bool mapFile() {
+        unmap();
+        damaged = false;
+        int fd = open(indexFile.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) return false;
+        
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            close(fd);
+            damaged = true;
+            return false;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        
+        mapBase = static_cast<const char*>(p);
+        mapSize = st.st_size;
+        header = reinterpret_cast<const Header*>(mapBase);
+        if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion ||
+            header->totalSize != mapSize || !validMap() ||
+            string_view(mapBase + sizeof(Header), header->rootLen) != root) {
+            unmap();
+            damaged = true;
+            return false;
+        }
+        return true;
+    }
+    
+    // Checks a freshly mapped file before anything indexes into it: every
+    // section lies inside the map, in file order and aligned, and is large
+    // enough for its count; the tables used as indexes (restart points,
+    // name offsets, directory ranges, posting slots) stay inside what they
+    // point into. Varint sections are bounded as they are decoded instead.
+    bool validMap() const {
+        const Header& h = *header;
+        uint64_t start = sizeof(Header) + static_cast<uint64_t>(h.rootLen);
+        // Counts can't exceed the bytes holding them; this also keeps the
+        // size products below from overflowing
+        if (start > mapSize || h.dirCount > mapSize || h.entryCount > mapSize || h.trigramCount > mapSize) {
+            return false;
+        }
+        const uint64_t order[] = {h.dirPathsOff, h.dirRestartsOff, h.dirMtimesOff, h.dirFirstOff, h.nameOffsetsOff,
+                                  h.nameBlobOff, h.typesOff, h.trigramsOff, h.postingsOff};
+        uint64_t prev = start;
+        for (uint64_t off : order) {
+            if (off < prev || off % 8 != 0) return false;
+            prev = off;
+        }
+        if (prev > mapSize) return false;
+        uint64_t restartCount = (h.dirCount + kRestartInterval - 1) / kRestartInterval;
+        auto fits = [](uint64_t off, uint64_t next, uint64_t bytes) { return bytes <= next - off; };
+        if (!fits(h.dirRestartsOff, h.dirMtimesOff, restartCount * sizeof(uint64_t)) ||
+            !fits(h.dirMtimesOff, h.dirFirstOff, h.dirCount * sizeof(int64_t)) ||
+            !fits(h.dirFirstOff, h.nameOffsetsOff, (h.dirCount + 1) * sizeof(uint32_t)) ||
+            !fits(h.nameOffsetsOff, h.nameBlobOff, (h.entryCount + 1) * sizeof(uint32_t)) ||
+            !fits(h.typesOff, h.trigramsOff, h.entryCount) ||
+            !fits(h.trigramsOff, h.postingsOff, h.trigramCount * sizeof(TrigramSlot))) {
+            return false;
+        }
+        
+        const uint64_t* restarts = section<uint64_t>(h.dirRestartsOff);
+        for (uint64_t b = 0; b < restartCount; b++) {
+            if (restarts[b] >= h.dirRestartsOff - h.dirPathsOff) return false;
+        }
+        const uint32_t* first = section<uint32_t>(h.dirFirstOff);
+        if (first[0] != 0 || first[h.dirCount] != h.entryCount) return false;
+        for (uint64_t i = 0; i < h.dirCount; i++) {
+            if (first[i] > first[i + 1]) return false;
+        }
+        const uint32_t* names = section<uint32_t>(h.nameOffsetsOff);
+        if (names[h.entryCount] > h.typesOff - h.nameBlobOff) return false;
+        for (uint64_t id = 0; id < h.entryCount; id++) {
+            if (names[id] > names[id + 1]) return false;
+        }
+        const TrigramSlot* slots = section<TrigramSlot>(h.trigramsOff);
+        uint64_t postingBytes = mapSize - h.postingsOff;
+        for (uint64_t t = 0; t < h.trigramCount; t++) {
+            if (slots[t].offset > postingBytes || slots[t].count > postingBytes - slots[t].offset) return false;
+        }
+        return true;
+    }
+    
+    // Decodes directory i's path from the front-coded section
+    string dirPathAt(uint64_t i) const {
+        const uint64_t* restarts = section<uint64_t>(header->dirRestartsOff);
+        uint64_t block = i / kRestartInterval;
+        const unsigned char* p = bytesAt(header->dirPathsOff + restarts[block]);
+        const unsigned char* end = bytesAt(header->dirRestartsOff);
+        
+        string path;
+        for (uint64_t k = block * kRestartInterval; k <= i; k++) {
+            uint64_t shared, suffix;
+            if (!getVarint(p, end, shared) || !getVarint(p, end, suffix) || shared > path.size() ||
+                suffix > static_cast<uint64_t>(end - p)) {
+                break;
+            }
+            path.resize(shared);
+            path.append(reinterpret_cast<const char*>(p), suffix);
+            p += suffix;
+        }
+        return path;
+    }
+    
+    string_view nameAt(uint64_t id) const {
+        const uint32_t* offs = section<uint32_t>(header->nameOffsetsOff);
+        const char* blob = mapBase + header->nameBlobOff;
+        return string_view(blob + offs[id], offs[id + 1] - offs[id]);
+    }
+    
+    uint64_t dirOfEntry(uint64_t id) const {
+        const uint32_t* first = section<uint32_t>(header->dirFirstOff);
+        // first has dirCount + 1 entries; find the last dir whose first <= id
+        const uint32_t* it = upper_bound(first, first + header->dirCount + 1, static_cast<uint32_t>(id));
+        return static_cast<uint64_t>(it - first) - 1;
+    }
+    
+    const TrigramSlot* findTrigram(uint32_t t) const {
+        const TrigramSlot* slots = section<TrigramSlot>(header->trigramsOff);
+        const TrigramSlot* end = slots + header->trigramCount;
+        const TrigramSlot* it = lower_bound(slots, end, t,
+            [](const TrigramSlot& s, uint32_t v) { return s.trigram < v; });
+        return (it != end && it->trigram == t) ? it : nullptr;
+    }
+    
+    void decodePostings(const TrigramSlot* slot, vector<uint32_t>& out) const {
+        const unsigned char* p = bytesAt(header->postingsOff + slot->offset);
+        const unsigned char* end = bytesAt(mapSize);
+        out.resize(slot->count);
+        uint32_t id = 0;
+        for (uint32_t k = 0; k < slot->count; k++) {
+            uint64_t delta;
+            // A damaged list ends at the first id it can't vouch for
+            if (!getVarint(p, end, delta) || id + delta >= header->entryCount) {
+                out.resize(k);
+                break;
+            }
+            id += static_cast<uint32_t>(delta);
+            out[k] = id;
+        }
+    }
+    
+    // Rebuilds the editable model from the mapped file
+    void loadModel() {
+        dirs.clear();
+        if (header) {
+            const int64_t* mtimes = section<int64_t>(header->dirMtimesOff);
+            const uint32_t* first = section<uint32_t>(header->dirFirstOff);
+            const unsigned char* types = section<unsigned char>(header->typesOff);
+            const unsigned char* p = bytesAt(header->dirPathsOff);
+            const unsigned char* end = bytesAt(header->dirRestartsOff);
+            
+            string path;
+            for (uint64_t i = 0; i < header->dirCount; i++) {
+                uint64_t shared, suffix;
+                if (!getVarint(p, end, shared) || !getVarint(p, end, suffix) || shared > path.size() ||
+                    suffix > static_cast<uint64_t>(end - p)) {
+                    break;
+                }
+                path.resize(shared);
+                path.append(reinterpret_cast<const char*>(p), suffix);
+                p += suffix;
+                
+                DirRecord& rec = dirs[path];
+                rec.mtimeNs = mtimes[i];
+                for (uint32_t id = first[i]; id < first[i + 1]; id++) {
+                    rec.names.emplace_back(nameAt(id));
+                    rec.types.push_back(types[id]);
+                }
+            }
+        }
+        modelLoaded = true;
+    }
+    
+    bool save() {
+        Header h{};
+        memcpy(h.magic, kMagic, sizeof(kMagic));
+        h.version = kVersion;
+        h.rootLen = static_cast<uint32_t>(root.size());
+        h.dirCount = dirs.size();
+        
+        string paths, nameBlob;
+        vector<uint64_t> restarts;
+        vector<int64_t> mtimes;
+        vector<uint32_t> dirFirst, nameOffsets;
+        vector<unsigned char> types;
+        vector<uint64_t> pairs;     // trigram << 32 | entry id
+        
+        const string* prev = nullptr;
+        uint64_t i = 0;
+        for (auto& kv : dirs) {
+            const string& path = kv.first;
+            size_t shared = 0;
+            if (i % kRestartInterval == 0) {
+                restarts.push_back(paths.size());
+            } else {
+                size_t limit = min(prev->size(), path.size());
+                while (shared < limit && (*prev)[shared] == path[shared]) shared++;
+            }
+            putVarint(paths, shared);
+            putVarint(paths, path.size() - shared);
+            paths.append(path, shared, string::npos);
+            prev = &path;
+            i++;
+            
+            mtimes.push_back(kv.second.mtimeNs);
+            dirFirst.push_back(static_cast<uint32_t>(nameOffsets.size()));
+            
+            // Sorted names keep listings and query output stable
+            DirRecord& rec = kv.second;
+            vector<size_t> order(rec.names.size());
+            for (size_t k = 0; k < order.size(); k++) order[k] = k;
+            sort(order.begin(), order.end(), [&](size_t a, size_t b) { return rec.names[a] < rec.names[b]; });
+            
+            for (size_t k : order) {
+                const string& name = rec.names[k];
+                uint32_t id = static_cast<uint32_t>(nameOffsets.size());
+                nameOffsets.push_back(static_cast<uint32_t>(nameBlob.size()));
+                nameBlob += name;
+                types.push_back(rec.types[k]);
+                for (size_t c = 0; c + 3 <= name.size(); c++) {
+                    pairs.push_back(static_cast<uint64_t>(trigramAt(name.data() + c)) << 32 | id);
+                }
+            }
+            if (nameBlob.size() > UINT32_MAX || nameOffsets.size() > UINT32_MAX - 1) {
+                cerr << RED << "Error: Tree too large to index" << RESET << endl;
+                return false;
+            }
+        }
+        h.entryCount = nameOffsets.size();
+        nameOffsets.push_back(static_cast<uint32_t>(nameBlob.size()));
+        dirFirst.push_back(static_cast<uint32_t>(h.entryCount));
+        
+        sort(pairs.begin(), pairs.end());
+        pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+        
+        vector<TrigramSlot> slots;
+        string postings;
+        for (size_t k = 0; k < pairs.size();) {
+            uint32_t tri = static_cast<uint32_t>(pairs[k] >> 32);
+            TrigramSlot slot{tri, 0, postings.size()};
+            uint32_t last = 0;
+            for (; k < pairs.size() && static_cast<uint32_t>(pairs[k] >> 32) == tri; k++) {
+                uint32_t id = static_cast<uint32_t>(pairs[k]);
+                putVarint(postings, id - last);
+                last = id;
+                slot.count++;
+            }
+            slots.push_back(slot);
+        }
+        h.trigramCount = slots.size();
+        
+        // Lay out sections, 8-byte aligned
+        string out;
+        putRaw(out, h);
+        out += root;
+        auto align = [&out] { out.resize((out.size() + 7) & ~size_t(7), '\0'); };
+        auto emit = [&](uint64_t& off, const void* data, size_t bytes) {
+            align();
+            off = out.size();
+            out.append(static_cast<const char*>(data), bytes);
+        };
+        emit(h.dirPathsOff, paths.data(), paths.size());
+        emit(h.dirRestartsOff, restarts.data(), restarts.size() * sizeof(uint64_t));
+        emit(h.dirMtimesOff, mtimes.data(), mtimes.size() * sizeof(int64_t));
+        emit(h.dirFirstOff, dirFirst.data(), dirFirst.size() * sizeof(uint32_t));
+        emit(h.nameOffsetsOff, nameOffsets.data(), nameOffsets.size() * sizeof(uint32_t));
+        emit(h.nameBlobOff, nameBlob.data(), nameBlob.size());
+        emit(h.typesOff, types.data(), types.size());
+        emit(h.trigramsOff, slots.data(), slots.size() * sizeof(TrigramSlot));
+        emit(h.postingsOff, postings.data(), postings.size());
+        // Padding so a varint read at the very end never runs off the map
+        out.append(8, '\0');
+        h.totalSize = out.size();
+        memcpy(&out[0], &h, sizeof(h));
+        
+        // Write to a temp file and rename so readers never see a partial index.
+        // Only writing creates the cache directory.
+        indexFile = defaultLocation(root, true);
+        if (indexFile.empty()) {
+            errno = ENOENT;
+            return false;
+        }
+        string tmp = indexFile + ".tmp";
+        unlink(tmp.c_str());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t n = write(fd, out.data() + done, out.size() - done);
+            if (n <= 0) {
+                close(fd);
+                unlink(tmp.c_str());
+                return false;
+            }
+            done += n;
+        }
+        if (close(fd) != 0 || rename(tmp.c_str(), indexFile.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        // Only now are the incremental changes safely on disk
+        modelDirty = false;
+        return mapFile();
+    }
+    
+    // Full scan of the tree, replacing the model and the file
+    bool rebuildLocked() {
+        dirs.clear();
+        scanSubtree(root);
+        modelLoaded = true;
+        return save();
+    }
+    
+    // Directories whose mtime no longer matches the index (or are gone)
+    vector<string> staleDirectoriesLocked() {
+        if (!modelLoaded) loadModel();
+        vector<string> stale;
+        for (const auto& kv : dirs) {
+            struct stat st;
+            if (stat(kv.first.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || mtimeOf(st) != kv.second.mtimeNs) {
+                stale.push_back(kv.first);
+            }
+        }
+        return stale;
+    }
+    
+    // Rescans only the directories that changed since the last save. New
+    // subdirectories are scanned in full; vanished ones are dropped with
+    // their subtree. Returns the number of directories rescanned.
+    size_t refreshLocked() {
+        vector<string> stale = staleDirectoriesLocked();
+        size_t rescanned = 0;
+        for (const auto& path : stale) {
+            auto it = dirs.find(path);
+            if (it == dirs.end()) continue;     // dropped with an ancestor
+            rescanned += rescanPathLocked(path);
+        }
+        if (rescanned > 0 || !header) save();
+        return rescanned;
+    }
+    
+    // Brings one directory's record in line with the filesystem; does not save
+    size_t rescanPathLocked(const string& path) {
+        if (!modelLoaded) loadModel();
+        auto it = dirs.find(path);
+        DirRecord old;
+        if (it != dirs.end()) old = move(it->second);
+        
+        DirRecord fresh;
+        if (!rescanDirectory(path, fresh)) {
+            eraseSubtree(path);
+            return 1;
+        }
+        
+        set<string> oldDirs, newDirs;
+        for (size_t k = 0; k < old.names.size(); k++) {
+            if (old.types[k] == DT_DIR) oldDirs.insert(old.names[k]);
+        }
+        for (size_t k = 0; k < fresh.names.size(); k++) {
+            if (fresh.types[k] == DT_DIR) newDirs.insert(fresh.names[k]);
+        }
+        dirs[path] = move(fresh);
+        
+        size_t count = 1;
+        for (const auto& name : oldDirs) {
+            if (!newDirs.count(name)) eraseSubtree(childPath(path, name));
+        }
+        for (const auto& name : newDirs) {
+            string child = childPath(path, name);
+            if (!dirs.count(child)) {
+                scanSubtree(child);
+                count++;
+            }
+        }
+        return count;
+    }
+    
+public:
+    explicit FileIndex(const string& rootPath) : root(rootPath) {
+        indexFile = defaultLocation(root);
+    }
+    
+    ~FileIndex() {
+        unmap();
+    }
+    
+    FileIndex(const FileIndex&) = delete;
+    FileIndex& operator=(const FileIndex&) = delete;
+    
+    // $XDG_CACHE_HOME/file_explorer/<hash of root>.idx (or ~/.cache/...).
+    // Without either, a private /tmp/file_explorer-<uid> directory is used
+    // so other users cannot plant links or indexes in it; empty (nothing
+    // is persisted) if that directory is not ours and 0700. Directories
+    // are made only with create, so looking an index up leaves no trace.
+    static string defaultLocation(const string& rootPath, bool create = false) {
+        string base;
+        if (const char* xdg = getenv("XDG_CACHE_HOME")) {
+            base = xdg;
+        } else if (const char* home = getenv("HOME")) {
+            base = string(home) + "/.cache";
+        }
+        if (!base.empty()) {
+            if (create) mkdir(base.c_str(), 0755);
+            base += "/file_explorer";
+            if (create) mkdir(base.c_str(), 0755);
+        } else {
+            base = "/tmp/file_explorer-" + to_string(getuid());
+            struct stat st;
+            if (create && mkdir(base.c_str(), 0700) != 0 && errno != EEXIST) return "";
+            if (lstat(base.c_str(), &st) != 0) {
+                if (create || errno != ENOENT) return "";
+            } else if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+                return "";
+            }
+        }
+        
+        uint64_t hash = 1469598103934665603ULL;     // FNV-1a
+        for (unsigned char c : rootPath) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.idx", static_cast<unsigned long long>(hash));
+        return base + name;
+    }
+    
+    const string& rootPath() const {
+        return root;
+    }
+    
+    bool covers(const string& path) const {
+        return isUnder(path, root);
+    }
+    
+    // Maps an existing index file; false if there is none for this root.
+    // A file that fails validation is rebuilt from a fresh scan.
+    bool load() {
+        lock_guard<mutex> lock(mtx);
+        modelLoaded = false;
+        modelDirty = false;
+        dirs.clear();
+        if (mapFile() || !damaged) return header != nullptr;
+        cerr << YELLOW << "Index file " << indexFile << " is damaged; rebuilding it" << RESET << endl;
+        return rebuildLocked();
+    }
+    
+    bool isLoaded() const {
+        lock_guard<mutex> lock(mtx);
+        return header != nullptr;
+    }
+    
+    size_t entryCount() const {
+        lock_guard<mutex> lock(mtx);
+        return header ? header->entryCount : 0;
+    }
+    
+    size_t dirCount() const {
+        lock_guard<mutex> lock(mtx);
+        return header ? header->dirCount : 0;
+    }
+    
+    // Full scan of the tree, replacing whatever was indexed before
+    bool rebuild() {
+        lock_guard<mutex> lock(mtx);
+        return rebuildLocked();
+    }
+    
+    // Directories whose mtime no longer matches the index (or are gone)
+    vector<string> staleDirectories() {
+        lock_guard<mutex> lock(mtx);
+        return staleDirectoriesLocked();
+    }
+    
+    // Rescans only the directories that changed since the last save. New
+    // subdirectories are scanned in full; vanished ones are dropped with
+    // their subtree. Returns the number of directories rescanned.
+    size_t refresh() {
+        lock_guard<mutex> lock(mtx);
+        return refreshLocked();
+    }
+    
+    // Every indexed directory, for callers that need to watch them
+    vector<string> directories() {
+        lock_guard<mutex> lock(mtx);
+        if (!modelLoaded) loadModel();
+        vector<string> out;
+        out.reserve(dirs.size());
+        for (const auto& kv : dirs) out.push_back(kv.first);
+        return out;
+    }
+    
+    // Applies a batch of changes inside one directory: each name is looked up
+    // again with fstatat, so a create followed by a delete in the same batch
+    // simply disappears. New subdirectories are scanned in full and returned
+    // so the caller can start watching them. A directory that cannot be
+    // examined falls back to rescanning it.
+    vector<string> applyChanges(const string& dirPath, const set<string>& names) {
+        lock_guard<mutex> lock(mtx);
+        if (!modelLoaded) loadModel();
+        vector<string> added;
+        
+        auto it = dirs.find(dirPath);
+        int dirFd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (it == dirs.end() || dirFd < 0) {
+            if (dirFd >= 0) close(dirFd);
+            if (it != dirs.end() || dirs.count(parentOf(dirPath))) {
+                rescanPathLocked(dirPath);
+                modelDirty = true;
+            }
+            return added;
+        }
+        
+        DirRecord& rec = it->second;
+        unordered_map<string, size_t> position;
+        position.reserve(rec.names.size());
+        for (size_t k = 0; k < rec.names.size(); k++) position.emplace(rec.names[k], k);
+        
+        vector<bool> removed(rec.names.size(), false);
+        for (const auto& name : names) {
+            struct stat st;
+            bool exists = fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+            unsigned char type = exists ? typeFromMode(st.st_mode) : static_cast<unsigned char>(DT_UNKNOWN);
+            auto pos = position.find(name);
+            string child = childPath(dirPath, name);
+            
+            if (pos != position.end() && (!exists || rec.types[pos->second] != type)) {
+                if (rec.types[pos->second] == DT_DIR) eraseSubtree(child);
+                removed[pos->second] = true;
+                position.erase(pos);
+                pos = position.end();
+            }
+            if (exists && pos == position.end()) {
+                position.emplace(name, rec.names.size());
+                rec.names.push_back(name);
+                rec.types.push_back(type);
+                removed.push_back(false);
+                if (type == DT_DIR) {
+                    scanSubtree(child);
+                    added.push_back(child);
+                    string prefix = childPath(child, "");
+                    for (auto d = dirs.lower_bound(prefix);
+                         d != dirs.end() && d->first.compare(0, prefix.size(), prefix) == 0; ++d) {
+                        added.push_back(d->first);
+                    }
+                }
+            }
+        }
+        
+        // Compact out removed entries
+        size_t w = 0;
+        for (size_t k = 0; k < rec.names.size(); k++) {
+            if (removed[k]) continue;
+            if (w != k) {
+                rec.names[w] = move(rec.names[k]);
+                rec.types[w] = rec.types[k];
+            }
+            w++;
+        }
+        rec.names.resize(w);
+        rec.types.resize(w);
+        
+        struct stat dirStat;
+        if (fstat(dirFd, &dirStat) == 0) rec.mtimeNs = mtimeOf(dirStat);
+        close(dirFd);
+        modelDirty = true;
+        return added;
+    }
+    
+    // Write pending incremental changes to disk
+    bool persist() {
+        lock_guard<mutex> lock(mtx);
+        return modelDirty ? save() : true;
+    }
+    
+    // Streams the full path of every indexed entry below `under` whose name
+    // the matcher accepts, in path order. Returns the number of matches.
+    size_t query(const NameMatcher& matcher, const string& under, const function<void(const string&)>& emit) {
+        lock_guard<mutex> lock(mtx);
+        // Pending incremental updates are flushed first so results are current
+        if (modelDirty && !save()) {
+            cerr << YELLOW << "Warning: Cannot save index " << indexFile << " (" << strerror(errno)
+                 << "); results may miss recent changes" << RESET << endl;
+        }
+        if (!header) return 0;
+        size_t matches = 0;
+        uint64_t cachedDir = UINT64_MAX;
+        string dirPath;
+        bool dirWanted = false;
+        
+        auto report = [&](uint64_t id) {
+            uint64_t d = dirOfEntry(id);
+            if (d != cachedDir) {
+                cachedDir = d;
+                dirPath = dirPathAt(d);
+                dirWanted = isUnder(dirPath, under);
+            }
+            if (!dirWanted) return;
+            emit(childPath(dirPath, nameAt(id)));
+            matches++;
+        };
+        
+        // Trigrams are case-sensitive and need a literal the match must contain
+        const string& pattern = matcher.requiredLiteral();
+        if (pattern.size() < 3 || matcher.foldsCase()) {
+            // No usable trigrams; a scan of the name blob is still cheap
+            for (uint64_t id = 0; id < header->entryCount; id++) {
+                if (matcher.matches(nameAt(id))) report(id);
+            }
+            return matches;
+        }
+        
+        vector<const TrigramSlot*> slots;
+        for (size_t c = 0; c + 3 <= pattern.size(); c++) {
+            const TrigramSlot* slot = findTrigram(trigramAt(pattern.data() + c));
+            if (!slot) return 0;
+            slots.push_back(slot);
+        }
+        sort(slots.begin(), slots.end(), [](const TrigramSlot* a, const TrigramSlot* b) { return a->count < b->count; });
+        slots.erase(unique(slots.begin(), slots.end()), slots.end());
+        
+        // Intersect the rarest few lists, then verify candidates directly
+        vector<uint32_t> candidates, other, merged;
+        decodePostings(slots[0], candidates);
+        for (size_t k = 1; k < slots.size() && k < 4 && !candidates.empty(); k++) {
+            decodePostings(slots[k], other);
+            merged.clear();
+            set_intersection(candidates.begin(), candidates.end(), other.begin(), other.end(), back_inserter(merged));
+            candidates.swap(merged);
+        }
+        for (uint32_t id : candidates) {
+            if (matcher.matches(nameAt(id))) report(id);
+        }
+        return matches;
+    }
+};
+
+// Keeps a FileIndex current from inotify events. One watch per indexed
+// directory; events are drained for a short window after the first one
+// arrives and coalesced per directory, so a burst of creates in a spool
+// directory becomes a single applyChanges() call. On queue overflow the
+// events are lost, so the watcher falls back to the index's mtime-based
+// refresh, which rescans only the directories that actually changed.
+class IndexWatcher {
+public:
+    // Called on the watcher thread with the directories that changed
+    using ChangeListener = function<void(const vector<string>& changedDirs)>;
+    
+private:
+    FileIndex& index;
+    ChangeListener listener;
+    int inotifyFd = -1;
+    int stopPipe[2] = {-1, -1};
+    thread worker;
+    mutex watchMtx;
+    unordered_map<int, string> watches;     // wd -> directory path
+    bool watchLimitHit = false;
+    
+    static constexpr int kCoalesceMs = 100;
+    static constexpr uint32_t kMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                      IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    
+    void addWatch(const string& dir) {
+        int wd = inotify_add_watch(inotifyFd, dir.c_str(), kMask);
+        if (wd < 0) {
+            if (errno == ENOSPC && !watchLimitHit) {
+                watchLimitHit = true;
+                cerr << YELLOW << "Warning: inotify watch limit reached; "
+                     << "some directories are only covered by refresh" << RESET << endl;
+            }
+            return;
+        }
+        lock_guard<mutex> lock(watchMtx);
+        watches[wd] = dir;     // a moved directory keeps its wd; update the path
+    }
+    
+    // Reads every queued event into pending; returns false on overflow
+    bool drain(map<string, set<string>>& pending) {
+        alignas(struct inotify_event) char buf[64 * 1024];
+        bool ok = true;
+        while (true) {
+            ssize_t n = read(inotifyFd, buf, sizeof(buf));
+            if (n <= 0) break;
+            for (char* p = buf; p < buf + n;) {
+                auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    ok = false;
+                    continue;
+                }
+                lock_guard<mutex> lock(watchMtx);
+                auto it = watches.find(ev->wd);
+                if (it == watches.end()) continue;
+                if (ev->mask & IN_IGNORED) {
+                    watches.erase(it);
+                    continue;
+                }
+                if (ev->len > 0) pending[it->second].insert(ev->name);
+            }
+        }
+        return ok;
+    }
+    
+    void run() {
+        struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+            if (fds[1].revents) break;
+            if (!fds[0].revents) continue;
+            
+            map<string, set<string>> pending;
+            bool ok = drain(pending);
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(kCoalesceMs);
+            while (true) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                if (left <= 0) break;
+                int r = poll(fds, 2, static_cast<int>(left));
+                if (r <= 0 || fds[1].revents) break;
+                ok = drain(pending) && ok;
+            }
+            
+            vector<string> changed;
+            if (!ok) {
+                // Events were dropped: let directory mtimes tell us what changed
+                changed = index.staleDirectories();
+                index.refresh();
+                for (const auto& dir : index.directories()) addWatch(dir);
+            } else {
+                for (const auto& kv : pending) {
+                    for (const auto& dir : index.applyChanges(kv.first, kv.second)) addWatch(dir);
+                    changed.push_back(kv.first);
+                }
+            }
+            if (listener && !changed.empty()) listener(changed);
+            if (fds[1].revents) break;
+        }
+    }
+    
+public:
+    explicit IndexWatcher(FileIndex& idx, ChangeListener onChange = nullptr)
+        : index(idx), listener(move(onChange)) {}
+    
+    ~IndexWatcher() {
+        stop();
+    }
+    
+    IndexWatcher(const IndexWatcher&) = delete;
+    IndexWatcher& operator=(const IndexWatcher&) = delete;
+    
+    bool start() {
+        if (worker.joinable()) return true;
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) return false;
+        if (pipe2(stopPipe, O_CLOEXEC) != 0) {
+            close(inotifyFd);
+            inotifyFd = -1;
+            return false;
+        }
+        // Catch up on anything that changed before the watches existed
+        index.refresh();
+        for (const auto& dir : index.directories()) addWatch(dir);
+        worker = thread(&IndexWatcher::run, this);
+        return true;
+    }
+    
+    void stop() {
+        if (worker.joinable()) {
+            char c = 0;
+            if (write(stopPipe[1], &c, 1) < 0) {
+                // Nothing else to do; join below still waits for the thread
+            }
+            worker.join();
+            index.persist();
+        }
+        if (inotifyFd >= 0) close(inotifyFd);
+        for (int& fd : stopPipe) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+        inotifyFd = -1;
+        watches.clear();
+    }
+    
+    bool running() const {
+        return worker.joinable();
+    }
+    
+    size_t watchCount() {
+        lock_guard<mutex> lock(watchMtx);
+        return watches.size();
+    }
+};
+
+// Streaming XXH64. Fast non-cryptographic 64-bit hash used to compare file
+// contents; equal digests are still confirmed byte by byte before anything
+// destructive is done with them.
+class Xxh64 {
+private:
+    static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+    
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total = 0;
+    unsigned char buf[32];
+    size_t buffered = 0;
+    
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+    
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        return x;
+    }
+    
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        return x;
+    }
+    
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        acc = rotl(acc, 31);
+        return acc * P1;
+    }
+    
+    static uint64_t mergeRound(uint64_t acc, uint64_t val) {
+        acc ^= round(0, val);
+        return acc * P1 + P4;
+    }
+    
+    void stripe(const unsigned char* p) {
+        v[0] = round(v[0], read64(p));
+        v[1] = round(v[1], read64(p + 8));
+        v[2] = round(v[2], read64(p + 16));
+        v[3] = round(v[3], read64(p + 24));
+    }
+    
+public:
+    explicit Xxh64(uint64_t seedValue = 0) {
+        reset(seedValue);
+    }
+    
+    void reset(uint64_t seedValue = 0) {
+        seed = seedValue;
+        v[0] = seed + P1 + P2;
+        v[1] = seed + P2;
+        v[2] = seed;
+        v[3] = seed - P1;
+        total = 0;
+        buffered = 0;
+    }
+    
+    void update(const void* data, size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total += len;
+        if (buffered + len < 32) {
+            memcpy(buf + buffered, p, len);
+            buffered += len;
+            return;
+        }
+        if (buffered) {
+            size_t take = 32 - buffered;
+            memcpy(buf + buffered, p, take);
+            stripe(buf);
+            p += take;
+            len -= take;
+            buffered = 0;
+        }
+        for (; len >= 32; p += 32, len -= 32) stripe(p);
+        memcpy(buf, p, len);
+        buffered = len;
+    }
+    
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; i++) h = mergeRound(h, v[i]);
+        } else {
+            h = seed + P5;
+        }
+        h += total;
+        
+        const unsigned char* p = buf;
+        size_t len = buffered;
+        for (; len >= 8; p += 8, len -= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * P1 + P4;
+        }
+        if (len >= 4) {
+            h ^= static_cast<uint64_t>(read32(p)) * P1;
+            h = rotl(h, 23) * P2 + P3;
+            p += 4;
+            len -= 4;
+        }
+        for (; len > 0; p++, len--) {
+            h ^= *p * P5;
+            h = rotl(h, 11) * P1;
+        }
+        
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+    
+    static uint64_t hash(const void* data, size_t len, uint64_t seedValue = 0) {
+        Xxh64 x(seedValue);
+        x.update(data, len);
+        return x.digest();
+    }
+};
+
+// Chunked tree hash: BLAKE3's tree layout with XXH64 as the compression
+// step. Input is cut into 1 MiB chunks, each hashed with its index as the
+// seed; chunk hashes are then combined pairwise into a left-balanced
+// binary tree and the root is mixed with the total length. Because the
+// shape only depends on the length, feeding the data as one stream (as the
+// copy engine does) and hashing chunks in parallel from disk produce the
+// same digest.
+class TreeHash {
+public:
+    static constexpr size_t kChunk = 1 << 20;
+    
+private:
+    Xxh64 chunk{0};
+    size_t chunkFill = 0;
+    uint64_t chunks = 0;            // completed chunks
+    uint64_t total = 0;
+    vector<uint64_t> stack;         // roots of complete subtrees, largest first
+    bool tailGiven = false;         // short last chunk hashed elsewhere
+    uint64_t tail = 0;
+    
+    static uint64_t parent(uint64_t left, uint64_t right) {
+        uint64_t pair[2] = {left, right};
+        return Xxh64::hash(pair, sizeof(pair), 0x9E3779B97F4A7C15ULL);
+    }
+    
+    // A subtree is complete whenever the chunk count has a trailing zero bit
+    void pushChunk(uint64_t h) {
+        stack.push_back(h);
+        chunks++;
+        for (uint64_t n = chunks; (n & 1) == 0; n >>= 1) {
+            uint64_t right = stack.back();
+            stack.pop_back();
+            stack.back() = parent(stack.back(), right);
+        }
+    }
+    
+public:
+    void update(const void* data, size_t len) {
+        const char* p = static_cast<const char*>(data);
+        total += len;
+        while (len > 0) {
+            size_t take = min(len, kChunk - chunkFill);
+            chunk.update(p, take);
+            chunkFill += take;
+            p += take;
+            len -= take;
+            if (chunkFill == kChunk) {
+                pushChunk(chunk.digest());
+                chunk.reset(chunks);
+                chunkFill = 0;
+            }
+        }
+    }
+    
+    // Feeds n zero bytes (the holes of a sparse file)
+    void zeros(uint64_t n) {
+        static const char zero[64 << 10] = {};
+        while (n > 0) {
+            size_t take = min<uint64_t>(n, sizeof(zero));
+            update(zero, take);
+            n -= take;
+        }
+    }
+    
+    // Appends the hash of a whole chunk computed elsewhere; only valid on
+    // a chunk boundary
+    void addChunk(uint64_t chunkHash, size_t len) {
+        pushChunk(chunkHash);
+        total += len;
+        chunk.reset(chunks);
+    }
+    
+    // Same for a short last chunk; nothing may be added after it
+    void addTail(uint64_t chunkHash, size_t len) {
+        tailGiven = true;
+        tail = chunkHash;
+        chunkFill = len;
+        total += len;
+    }
+    
+    static uint64_t chunkHash(const void* data, size_t len, uint64_t index) {
+        return Xxh64::hash(data, len, index);
+    }
+    
+    uint64_t digest() const {
+        vector<uint64_t> roots = stack;
+        if (chunkFill > 0 || chunks == 0) roots.push_back(tailGiven ? tail : chunk.digest());
+        uint64_t h = roots.back();
+        for (size_t i = roots.size() - 1; i-- > 0;) h = parent(roots[i], h);
+        uint64_t root[2] = {h, total};
+        return Xxh64::hash(root, sizeof(root), 0);
+    }
+    
+    static string hex(uint64_t digest) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(digest));
+        return buf;
+    }
+    
+    // Hashes [0, size) of fd with up to threads readers, each taking runs of
+    // consecutive chunks so reads stay large. Sets errno on failure.
+    static bool hashFile(int fd, uint64_t size, unsigned threads, uint64_t& digest) {
+        const size_t kRun = 16;
+        uint64_t count = (size + kChunk - 1) / kChunk;
+        vector<uint64_t> leaves(count);
+        atomic<uint64_t> next{0};
+        atomic<int> failure{0};
+        
+        auto work = [&] {
+            vector<char> buffer(kRun * kChunk);
+            for (uint64_t run = next++; run * kRun < count && !failure; run = next++) {
+                uint64_t first = run * kRun;
+                uint64_t offset = first * kChunk;
+                size_t want = min<uint64_t>(kRun * kChunk, size - offset);
+                size_t got = 0;
+                while (got < want) {
+                    ssize_t n = FE_TIMED(Read, pread(fd, buffer.data() + got, want - got, offset + got));
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) {
+                        failure = n < 0 ? errno : EIO;
+                        return;
+                    }
+                    got += n;
+                }
+                for (uint64_t c = first; c < min<uint64_t>(first + kRun, count); c++) {
+                    size_t at = (c - first) * kChunk;
+                    leaves[c] = chunkHash(buffer.data() + at, min<size_t>(kChunk, want - at), c);
+                }
+            }
+        };
+        
+        uint64_t runs = (count + kRun - 1) / kRun;
+        threads = static_cast<unsigned>(min<uint64_t>(max(1u, threads), max<uint64_t>(runs, 1)));
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(work);
+        work();
+        for (auto& t : pool) t.join();
+        if (failure) {
+            errno = failure;
+            return false;
+        }
+        
+        TreeHash tree;
+        for (uint64_t c = 0; c < count; c++) {
+            size_t len = c + 1 < count ? kChunk : size - c * kChunk;
+            if (len == kChunk) tree.addChunk(leaves[c], len);
+            else tree.addTail(leaves[c], len);
+        }
+        digest = tree.digest();
+        return true;
+    }
+};
+
+// Rate limiter shared by the workers of a bulk operation. Tokens refill
+// continuously at the set rate up to a quarter second's worth. take() may
+// overdraw the bucket; the caller then sleeps off the debt outside the
+// lock, so a large request is paced rather than refused and concurrent
+// callers queue up behind each other. A rate of 0 means unlimited.
+class TokenBucket {
+private:
+    mutex mtx;
+    atomic<uint64_t> perSecond{0};
+    double tokens = 0;
+    chrono::steady_clock::time_point last;
+    
+public:
+    void setRate(uint64_t rate) {
+        lock_guard<mutex> lock(mtx);
+        perSecond = rate;
+        tokens = rate / 4.0;
+        last = chrono::steady_clock::now();
+    }
+    
+    uint64_t rate() const {
+        return perSecond.load(memory_order_relaxed);
+    }
+    
+    // Takes n tokens, first sleeping while the bucket is in debt
+    void take(uint64_t n) {
+        if (rate() == 0) return;
+        double wait;
+        {
+            lock_guard<mutex> lock(mtx);
+            double r = static_cast<double>(perSecond.load());
+            if (r == 0) return;
+            auto now = chrono::steady_clock::now();
+            tokens = min(r / 4, tokens + r * chrono::duration<double>(now - last).count());
+            last = now;
+            tokens -= n;
+            wait = tokens < 0 ? -tokens / r : 0;
+        }
+        if (wait > 0) this_thread::sleep_for(chrono::duration<double>(wait));
+    }
+};
+
+// Limits for bulk copies and deletes: file data in bytes per second, and
+// operations (files or directories created, copied or removed) per second
+struct Throttle {
+    TokenBucket bytes;
+    TokenBucket ops;
+    
+    bool active() const {
+        return bytes.rate() > 0 || ops.rate() > 0;
+    }
+};
+
+// Result of one file copy, including which kernel path did the work
+struct CopyResult {
+    bool ok = false;
+    const char* method = "none";
+    uint64_t bytes = 0;         // logical bytes copied (holes excluded)
+    double seconds = 0;
+    const char* error = nullptr;
+    int errnum = 0;
+    bool verified = false;      // destination re-read and matched checksum
+    uint64_t checksum = 0;      // TreeHash of the source, when verifying
+    
+    double bytesPerSecond() const {
+        return seconds > 0 ? bytes / seconds : 0;
+    }
+};
+
+// File copy engine. Tries, in order: a FICLONE reflink (instant on btrfs/XFS),
+// copy_file_range (in-kernel, may offload to the storage), sendfile, and
+// finally read/write through a large buffer with sequential read-ahead
+// hinted. Each step falls through to the next only when the kernel reports
+// the mechanism is unsupported for this pair of files. Sparse sources are
+// copied segment by segment using SEEK_DATA/SEEK_HOLE so holes stay holes.
+class CopyEngine {
+private:
+    enum class Method { CopyFileRange, Sendfile, ReadWrite };
+    
+    static constexpr size_t kBufferSize = 1 << 20;
+    static constexpr size_t kChunk = 1 << 30;   // max bytes per kernel call
+    
+    static bool unsupported(int err) {
+        return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+               err == ENOTSUP || err == EBADF || err == ETXTBSY;
+    }
+    
+    // Copies [offset, offset + length) with the current method, downgrading
+    // the method when the kernel refuses it. Returns false on a real error.
+    static bool copyRange(int srcFd, int destFd, off_t offset, uint64_t length,
+                          Method& method, vector<char>& buffer, TreeHash* hash) {
+        while (length > 0) {
+            if (method == Method::CopyFileRange) {
+                loff_t in = offset, out = offset;
+                ssize_t n = FE_TIMED(Write, copy_file_range(srcFd, &in, destFd, &out, min<uint64_t>(length, kChunk), 0));
+                if (n > 0) {
+                    offset += n;
+                    length -= n;
+                    continue;
+                }
+                // Some filesystems (procfs-like sizes, some FUSE and ceph
+                // kernels) return 0 before EOF; pread below tells whether
+                // the source really shrank
+                if (n == 0) {
+                    method = Method::ReadWrite;
+                    continue;
+                }
+                if (!unsupported(errno)) return false;
+                method = Method::Sendfile;
+            }
+            if (method == Method::Sendfile) {
+                // sendfile writes at the destination's file position
+                if (lseek(destFd, offset, SEEK_SET) != offset) return false;
+                off_t in = offset;
+                ssize_t n = FE_TIMED(Write, sendfile(destFd, srcFd, &in, min<uint64_t>(length, kChunk)));
+                if (n > 0) {
+                    offset += n;
+                    length -= n;
+                    continue;
+                }
+                if (n != 0 && !unsupported(errno)) return false;
+                method = Method::ReadWrite;
+            }
+            if (buffer.empty()) buffer.resize(kBufferSize);
+            ssize_t n = FE_TIMED(Read, pread(srcFd, buffer.data(), min<uint64_t>(length, buffer.size()), offset));
+            if (n == 0) errno = EIO;    // source shrank under us
+            if (n <= 0) return false;
+            if (hash) hash->update(buffer.data(), n);
+            ssize_t done = 0;
+            while (done < n) {
+                ssize_t w = FE_TIMED(Write, pwrite(destFd, buffer.data() + done, n - done, offset + done));
+                if (w <= 0) return false;
+                done += w;
+            }
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+    
+    static const char* methodName(Method m) {
+        switch (m) {
+            case Method::CopyFileRange: return "copy_file_range";
+            case Method::Sendfile: return "sendfile";
+            default: return "read/write";
+        }
+    }
+    
+public:
+    // Shares srcFd's extents with destFd (btrfs, XFS); no data is copied
+    static bool reflink(int srcFd, int destFd) {
+        return ioctl(destFd, FICLONE, srcFd) == 0;
+    }
+    
+    // Copies the contents of srcFd (described by srcStat) into destFd, which
+    // must be an empty regular file opened for writing. With hash, data goes
+    // through the read/write path so each block is hashed on its way to the
+    // destination (holes are hashed as zeros), and no reflink is made. With
+    // pace, data moves in kBufferSize steps, each taking its bytes first.
+    static CopyResult copyFd(int srcFd, int destFd, const struct stat& srcStat, TreeHash* hash = nullptr,
+                             TokenBucket* pace = nullptr) {
+        CopyResult result;
+        auto start = chrono::steady_clock::now();
+        auto finish = [&](bool ok, const char* method) {
+            result.ok = ok;
+            result.method = method;
+            result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            return result;
+        };
+        
+        if (!hash && reflink(srcFd, destFd)) {
+            result.bytes = srcStat.st_size;
+            return finish(true, "reflink");
+        }
+        
+        posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        Method method = hash ? Method::ReadWrite : Method::CopyFileRange;
+        vector<char> buffer;
+        off_t size = srcStat.st_size;
+        
+        // Fewer allocated blocks than the size implies means there are holes
+        bool sparse = static_cast<off_t>(srcStat.st_blocks) * 512 < size;
+        off_t pos = 0;
+        while (pos < size) {
+            off_t dataStart = pos, dataEnd = size;
+            if (sparse) {
+                dataStart = lseek(srcFd, pos, SEEK_DATA);
+                if (dataStart < 0) {
+                    if (errno == ENXIO) break;      // only a hole remains
+                    dataStart = pos;                // no SEEK_DATA support
+                    sparse = false;
+                } else {
+                    dataEnd = lseek(srcFd, dataStart, SEEK_HOLE);
+                    if (dataEnd < 0) dataEnd = size;
+                }
+            }
+            if (hash) hash->zeros(dataStart - pos);
+            off_t step = pace && pace->rate() ? static_cast<off_t>(kBufferSize) : dataEnd - dataStart;
+            for (off_t at = dataStart; at < dataEnd; at += step) {
+                off_t len = min(step, dataEnd - at);
+                if (pace) pace->take(len);
+                if (!copyRange(srcFd, destFd, at, len, method, buffer, hash)) {
+                    result.errnum = errno;
+                    result.error = strerror(errno);
+                    return finish(false, methodName(method));
+                }
+            }
+            result.bytes += dataEnd - dataStart;
+            pos = dataEnd;
+        }
+        if (hash) hash->zeros(size - pos);
+        
+        // Extends the file over any trailing hole
+        if (ftruncate(destFd, size) != 0) {
+            result.errnum = errno;
+            result.error = strerror(errno);
+            return finish(false, methodName(method));
+        }
+        return finish(true, methodName(method));
+    }
+    
+    // Path-based wrapper: creates (or truncates) dest with the source's mode
+    static CopyResult copyPath(const string& src, const string& dest) {
+        return copyAt(AT_FDCWD, src.c_str(), AT_FDCWD, dest.c_str());
+    }
+    
+    // Re-reads destFd from storage (not the page cache) and compares its
+    // tree hash with the one recorded while copying
+    static bool verifyCopy(int destFd, uint64_t size, CopyResult& result) {
+        if (fdatasync(destFd) != 0) return false;
+        posix_fadvise(destFd, 0, 0, POSIX_FADV_DONTNEED);
+        uint64_t digest;
+        if (!TreeHash::hashFile(destFd, size, thread::hardware_concurrency(), digest)) return false;
+        if (digest != result.checksum) {
+            errno = EIO;
+            result.error = "destination does not match source checksum";
+            return false;
+        }
+        result.verified = true;
+        return true;
+    }
+    
+    // Same, with each name resolved relative to a directory descriptor.
+    // verify hashes the source during the copy and checks the destination.
+    static CopyResult copyAt(int srcDirFd, const char* src, int destDirFd, const char* dest, bool verify = false,
+                             TokenBucket* pace = nullptr) {
+        CopyResult result;
+        int srcFd = FE_TIMED(Open, openat(srcDirFd, src, O_RDONLY | O_CLOEXEC));
+        if (srcFd < 0) {
+            result.errnum = errno;
+            result.error = "Cannot open source file";
+            return result;
+        }
+        struct stat st;
+        if (fstat(srcFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(srcFd);
+            result.errnum = EINVAL;
+            result.error = "Source is not a regular file";
+            return result;
+        }
+        result = copyOpened(srcFd, st, destDirFd, dest, verify, pace);
+        close(srcFd);
+        return result;
+    }
+    
+    // The rest of copyAt, for a source the caller already opened: srcFd is
+    // the regular file st describes, and stays open. destFlags are added to
+    // the flags dest is opened with.
+    static CopyResult copyOpened(int srcFd, const struct stat& st, int destDirFd, const char* dest,
+                                 bool verify = false, TokenBucket* pace = nullptr, int destFlags = 0) {
+        CopyResult result;
+        // Truncated only once it is known not to be the source itself
+        int destFd = FE_TIMED(Open, openat(destDirFd, dest, (verify ? O_RDWR : O_WRONLY) | O_CREAT | O_CLOEXEC | destFlags,
+                                           st.st_mode & 07777));
+        if (destFd < 0) {
+            result.errnum = errno;
+            result.error = "Cannot create destination file";
+            return result;
+        }
+        struct stat destSt;
+        if (fstat(destFd, &destSt) == 0 && destSt.st_dev == st.st_dev && destSt.st_ino == st.st_ino) {
+            close(destFd);
+            result.errnum = EINVAL;
+            result.error = "Source and destination are the same file";
+            return result;
+        }
+        if (ftruncate(destFd, 0) != 0) {
+            result.errnum = errno;
+            close(destFd);
+            result.error = "Cannot truncate destination file";
+            return result;
+        }
+        TreeHash hash;
+        result = copyFd(srcFd, destFd, st, verify ? &hash : nullptr, pace);
+        // The create mode was cut by the umask, and an existing file kept its own
+        if (result.ok && fchmod(destFd, st.st_mode & 07777) != 0) {
+            result.ok = false;
+            result.errnum = errno;
+            result.error = "Cannot set destination permissions";
+        }
+        if (verify && result.ok) {
+            result.checksum = hash.digest();
+            if (!verifyCopy(destFd, st.st_size, result)) {
+                result.ok = false;
+                result.errnum = errno;
+                if (!result.error) result.error = strerror(errno);
+            }
+        }
+        if (close(destFd) != 0 && result.ok) {
+            result.ok = false;
+            result.errnum = errno;
+            result.error = strerror(errno);
+        }
+        return result;
+    }
+};
+
+// Thin wrapper over the raw io_uring syscalls (no liburing dependency):
+// maps the rings, hands out SQEs and reaps CQEs.
+class IoUring {
+private:
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+    
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+    unsigned sqEntries = 0;
+    unsigned queued = 0;        // SQEs filled in but not yet submitted
+    
+public:
+    IoUring() = default;
+    
+    ~IoUring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (fd >= 0) close(fd);
+    }
+    
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    
+    bool init(unsigned entries) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // SUBMIT_ALL keeps the kernel going past an SQE that fails to
+        // prepare, so a submission doesn't stop halfway through a chain
+        p.flags = IORING_SETUP_SUBMIT_ALL;
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0 && errno == EINVAL) {
+            memset(&p, 0, sizeof(p));
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        }
+        if (fd < 0) return false;
+        
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = single ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        void* s = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return false;
+        sqes = static_cast<struct io_uring_sqe*>(s);
+        
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+        sqEntries = p.sq_entries;
+        return true;
+    }
+    
+    unsigned freeSqes() const {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        return sqEntries - (*sqTail + queued - head);
+    }
+    
+    // Next free SQE, zeroed; nullptr when the submission queue is full
+    struct io_uring_sqe* getSqe() {
+        if (freeSqes() == 0) return nullptr;
+        unsigned idx = (*sqTail + queued) & *sqMask;
+        queued++;
+        struct io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[idx] = idx;
+        return sqe;
+    }
+    
+    // Like getSqe, but submits what is queued to make room when full
+    struct io_uring_sqe* getSqeFlushing() {
+        struct io_uring_sqe* sqe = getSqe();
+        while (!sqe) {
+            int r = submitAndWait(0);
+            if (r < 0) return nullptr;
+            sqe = getSqe();
+            // Nothing went out: only reaping completions can make room
+            if (!sqe && r == 0) return nullptr;
+            if (!sqe) this_thread::yield();
+        }
+        return sqe;
+    }
+    
+    bool hasCompletions() const {
+        return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    }
+    
+    // Submits queued SQEs and waits for at least waitFor completions.
+    // What is left to submit is counted from the ring head, so SQEs a short
+    // submission left behind go out on the next attempt. When the kernel
+    // is out of room (EAGAIN/EBUSY) and completions are waiting, it returns
+    // early so the caller reaps them first; the rest go out next call.
+    int submitAndWait(unsigned waitFor) {
+        __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+        queued = 0;
+        int submitted = 0;
+        unsigned stalls = 0;
+        while (true) {
+            unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            long r = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            int err = r < 0 ? errno : 0;
+            if (r > 0) submitted += static_cast<int>(r);
+            if (r >= 0 && static_cast<unsigned>(r) >= toSubmit) return submitted;
+            if (err == EINTR || (r > 0 && !hasCompletions())) continue;
+            if (err != 0 && err != EAGAIN && err != EBUSY) return -err;
+            
+            // No progress: make overflowed completions visible, then let
+            // the caller reap, or give the kernel a moment
+            syscall(__NR_io_uring_enter, fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (hasCompletions()) return submitted;
+            if (++stalls > 1000) return -(err ? err : EAGAIN);
+            this_thread::yield();
+        }
+    }
+    
+    // Takes back every SQE the kernel has not consumed, queued or already
+    // published, and returns their user_data. Only for abandoning a ring:
+    // without SQPOLL the kernel reads the tail only inside io_uring_enter.
+    vector<uint64_t> takeUnsubmitted() {
+        vector<uint64_t> tags;
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        for (unsigned i = head, end = *sqTail + queued; i != end; i++) {
+            tags.push_back(sqes[sqArray[i & *sqMask]].user_data);
+        }
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+        queued = 0;
+        return tags;
+    }
+    
+    bool peek(struct io_uring_cqe& out) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+        out = cqes[head & *cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    
+    int registerResource(unsigned opcode, const void* arg, unsigned count) {
+        long r = syscall(__NR_io_uring_register, fd, opcode, arg, count);
+        return r < 0 ? -errno : 0;
+    }
+    
+    bool supports(const vector<unsigned>& ops) {
+        size_t bytes = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        vector<char> buf(bytes, 0);
+        auto* probe = reinterpret_cast<struct io_uring_probe*>(buf.data());
+        if (registerResource(IORING_REGISTER_PROBE, probe, 256) != 0) return false;
+        for (unsigned op : ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+};
+
+// One unit of work for BatchExecutor; dest is unused for deletes
+struct BatchItem {
+    string src;
+    string dest;
+};
+
+struct BatchOutcome {
+    size_t succeeded = 0;
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    const char* backend = "none";
+};
+
+// Runs many copies, deletes or renames at once. With io_uring each copy is
+// one linked chain: open src -> open dest -> read/write pairs through a
+// registered buffer -> close -> close, using direct (registered) file slots
+// so no descriptor ever crosses into userspace. queueDepth chains stay in
+// flight. Files too large for a short chain go through CopyEngine after the
+// ring drains. Without io_uring the same work is spread over a thread pool.
+class BatchExecutor {
+public:
+    enum class Op { Copy, Delete, Move };
+    // Called once per item, serialized, with 0 or a positive errno
+    using Completion = function<void(const BatchItem&, int err)>;
+    
+private:
+    enum Step : uint32_t { OpenSrc = 1, OpenDest, Read, Write, CloseSrc, CloseDest, Cleanup, Single, Retry };
+    
+    struct Slot {
+        size_t item = SIZE_MAX;
+        unsigned outstanding = 0;
+        int error = 0;
+        bool srcOpened = false;
+        bool destOpened = false;
+        bool srcClosed = false;
+        bool destClosed = false;
+        bool stranded = false;      // part of it never reached the kernel
+        bool reported = false;      // finishItem has run for the item
+        uint64_t bytes = 0;
+    };
+    
+    unsigned queueDepth;
+    size_t bufferSize;
+    unsigned maxChunks;
+    int baseFd = AT_FDCWD;      // relative item paths resolve against this
+    Throttle* throttle = nullptr;
+    
+    TokenBucket* pace() const {
+        return throttle ? &throttle->bytes : nullptr;
+    }
+    
+    static uint64_t tag(unsigned slot, Step step) {
+        return static_cast<uint64_t>(slot) << 32 | step;
+    }
+    
+    static void linkFlags(struct io_uring_sqe* sqe, bool link) {
+        if (link) sqe->flags |= IOSQE_IO_LINK;
+    }
+    
+    // Verifies that opening into a direct descriptor slot works on this kernel
+    static bool directOpenWorks(IoUring& ring) {
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>("/");
+        sqe->open_flags = O_RDONLY | O_DIRECTORY;
+        sqe->file_index = 1;
+        sqe->user_data = 1;
+        if (ring.submitAndWait(1) < 0) return false;
+        struct io_uring_cqe cqe;
+        if (!ring.peek(cqe) || cqe.res != 0) return false;
+        
+        sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = 1;
+        sqe->user_data = 2;
+        if (ring.submitAndWait(1) < 0) return false;
+        return ring.peek(cqe) && cqe.res == 0;
+    }
+    
+    bool runUring(Op op, const vector<BatchItem>& items, const Completion& done, BatchOutcome& outcome) {
+        IoUring ring;
+        unsigned chainLen = 6 + 2 * maxChunks;
+        unsigned entries = 1;
+        while (entries < queueDepth * (op == Op::Copy ? chainLen : 2)) entries <<= 1;
+        if (!ring.init(min(entries, 4096u))) return false;
+        
+        if (!ring.supports({IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                            IORING_OP_UNLINKAT, IORING_OP_RENAMEAT})) {
+            return false;
+        }
+        
+        vector<Slot> slots(queueDepth);
+        vector<char> arena;
+        vector<struct stat> stats;
+        vector<size_t> deferred;        // copies handed to CopyEngine afterwards
+        
+        if (op == Op::Copy) {
+            vector<int> table(queueDepth * 2, -1);
+            if (ring.registerResource(IORING_REGISTER_FILES, table.data(), table.size()) != 0) return false;
+            if (!directOpenWorks(ring)) return false;
+            
+            arena.assign(queueDepth * bufferSize, 0);
+            vector<struct iovec> iov(queueDepth);
+            for (unsigned i = 0; i < queueDepth; i++) {
+                iov[i].iov_base = arena.data() + i * bufferSize;
+                iov[i].iov_len = bufferSize;
+            }
+            if (ring.registerResource(IORING_REGISTER_BUFFERS, iov.data(), iov.size()) != 0) return false;
+            
+            // Sizes are needed up front to lay out the read/write chain
+            stats.resize(items.size());
+            for (size_t i = 0; i < items.size(); i++) {
+                if (fstatat(baseFd, items[i].src.c_str(), &stats[i], 0) != 0) stats[i].st_mode = 0;
+            }
+        }
+        outcome.backend = "io_uring";
+        
+        auto finishItem = [&](size_t item, int err, uint64_t bytes) {
+            if (err == 0) {
+                outcome.succeeded++;
+                outcome.bytes += bytes;
+            } else {
+                outcome.failed++;
+            }
+            if (done) done(items[item], err);
+        };
+        
+        auto noteResult = [](Slot& s, int res) {
+            if (res < 0 && res != -ECANCELED && s.error == 0) s.error = -res;
+        };
+        
+        // Queues the chain for one copy into slot idx; false if the ring is full
+        auto queueCopy = [&](unsigned idx, size_t item) {
+            const struct stat& st = stats[item];
+            uint64_t size = st.st_size;
+            unsigned chunks = static_cast<unsigned>((size + bufferSize - 1) / bufferSize);
+            if (ring.freeSqes() < 4 + 2 * chunks) return false;
+            
+            Slot& s = slots[idx];
+            s = Slot();
+            s.item = item;
+            s.bytes = size;
+            unsigned srcSlot = idx * 2, destSlot = idx * 2 + 1;
+            
+            struct io_uring_sqe* sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = baseFd;
+            sqe->addr = reinterpret_cast<uint64_t>(items[item].src.c_str());
+            sqe->open_flags = O_RDONLY;
+            sqe->file_index = srcSlot + 1;
+            sqe->user_data = tag(idx, OpenSrc);
+            linkFlags(sqe, true);
+            
+            sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = baseFd;
+            sqe->addr = reinterpret_cast<uint64_t>(items[item].dest.c_str());
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            sqe->len = st.st_mode & 07777;
+            sqe->file_index = destSlot + 1;
+            sqe->user_data = tag(idx, OpenDest);
+            linkFlags(sqe, true);
+            
+            char* buf = arena.data() + idx * bufferSize;
+            for (unsigned c = 0; c < chunks; c++) {
+                uint64_t off = static_cast<uint64_t>(c) * bufferSize;
+                unsigned len = static_cast<unsigned>(min<uint64_t>(bufferSize, size - off));
+                for (Step step : {Read, Write}) {
+                    sqe = ring.getSqe();
+                    sqe->opcode = step == Read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                    sqe->flags = IOSQE_FIXED_FILE;
+                    sqe->fd = step == Read ? srcSlot : destSlot;
+                    sqe->addr = reinterpret_cast<uint64_t>(buf);
+                    sqe->len = len;
+                    sqe->off = off;
+                    sqe->buf_index = idx;
+                    sqe->user_data = tag(idx, step);
+                    linkFlags(sqe, true);
+                }
+            }
+            
+            sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = srcSlot + 1;
+            sqe->user_data = tag(idx, CloseSrc);
+            linkFlags(sqe, true);
+            
+            sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = destSlot + 1;
+            sqe->user_data = tag(idx, CloseDest);
+            
+            s.outstanding = 4 + 2 * chunks;
+            return true;
+        };
+        
+        auto queueSingle = [&](unsigned idx, size_t item, Step step, uint32_t unlinkFlags) {
+            struct io_uring_sqe* sqe = step == Retry ? ring.getSqeFlushing() : ring.getSqe();
+            if (!sqe) return false;
+            Slot& s = slots[idx];
+            s = Slot();
+            s.item = item;
+            sqe->fd = baseFd;
+            sqe->addr = reinterpret_cast<uint64_t>(items[item].src.c_str());
+            if (op == Op::Delete) {
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->unlink_flags = unlinkFlags;
+            } else {
+                sqe->opcode = IORING_OP_RENAMEAT;
+                sqe->len = static_cast<uint32_t>(baseFd);
+                sqe->addr2 = reinterpret_cast<uint64_t>(items[item].dest.c_str());
+            }
+            sqe->user_data = tag(idx, step);
+            s.outstanding = 1;
+            return true;
+        };
+        
+        vector<unsigned> freeSlots;
+        for (unsigned i = queueDepth; i-- > 0;) freeSlots.push_back(i);
+        size_t next = 0;
+        unsigned inFlight = 0;
+        bool draining = false;
+        
+        // Accounts one completion; false when the ring can't take the
+        // follow-up SQEs it needs
+        auto reap = [&](const struct io_uring_cqe& cqe) {
+            unsigned idx = static_cast<unsigned>(cqe.user_data >> 32);
+            Step step = static_cast<Step>(cqe.user_data & 0xffffffff);
+            Slot& s = slots[idx];
+            bool ok = true;
+            
+            switch (step) {
+                case OpenSrc: s.srcOpened = cqe.res >= 0; break;
+                case OpenDest: s.destOpened = cqe.res >= 0; break;
+                case CloseSrc: s.srcClosed = cqe.res >= 0; break;
+                case CloseDest: s.destClosed = cqe.res >= 0; break;
+                default:
+                    // A short read or write breaks the link; the closes
+                    // then come back cancelled and the item fails below
+                    break;
+            }
+            
+            if (step == Single && op == Op::Delete && cqe.res == -EISDIR) {
+                // unlinkat refused a directory; retry as rmdir. Without a
+                // working ring it stays untouched for the fallback instead.
+                if (!draining && queueSingle(idx, s.item, Retry, AT_REMOVEDIR)) return true;
+                ok = draining;
+                s.stranded = true;
+            }
+            noteResult(s, cqe.res);
+            if (--s.outstanding > 0) return ok;
+            
+            if (step != Cleanup && !s.stranded) {
+                // Release slots the cancelled part of a chain left open; a
+                // ring being given up releases them all when it closes
+                for (unsigned file : {s.srcOpened && !s.srcClosed ? 1u : 0u, s.destOpened && !s.destClosed ? 2u : 0u}) {
+                    if (file == 0 || draining) continue;
+                    struct io_uring_sqe* sqe = ring.getSqeFlushing();
+                    if (!sqe) {
+                        ok = false;
+                        continue;
+                    }
+                    sqe->opcode = IORING_OP_CLOSE;
+                    sqe->file_index = idx * 2 + file;
+                    sqe->user_data = tag(idx, Cleanup);
+                    s.outstanding++;
+                }
+                int err = s.error;
+                if (err == 0 && op == Op::Copy && !(s.srcClosed && s.destClosed)) err = EIO;
+                // The chain's open took the umask; io_uring has no fchmod,
+                // so the source mode is applied once the copy is complete
+                if (err == 0 && op == Op::Copy &&
+                    fchmodat(baseFd, items[s.item].dest.c_str(), stats[s.item].st_mode & 07777, 0) != 0) {
+                    err = errno;
+                }
+                finishItem(s.item, err, s.bytes);
+                s.reported = true;
+                s.srcOpened = s.destOpened = false;
+                if (s.outstanding > 0) return ok;
+            }
+            freeSlots.push_back(idx);
+            inFlight--;
+            return ok;
+        };
+        
+        // Gives the ring up midway. SQEs the kernel never consumed are taken
+        // back and whatever it did consume is waited for, so the fallback
+        // only gets items that never started: a move that already happened
+        // must not be attempted again.
+        auto abandon = [&] {
+            draining = true;
+            for (uint64_t t : ring.takeUnsubmitted()) {
+                Slot& s = slots[t >> 32];
+                s.stranded = true;
+                if (--s.outstanding == 0) inFlight--;
+            }
+            struct io_uring_cqe cqe;
+            while (inFlight > 0 && ring.submitAndWait(1) >= 0) {
+                while (ring.peek(cqe)) reap(cqe);
+            }
+            // If even waiting fails, the state of what is left is unknown;
+            // report it failed rather than risk running it twice
+            for (Slot& s : slots) {
+                if (s.outstanding > 0 && !s.stranded && !s.reported) finishItem(s.item, EIO, 0);
+                s.outstanding = 0;
+            }
+            return false;
+        };
+        
+        while (next < items.size() || inFlight > 0) {
+            // Fill every free slot
+            while (next < items.size() && !freeSlots.empty()) {
+                unsigned idx = freeSlots.back();
+                bool queued;
+                if (op == Op::Copy) {
+                    const struct stat& st = stats[next];
+                    if (!S_ISREG(st.st_mode)) {
+                        finishItem(next++, st.st_mode ? EISDIR : ENOENT, 0);
+                        continue;
+                    }
+                    // The chain opens the destination with O_TRUNC, which
+                    // would empty a source named twice or hard-linked
+                    struct stat destSt;
+                    if (fstatat(baseFd, items[next].dest.c_str(), &destSt, 0) == 0 &&
+                        destSt.st_dev == st.st_dev && destSt.st_ino == st.st_ino) {
+                        finishItem(next++, EINVAL, 0);
+                        continue;
+                    }
+                    if (static_cast<uint64_t>(st.st_size) > bufferSize * maxChunks) {
+                        deferred.push_back(next++);
+                        continue;
+                    }
+                    queued = queueCopy(idx, next);
+                } else {
+                    queued = queueSingle(idx, next, Single, 0);
+                }
+                if (!queued) break;
+                if (throttle) {
+                    throttle->ops.take(1);
+                    if (op == Op::Copy) throttle->bytes.take(stats[next].st_size);
+                }
+                freeSlots.pop_back();
+                next++;
+                inFlight++;
+            }
+            if (inFlight == 0) continue;
+            
+            if (ring.submitAndWait(1) < 0) return abandon();
+            struct io_uring_cqe cqe;
+            while (ring.peek(cqe)) {
+                if (!reap(cqe)) return abandon();
+            }
+        }
+        
+        for (size_t item : deferred) {
+            if (throttle) throttle->ops.take(1);
+            CopyResult r = CopyEngine::copyAt(baseFd, items[item].src.c_str(), baseFd, items[item].dest.c_str(),
+                                              false, pace());
+            finishItem(item, r.ok ? 0 : (r.errnum ? r.errnum : EIO), r.bytes);
+        }
+        return true;
+    }
+    
+    void runThreadPool(Op op, const vector<BatchItem>& items, const Completion& done, BatchOutcome& outcome) {
+        outcome.backend = "thread pool";
+        atomic<size_t> next{0};
+        mutex resultMtx;
+        
+        auto work = [&] {
+            size_t i;
+            while ((i = next.fetch_add(1)) < items.size()) {
+                const BatchItem& item = items[i];
+                int err = 0;
+                uint64_t bytes = 0;
+                if (throttle) throttle->ops.take(1);
+                if (op == Op::Copy) {
+                    CopyResult r = CopyEngine::copyAt(baseFd, item.src.c_str(), baseFd, item.dest.c_str(), false, pace());
+                    if (!r.ok) err = r.errnum ? r.errnum : EIO;
+                    bytes = r.bytes;
+                } else if (op == Op::Delete) {
+                    if (unlinkat(baseFd, item.src.c_str(), 0) != 0) {
+                        err = errno;
+                        if (err == EISDIR || err == EPERM) {
+                            err = unlinkat(baseFd, item.src.c_str(), AT_REMOVEDIR) == 0 ? 0 : errno;
+                        }
+                    }
+                } else if (renameat(baseFd, item.src.c_str(), baseFd, item.dest.c_str()) != 0) {
+                    err = errno;
+                }
+                
+                lock_guard<mutex> lock(resultMtx);
+                if (err == 0) {
+                    outcome.succeeded++;
+                    outcome.bytes += bytes;
+                } else {
+                    outcome.failed++;
+                }
+                if (done) done(item, err);
+            }
+        };
+        
+        unsigned n = max(4u, thread::hardware_concurrency());
+        n = static_cast<unsigned>(min<size_t>(n, items.size()));
+        vector<thread> threads;
+        for (unsigned t = 1; t < n; t++) threads.emplace_back(work);
+        work();
+        for (auto& t : threads) t.join();
+    }
+    
+public:
+    explicit BatchExecutor(unsigned depth = 32, size_t bufSize = 128 << 10, unsigned chunks = 8)
+        : queueDepth(max(1u, depth)), bufferSize(bufSize), maxChunks(chunks) {}
+    
+    // Paces every following run() by the limits (null: unlimited)
+    void setThrottle(Throttle* limits) {
+        throttle = limits;
+    }
+    
+    // Relative paths in items are resolved against dirFd (AT_FDCWD by default)
+    BatchOutcome run(Op op, const vector<BatchItem>& items, const Completion& done = nullptr,
+                     int dirFd = AT_FDCWD) {
+        BatchOutcome outcome;
+        if (items.empty()) return outcome;
+        baseFd = dirFd;
+        auto start = chrono::steady_clock::now();
+        
+        // A ring that fails before completing anything falls back cleanly;
+        // one that fails midway leaves the remainder to the pool
+        vector<bool> finished(items.size(), false);
+        Completion track = [&](const BatchItem& item, int err) {
+            finished[&item - items.data()] = true;
+            if (done) done(item, err);
+        };
+        
+        if (!runUring(op, items, track, outcome)) {
+            vector<BatchItem> rest;
+            for (size_t i = 0; i < items.size(); i++) {
+                if (!finished[i]) rest.push_back(items[i]);
+            }
+            const char* backend = outcome.succeeded + outcome.failed ? "io_uring + thread pool" : "thread pool";
+            runThreadPool(op, rest, done, outcome);
+            outcome.backend = backend;
+        }
+        outcome.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return outcome;
+    }
+};
+
+// Live progress line for long recursive jobs. Workers bump the counters;
+// a printer thread redraws the line a few times a second when stdout is a
+// terminal, so the counters stay cheap atomics.
+class ProgressMeter {
+private:
+    const char* label;
+    atomic<uint64_t> items{0};
+    atomic<uint64_t> bytes{0};
+    atomic<bool> stopping{false};
+    thread printer;
+    chrono::steady_clock::time_point startTime;
+    
+    void print(bool final) {
+        double secs = elapsed();
+        double mb = bytes.load() / (1024.0 * 1024.0);
+        char line[160];
+        snprintf(line, sizeof(line), "\r  %llu %s, %.1f MB, %.1f MB/s, %.0f %s/s   ",
+                 static_cast<unsigned long long>(items.load()), label, mb,
+                 secs > 0 ? mb / secs : 0.0, secs > 0 ? items.load() / secs : 0.0, label);
+        cout << line;
+        if (final) cout << '\n';
+        cout.flush();
+    }
+    
+public:
+    explicit ProgressMeter(const char* unitLabel) : label(unitLabel) {
+        startTime = chrono::steady_clock::now();
+        if (isatty(STDOUT_FILENO)) {
+            printer = thread([this] {
+                while (!stopping.load()) {
+                    this_thread::sleep_for(chrono::milliseconds(250));
+                    if (!stopping.load()) print(false);
+                }
+            });
+        }
+    }
+    
+    ~ProgressMeter() {
+        stop();
+    }
+    
+    void add(uint64_t n, uint64_t b) {
+        items.fetch_add(n, memory_order_relaxed);
+        bytes.fetch_add(b, memory_order_relaxed);
+    }
+    
+    double elapsed() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    }
+    
+    void stop() {
+        if (stopping.exchange(true)) return;
+        if (printer.joinable()) {
+            printer.join();
+            print(true);
+        }
+    }
+};
+
+struct TreeResult {
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    uint64_t skipped = 0;       // files already complete at the destination
+    double seconds = 0;
+};
+
+// Append-only record of the files a recursive copy has finished, kept
+// beside the destination as DEST.fe-journal. A record holds the file's
+// path below the copy root and the size and mtime it was copied at, so a
+// re-run skips a file only while the source is still that version. The
+// journal outlives a completed copy: running the copy again then acts as
+// an incremental sync into the same destination.
+// Records are appended once per batch of files without fsync: a crash can
+// lose the last few (they are copied again) and a torn record at the end
+// is dropped when the journal is reopened.
+class CopyJournal {
+public:
+    static constexpr const char* kSuffix = ".fe-journal";
+    
+private:
+    static constexpr char kMagic[8] = {'F', 'E', 'J', 'R', 'N', 'L', '1', '\n'};
+    static constexpr size_t kRecordHead = 4 + 8 + 8;    // path length, size, mtime
+    
+    struct Version {
+        uint64_t size;
+        int64_t mtime;
+    };
+    
+    int fd = -1;
+    string path;
+    unordered_map<string, Version> done;    // read-only once open() returns
+    mutex writeMtx;
+    
+    static int64_t nanos(const struct timespec& t) {
+        return static_cast<int64_t>(t.tv_sec) * 1000000000LL + t.tv_nsec;
+    }
+    
+    template <typename T>
+    static T load(const char* p) {
+        T v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    
+    template <typename T>
+    static void store(string& out, T v) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+    
+    bool writeAll(const string& data) {
+        for (size_t off = 0; off < data.size();) {
+            ssize_t n = write(fd, data.data() + off, data.size() - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            off += n;
+        }
+        return true;
+    }
+    
+    // Parses the journal read into data; returns the length of the valid
+    // prefix, or 0 if it does not belong to a copy of source
+    size_t parse(const string& data, const string& source) {
+        size_t pos = sizeof(kMagic) + 4;
+        if (data.size() < pos || memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) return 0;
+        uint32_t len = load<uint32_t>(data.data() + sizeof(kMagic));
+        if (data.size() - pos < len || data.compare(pos, len, source) != 0) return 0;
+        pos += len;
+        while (data.size() - pos >= kRecordHead) {
+            const char* p = data.data() + pos;
+            uint32_t nameLen = load<uint32_t>(p);
+            if (data.size() - pos - kRecordHead < nameLen) break;
+            done[data.substr(pos + kRecordHead, nameLen)] = Version{load<uint64_t>(p + 4), load<int64_t>(p + 12)};
+            pos += kRecordHead + nameLen;
+        }
+        return pos;
+    }
+    
+public:
+    CopyJournal() = default;
+    CopyJournal(const CopyJournal&) = delete;
+    CopyJournal& operator=(const CopyJournal&) = delete;
+    
+    ~CopyJournal() {
+        if (fd >= 0) ::close(fd);
+    }
+    
+    static bool exists(const string& dest) {
+        return access((dest + kSuffix).c_str(), F_OK) == 0;
+    }
+    
+    // Opens the journal of a copy of source into dest, creating it if
+    // needed. A journal left by a copy of some other source starts over.
+    bool open(const string& source, const string& dest) {
+        path = dest + kSuffix;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        
+        string data;
+        char buf[64 << 10];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) data.append(buf, n);
+        if (n < 0) return false;
+        
+        size_t valid = parse(data, source);
+        if (valid != data.size() && ftruncate(fd, valid) != 0) return false;
+        if (valid > 0) return true;
+        
+        done.clear();
+        string header(kMagic, sizeof(kMagic));
+        store<uint32_t>(header, static_cast<uint32_t>(source.size()));
+        header += source;
+        return writeAll(header);
+    }
+    
+    // Files recorded by earlier runs
+    size_t size() const {
+        return done.size();
+    }
+    
+    // True if rel was copied while the source looked as it does in st
+    bool finished(const string& rel, const struct stat& st) const {
+        auto it = done.find(rel);
+        return it != done.end() && it->second.size == static_cast<uint64_t>(st.st_size) &&
+               it->second.mtime == nanos(st.st_mtim);
+    }
+    
+    // Adds the record of one finished file to records, for append()
+    static void add(string& records, const string& rel, const struct stat& st) {
+        store<uint32_t>(records, static_cast<uint32_t>(rel.size()));
+        store<uint64_t>(records, st.st_size);
+        store<int64_t>(records, nanos(st.st_mtim));
+        records += rel;
+    }
+    
+    // Writes a batch of records; safe to call from several threads
+    bool append(const string& records) {
+        if (records.empty()) return true;
+        lock_guard<mutex> lock(writeMtx);
+        return writeAll(records);
+    }
+};
+
+// How a recursive copy or delete runs: pace limits for shared storage,
+// and for copies a journal to resume from and the incremental check that
+// skips files whose destination already has the source's size and mtime
+struct TreeOptions {
+    Throttle* throttle = nullptr;
+    CopyJournal* journal = nullptr;
+    bool incremental = false;
+};
+
+// Recursive copy and delete on top of the parallel walker. Everything below
+// the root is addressed relative to open directory descriptors
+// (openat/mkdirat/unlinkat), so the kernel never re-walks long paths.
+class TreeOps {
+private:
+    // One directory of a copy. Subdirectories hold their parent, so the
+    // last reference goes once everything below it has been copied; only
+    // then does the destination get the source's mode, so read-only source
+    // directories still fill in.
+    struct DirPair {
+        int srcFd = -1;
+        int destFd = -1;
+        string rel;             // path below the copy root, "" for the root itself
+        shared_ptr<DirPair> parent;
+        mode_t mode = 0;
+        atomic<uint64_t>* errors = nullptr;
+        ~DirPair() {
+            if (srcFd >= 0) close(srcFd);
+            if (destFd >= 0) {
+                if (errors && fchmod(destFd, mode) != 0) (*errors)++;
+                close(destFd);
+            }
+        }
+    };
+    
+    static constexpr size_t kFileBatch = 64;
+    
+    // Counters and settings shared by the workers of one copyTree()
+    struct CopyState {
+        const TreeOptions& opts;
+        ProgressMeter* progress;
+        atomic<uint64_t> files{0}, bytes{0}, errors{0}, skipped{0};
+        
+        explicit CopyState(const TreeOptions& o, ProgressMeter* p) : opts(o), progress(p) {}
+        bool resuming() const { return opts.journal || opts.incremental; }
+    };
+    
+    static bool sameTime(const struct timespec& a, const struct timespec& b) {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+    
+    // Copies one regular file. Returns true if the destination now holds
+    // the version of the source described by st and the journal should say
+    // so; files the journal already lists return false.
+    static bool copyOne(const DirPair& dirs, const string& name, const string& rel, CopyState& state,
+                        struct stat& st) {
+        const TreeOptions& opts = state.opts;
+        if (state.resuming()) {
+            if (fstatat(dirs.srcFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                state.errors++;
+                return false;
+            }
+            if (opts.journal && opts.journal->finished(rel, st)) {
+                state.skipped++;
+                return false;
+            }
+            struct stat destSt;
+            if (opts.incremental && fstatat(dirs.destFd, name.c_str(), &destSt, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISREG(destSt.st_mode) && destSt.st_size == st.st_size && sameTime(destSt.st_mtim, st.st_mtim)) {
+                state.skipped++;
+                return true;
+            }
+        }
+        if (opts.throttle) opts.throttle->ops.take(1);
+        
+        // Neither side follows a symlink that replaced the file
+        int srcFd = openat(dirs.srcFd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (srcFd < 0 || fstat(srcFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            if (srcFd >= 0) close(srcFd);
+            state.errors++;
+            return false;
+        }
+        CopyResult r = CopyEngine::copyOpened(srcFd, st, dirs.destFd, name.c_str(), false,
+                                              opts.throttle ? &opts.throttle->bytes : nullptr, O_NOFOLLOW);
+        close(srcFd);
+        if (r.ok && state.resuming()) {
+            // The incremental check of the next run compares mtimes
+            struct timespec times[2] = {{0, UTIME_OMIT}, st.st_mtim};
+            utimensat(dirs.destFd, name.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+        if (!r.ok) {
+            state.errors++;
+            return false;
+        }
+        state.files++;
+        state.bytes += r.bytes;
+        if (state.progress) state.progress->add(1, r.bytes);
+        return true;
+    }
+    
+    // Removes a directory that was still not empty after the walk, for
+    // entries the walk missed: up to two sweeps unlink what sits directly
+    // in it and retry. Nothing recurses, so an entry that can't be deleted
+    // costs the same at any depth.
+    static bool sweepDirectory(int parentFd, const string& name, atomic<uint64_t>& files,
+                               ProgressMeter* progress, const TreeOptions& opts) {
+        for (int pass = 0; pass < 2; pass++) {
+            DirReader reader(64 << 10);
+            if (!reader.openAt(parentFd, name.c_str())) return false;
+            DirReader::Entry entry;
+            while (reader.next(entry)) {
+                if (entry.type == DT_DIR) continue;
+                if (opts.throttle) opts.throttle->ops.take(1);
+                if (unlinkat(reader.fdNum(), entry.name.data(), 0) == 0) {
+                    files++;
+                    if (progress) progress->add(1, 0);
+                }
+            }
+            reader.close();
+            if (unlinkat(parentFd, name.c_str(), AT_REMOVEDIR) == 0) return true;
+            if (errno != ENOTEMPTY) return false;
+        }
+        return false;
+    }
+    
+public:
+    // Path without trailing slashes ("/" stays "/"), so that appending
+    // "/name" to it or slicing a walker path by its length stays exact
+    static string rootPath(string path) {
+        while (path.size() > 1 && path.back() == '/') path.pop_back();
+        return path;
+    }
+    
+    // True if path, or its nearest existing ancestor, is the directory root
+    // describes or lies below it. Steps up through ".." by descriptor, so
+    // symlinks and different spellings of the same place can't hide it.
+    static bool isWithin(string path, const struct stat& root) {
+        int fd;
+        while ((fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            size_t slash = path.find_last_of('/');
+            if (path == "/" || path == ".") return false;
+            path = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        }
+        bool within = false;
+        struct stat st;
+        while (fstat(fd, &st) == 0) {
+            if (st.st_dev == root.st_dev && st.st_ino == root.st_ino) {
+                within = true;
+                break;
+            }
+            int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            struct stat parentSt;
+            if (parent < 0 || fstat(parent, &parentSt) != 0 ||
+                (parentSt.st_dev == st.st_dev && parentSt.st_ino == st.st_ino)) {
+                if (parent >= 0) close(parent);
+                break;
+            }
+            close(fd);
+            fd = parent;
+        }
+        close(fd);
+        return within;
+    }
+    
+    // Copies the directory tree at src to dest (which must not exist yet,
+    // unless opts resume an earlier copy into it). Directories are created
+    // as each parent is listed, so creation always follows dependency
+    // order, and opened relative to the parent's descriptor without
+    // following symlinks; file copies are queued in batches as walker
+    // tasks and stolen by idle workers.
+    static TreeResult copyTree(const string& src, const string& dest, ProgressMeter* progress = nullptr,
+                               const TreeOptions& opts = TreeOptions()) {
+        TreeResult result;
+        auto start = chrono::steady_clock::now();
+        CopyState state(opts, progress);
+        struct stat destStat;
+        if (mkdir(dest.c_str(), 0700) != 0 &&
+            !(errno == EEXIST && state.resuming() && stat(dest.c_str(), &destStat) == 0 && S_ISDIR(destStat.st_mode))) {
+            result.errors++;
+            return result;
+        }
+        
+        ParallelWalker walker;
+        unsigned n = walker.workers();
+        vector<shared_ptr<DirPair>> current(n);
+        vector<vector<string>> pendingFiles(n);
+        // Destination parent of each directory queued but not yet entered
+        mutex parentMtx;
+        unordered_map<string, shared_ptr<DirPair>> parents;
+        atomic<uint64_t> dirCount{0};
+        atomic<uint64_t>& files = state.files;
+        atomic<uint64_t>& errors = state.errors;
+        
+        auto flush = [&](unsigned worker) {
+            if (pendingFiles[worker].empty()) return;
+            shared_ptr<DirPair> dirs = current[worker];
+            auto names = make_shared<vector<string>>(move(pendingFiles[worker]));
+            pendingFiles[worker].clear();
+            walker.spawn(worker, [&, dirs, names](unsigned) {
+                string records, rel;
+                struct stat st;
+                for (const auto& name : *names) {
+                    rel.assign(dirs->rel).append(1, '/').append(name);
+                    if (copyOne(*dirs, name, rel, state, st) && opts.journal) CopyJournal::add(records, rel, st);
+                }
+                if (opts.journal && !opts.journal->append(records)) errors++;
+            });
+        };
+        
+        walker.walk(src,
+            [&](const WalkEntry& e) {
+                const DirPair& dirs = *current[e.worker];
+                if (dirs.destFd < 0) {
+                    errors++;
+                    return false;
+                }
+                const char* name = e.name.data();
+                if (opts.throttle && e.type != DT_REG) opts.throttle->ops.take(1);
+                switch (e.type) {
+                    case DT_DIR:
+                        if (mkdirat(dirs.destFd, name, 0700) != 0 && errno != EEXIST) {
+                            errors++;
+                            return false;
+                        }
+                        {
+                            lock_guard<mutex> lock(parentMtx);
+                            parents[dirs.rel + '/' + name] = current[e.worker];
+                        }
+                        return true;
+                    case DT_REG:
+                        pendingFiles[e.worker].emplace_back(e.name);
+                        if (pendingFiles[e.worker].size() >= kFileBatch) flush(e.worker);
+                        return false;
+                    case DT_LNK: {
+                        char target[PATH_MAX];
+                        ssize_t len = readlinkat(e.dirFd, name, target, sizeof(target) - 1);
+                        if (len < 0) {
+                            errors++;
+                            return false;
+                        }
+                        target[len] = '\0';
+                        int made = symlinkat(target, dirs.destFd, name);
+                        if (made != 0 && errno == EEXIST && state.resuming() && unlinkat(dirs.destFd, name, 0) == 0) {
+                            // Left by the run being resumed; links are cheaper to redo than compare
+                            made = symlinkat(target, dirs.destFd, name);
+                        }
+                        if (made != 0) errors++;
+                        else files++;
+                        return false;
+                    }
+                    default:
+                        // Devices, FIFOs and sockets are not copied
+                        errors++;
+                        return false;
+                }
+            },
+            [&](const string& path, unsigned, unsigned worker, int dirFd) {
+                auto dirs = make_shared<DirPair>();
+                dirs->srcFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+                // The walker joins names to a root ending in '/' without adding one
+                dirs->rel = path.substr(min(src.size(), path.size()));
+                if (!dirs->rel.empty() && dirs->rel[0] != '/') dirs->rel.insert(0, 1, '/');
+                if (dirs->rel.empty()) {
+                    dirs->destFd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                } else {
+                    {
+                        lock_guard<mutex> lock(parentMtx);
+                        auto it = parents.find(dirs->rel);
+                        if (it != parents.end()) {
+                            dirs->parent = move(it->second);
+                            parents.erase(it);
+                        }
+                    }
+                    const char* name = dirs->rel.c_str() + dirs->rel.rfind('/') + 1;
+                    if (dirs->parent && dirs->parent->destFd >= 0) {
+                        dirs->destFd = openat(dirs->parent->destFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    }
+                }
+                struct stat st;
+                if (dirs->destFd >= 0 && fstat(dirFd, &st) == 0) {
+                    dirs->mode = st.st_mode & 07777;
+                    dirs->errors = &errors;
+                }
+                current[worker] = dirs;
+                dirCount++;
+            },
+            [&](const string&, unsigned, unsigned worker, int) {
+                flush(worker);
+                current[worker].reset();
+            });
+        
+        // Directories the walker could not enter
+        parents.clear();
+        
+        result.files = files;
+        result.dirs = dirCount;
+        result.bytes = state.bytes;
+        result.errors = errors;
+        result.skipped = state.skipped;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+    
+    // Deletes the tree at root. Workers unlink files relative to the
+    // descriptor of the directory being listed, and each directory is
+    // removed relative to its parent's descriptor as soon as everything
+    // below it is gone; nothing is reopened by path, so a directory swapped
+    // for a symlink mid-delete can't redirect it elsewhere.
+    // Only the throttle of opts applies: an interrupted delete resumes by
+    // simply running again over what is left.
+    static TreeResult removeTree(const string& rootArg, ProgressMeter* progress = nullptr,
+                                 const TreeOptions& opts = TreeOptions()) {
+        TreeResult result;
+        auto start = chrono::steady_clock::now();
+        const string root = rootPath(rootArg);
+        
+        ParallelWalker walker;
+        atomic<uint64_t> files{0}, dirs{0}, errors{0};
+        
+        bool walked = walker.walkTree(root,
+            [&](const WalkEntry& e) {
+                if (e.type == DT_DIR) return true;
+                if (opts.throttle) opts.throttle->ops.take(1);
+                if (unlinkat(e.dirFd, e.name.data(), 0) == 0) {
+                    files++;
+                    if (progress) progress->add(1, 0);
+                } else {
+                    errors++;
+                }
+                return false;
+            },
+            [&](int parentFd, const char* name) {
+                if (opts.throttle) opts.throttle->ops.take(1);
+                if (unlinkat(parentFd, name, AT_REMOVEDIR) == 0) {
+                    dirs++;
+                } else if (errno == ENOTEMPTY && sweepDirectory(parentFd, name, files, progress, opts)) {
+                    // Entries unlinked while the directory was being read can
+                    // shift others past the read position; the sweep caught them
+                    dirs++;
+                } else {
+                    errors++;
+                }
+            });
+        if (!walked) errors++;
+        
+        result.dirs = dirs;
+        result.files = files;
+        result.errors = errors;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+};
+
+// Space used by one directory subtree
+struct UsageTotals {
+    uint64_t diskBytes = 0;         // allocated, from st_blocks
+    uint64_t apparentBytes = 0;     // sum of st_size
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    
+    void add(const UsageTotals& o) {
+        diskBytes += o.diskBytes;
+        apparentBytes += o.apparentBytes;
+        files += o.files;
+        dirs += o.dirs;
+    }
+};
+
+// Set of (dev, ino) pairs shared by walker threads. Sharded by inode so
+// concurrent inserts rarely meet on the same lock.
+class InodeSet {
+private:
+    struct Shard {
+        mutex mtx;
+        set<pair<dev_t, ino_t>> seen;
+    };
+    static constexpr size_t kShards = 64;
+    Shard shards[kShards];
+    
+public:
+    // True if the pair was not in the set yet
+    bool insert(dev_t dev, ino_t ino) {
+        Shard& s = shards[(ino * 0x9e3779b97f4a7c15ULL >> 58) % kShards];
+        lock_guard<mutex> lock(s.mtx);
+        return s.seen.emplace(dev, ino).second;
+    }
+};
+
+// Recursive disk usage on the parallel walker. Every worker tallies the
+// entries of the directory it is listing into its own table, so the walk
+// takes no shared lock except for files with several links, which are
+// counted once per (dev, ino). Directories on another device are not
+// entered. The per-directory tallies are then folded bottom-up into
+// subtree totals: in descending path order every child sorts before its
+// parent, so one reverse pass suffices. The resulting report is kept so
+// that a subdirectory can be drilled into without another walk.
+class UsageAnalyzer {
+public:
+    struct Report {
+        string root;
+        map<string, UsageTotals> subtrees;      // every directory below root, and root
+        uint64_t hardlinksSkipped = 0;
+        uint64_t mountsSkipped = 0;
+        uint64_t errors = 0;
+        double seconds = 0;
+        chrono::steady_clock::time_point taken;
+        
+        bool covers(const string& path) const {
+            return subtrees.count(path) > 0;
+        }
+    };
+    
+    static bool analyze(const string& root, Report& out) {
+        struct stat rootStat;
+        if (stat(root.c_str(), &rootStat) != 0 || !S_ISDIR(rootStat.st_mode)) return false;
+        auto start = chrono::steady_clock::now();
+        
+        ParallelWalker walker;
+        unsigned workers = walker.workers();
+        vector<unordered_map<string, UsageTotals>> tallies(workers);
+        vector<UsageTotals*> current(workers, nullptr);
+        InodeSet links;
+        atomic<uint64_t> hardlinks{0}, mounts{0}, errors{0};
+        MetaFetcher meta(MetaFetcher::Mode | MetaFetcher::Size | MetaFetcher::Blocks |
+                         MetaFetcher::Links | MetaFetcher::Inode);
+        
+        walker.walk(root,
+            [&](const WalkEntry& e) {
+                EntryMeta info;
+                if (!meta.fetch(e.dirFd, e.name.data(), e.type, info)) {
+                    errors++;
+                    return false;
+                }
+                if (S_ISDIR(info.mode)) {
+                    // Mount points are left out together with their contents
+                    if (info.dev != rootStat.st_dev) {
+                        mounts++;
+                        return false;
+                    }
+                    return true;        // counted by the enter hook
+                }
+                if (info.nlink > 1 && !links.insert(info.dev, info.ino)) {
+                    hardlinks++;
+                    return false;
+                }
+                UsageTotals& t = *current[e.worker];
+                t.diskBytes += info.blocks * 512;
+                t.apparentBytes += info.size;
+                t.files++;
+                return false;
+            },
+            [&](const string& path, unsigned, unsigned worker, int dirFd) {
+                UsageTotals& t = tallies[worker][path];
+                current[worker] = &t;
+                struct stat st;
+                if (fstat(dirFd, &st) == 0) {
+                    t.diskBytes += st.st_blocks * 512;
+                    t.apparentBytes += st.st_size;
+                }
+                t.dirs++;
+            });
+        
+        out = Report();
+        out.root = root;
+        for (auto& table : tallies) {
+            for (auto& kv : table) out.subtrees[kv.first].add(kv.second);
+        }
+        for (auto it = out.subtrees.rbegin(); it != out.subtrees.rend(); ++it) {
+            if (it->first == root) continue;
+            size_t slash = it->first.find_last_of('/');
+            string parent = slash == 0 ? "/" : it->first.substr(0, slash);
+            auto p = out.subtrees.find(parent);
+            if (p != out.subtrees.end()) p->second.add(it->second);
+        }
+        out.hardlinksSkipped = hardlinks;
+        out.mountsSkipped = mounts;
+        out.errors = errors;
+        out.taken = chrono::steady_clock::now();
+        out.seconds = chrono::duration<double>(out.taken - start).count();
+        return true;
+    }
+    
+    // Immediate subdirectories of path, largest first
+    static vector<pair<string, UsageTotals>> children(const Report& report, const string& path) {
+        vector<pair<string, UsageTotals>> out;
+        string prefix = path;
+        if (prefix.back() != '/') prefix += '/';
+        for (auto it = report.subtrees.lower_bound(prefix);
+             it != report.subtrees.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (it->first.find('/', prefix.size()) == string::npos) out.push_back(*it);
+        }
+        sort(out.begin(), out.end(), [](const pair<string, UsageTotals>& a, const pair<string, UsageTotals>& b) {
+            return a.second.diskBytes > b.second.diskBytes;
+        });
+        return out;
+    }
+    
+    // The n largest directories anywhere below path
+    static vector<pair<string, UsageTotals>> largest(const Report& report, const string& path, size_t n) {
+        vector<pair<string, UsageTotals>> out;
+        string prefix = path;
+        if (prefix.back() != '/') prefix += '/';
+        for (auto it = report.subtrees.lower_bound(prefix);
+             it != report.subtrees.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            out.push_back(*it);
+        }
+        auto bySize = [](const pair<string, UsageTotals>& a, const pair<string, UsageTotals>& b) {
+            return a.second.diskBytes > b.second.diskBytes;
+        };
+        if (out.size() > n) {
+            partial_sort(out.begin(), out.begin() + n, out.end(), bySize);
+            out.resize(n);
+        } else {
+            sort(out.begin(), out.end(), bySize);
+        }
+        return out;
+    }
+};
+
+// Files with identical contents
+struct DuplicateGroup {
+    uint64_t size = 0;
+    uint64_t hash = 0;
+    vector<string> paths;       // sorted; the first one is kept when replacing
+    
+    uint64_t wastedBytes() const {
+        return size * (paths.size() - 1);
+    }
+};
+
+// Finds duplicate files in stages, each one only looking at the survivors
+// of the last: equal sizes from one parallel walk, then an XXH64 of the
+// first and last 4 KiB, then an XXH64 of the whole file read sequentially
+// in 1 MiB blocks. Names sharing an inode are hard links already and count
+// as one file. Hashing runs on a small thread pool.
+class DuplicateFinder {
+public:
+    struct Stats {
+        uint64_t files = 0;
+        uint64_t sameSize = 0;          // files left after grouping by size
+        uint64_t samePartial = 0;       // files left after the partial hash
+        uint64_t hashedBytes = 0;
+        double seconds = 0;
+    };
+    
+    enum class Replace { Hardlink, Reflink };
+    
+private:
+    struct Candidate {
+        string path;
+        uint64_t size;
+        dev_t dev;
+        ino_t ino;
+        uint64_t hash = 0;
+        bool readable = true;
+    };
+    
+    static constexpr size_t kEdge = 4096;
+    static constexpr size_t kBlock = 1 << 20;
+    
+    static void parallelFor(size_t count, const function<void(size_t, vector<char>&)>& work) {
+        unsigned threads = min<unsigned>(max(1u, thread::hardware_concurrency()), 8);
+        if (count < threads) threads = max<size_t>(count, 1);
+        atomic<size_t> next{0};
+        auto loop = [&] {
+            vector<char> buffer;
+            for (size_t i = next++; i < count; i = next++) work(i, buffer);
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) pool.emplace_back(loop);
+        loop();
+        for (auto& t : pool) t.join();
+    }
+    
+    static bool partialHash(Candidate& c, vector<char>& buffer) {
+        int fd = open(c.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) return false;
+        buffer.resize(2 * kEdge);
+        size_t head = min<uint64_t>(c.size, kEdge);
+        size_t tail = c.size > kEdge ? min<uint64_t>(c.size - kEdge, kEdge) : 0;
+        bool ok = pread(fd, buffer.data(), head, 0) == static_cast<ssize_t>(head) &&
+                  (tail == 0 || pread(fd, buffer.data() + head, tail, c.size - tail) == static_cast<ssize_t>(tail));
+        close(fd);
+        if (ok) c.hash = Xxh64::hash(buffer.data(), head + tail);
+        return ok;
+    }
+    
+    static bool fullHash(Candidate& c, vector<char>& buffer, atomic<uint64_t>& hashed) {
+        int fd = open(c.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) return false;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        buffer.resize(kBlock);
+        Xxh64 h(c.size);
+        uint64_t done = 0;
+        while (done < c.size) {
+            ssize_t n = FE_TIMED(Read, read(fd, buffer.data(), buffer.size()));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            h.update(buffer.data(), n);
+            done += n;
+        }
+        close(fd);
+        hashed += done;
+        c.hash = h.digest();
+        return done == c.size;
+    }
+    
+    // Keeps only groups of two or more candidates with equal (size, hash)
+    static void regroup(vector<Candidate>& files) {
+        sort(files.begin(), files.end(), [](const Candidate& a, const Candidate& b) {
+            if (a.size != b.size) return a.size < b.size;
+            return a.hash < b.hash;
+        });
+        vector<Candidate> kept;
+        for (size_t i = 0; i < files.size();) {
+            size_t j = i + 1;
+            while (j < files.size() && files[j].size == files[i].size && files[j].hash == files[i].hash) j++;
+            if (j - i > 1) {
+                for (size_t k = i; k < j; k++) kept.push_back(move(files[k]));
+            }
+            i = j;
+        }
+        files.swap(kept);
+    }
+    
+    static void dropUnreadable(vector<Candidate>& files) {
+        files.erase(remove_if(files.begin(), files.end(), [](const Candidate& c) { return !c.readable; }),
+                    files.end());
+    }
+    
+public:
+    static vector<DuplicateGroup> find(const string& root, uint64_t minSize, Stats& stats) {
+        auto start = chrono::steady_clock::now();
+        stats = Stats();
+        
+        ParallelWalker walker;
+        vector<vector<Candidate>> found(walker.workers());
+        MetaFetcher meta(MetaFetcher::Mode | MetaFetcher::Size | MetaFetcher::Inode);
+        walker.walk(root, [&](const WalkEntry& e) {
+            if (e.type == DT_DIR) return true;
+            if (e.type != DT_REG) return false;
+            EntryMeta info;
+            if (!meta.fetch(e.dirFd, e.name.data(), e.type, info) || !S_ISREG(info.mode)) return false;
+            if (info.size == 0 || info.size < minSize) return false;
+            string path = e.dirPath;
+            if (path.back() != '/') path += '/';
+            path += e.name;
+            found[e.worker].push_back(Candidate{move(path), info.size, info.dev, info.ino});
+            return false;
+        });
+        
+        vector<Candidate> files;
+        for (auto& v : found) {
+            files.insert(files.end(), make_move_iterator(v.begin()), make_move_iterator(v.end()));
+        }
+        stats.files = files.size();
+        
+        // Several names for one inode are one file: keep the first name only
+        sort(files.begin(), files.end(), [](const Candidate& a, const Candidate& b) {
+            if (a.dev != b.dev) return a.dev < b.dev;
+            if (a.ino != b.ino) return a.ino < b.ino;
+            return a.path < b.path;
+        });
+        files.erase(unique(files.begin(), files.end(), [](const Candidate& a, const Candidate& b) {
+            return a.dev == b.dev && a.ino == b.ino;
+        }), files.end());
+        
+        // Stage 1: sizes (hash is still zero everywhere)
+        regroup(files);
+        stats.sameSize = files.size();
+        
+        // Stage 2: first and last 4 KiB
+        parallelFor(files.size(), [&](size_t i, vector<char>& buffer) {
+            files[i].readable = partialHash(files[i], buffer);
+        });
+        dropUnreadable(files);
+        regroup(files);
+        stats.samePartial = files.size();
+        
+        // Stage 3: whole contents, unless the edges already covered them
+        atomic<uint64_t> hashed{0};
+        parallelFor(files.size(), [&](size_t i, vector<char>& buffer) {
+            if (files[i].size > 2 * kEdge) files[i].readable = fullHash(files[i], buffer, hashed);
+        });
+        dropUnreadable(files);
+        regroup(files);
+        stats.hashedBytes = hashed;
+        
+        vector<DuplicateGroup> groups;
+        for (size_t i = 0; i < files.size();) {
+            DuplicateGroup g;
+            g.size = files[i].size;
+            g.hash = files[i].hash;
+            size_t j = i;
+            for (; j < files.size() && files[j].size == g.size && files[j].hash == g.hash; j++) {
+                g.paths.push_back(move(files[j].path));
+            }
+            sort(g.paths.begin(), g.paths.end());
+            groups.push_back(move(g));
+            i = j;
+        }
+        sort(groups.begin(), groups.end(), [](const DuplicateGroup& a, const DuplicateGroup& b) {
+            return a.wastedBytes() > b.wastedBytes();
+        });
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return groups;
+    }
+    
+    // Byte-for-byte comparison of two open files of the given size
+    static bool sameContents(int a, int b, uint64_t size) {
+        vector<char> x(kBlock), y(kBlock);
+        for (uint64_t off = 0; off < size;) {
+            size_t want = min<uint64_t>(kBlock, size - off);
+            if (pread(a, x.data(), want, off) != static_cast<ssize_t>(want) ||
+                pread(b, y.data(), want, off) != static_cast<ssize_t>(want) ||
+                memcmp(x.data(), y.data(), want) != 0) {
+                return false;
+            }
+            off += want;
+        }
+        return true;
+    }
+    
+    // Replaces dup by a hard link to, or a reflinked copy of, keeper. The
+    // new file is built under a temporary name beside dup and renamed over
+    // it, so dup is never missing. Contents are compared first.
+    static bool replace(const string& keeper, const string& dup, Replace how, const char*& error) {
+        int keepFd = open(keeper.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int dupFd = open(dup.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat keepStat, dupStat;
+        bool same = keepFd >= 0 && dupFd >= 0 && fstat(keepFd, &keepStat) == 0 && fstat(dupFd, &dupStat) == 0 &&
+                    keepStat.st_size == dupStat.st_size && sameContents(keepFd, dupFd, keepStat.st_size);
+        if (dupFd >= 0) close(dupFd);
+        if (!same) {
+            if (keepFd >= 0) close(keepFd);
+            error = "Contents differ or cannot be read";
+            return false;
+        }
+        
+        string temp = dup + ".dedup-" + to_string(getpid());
+        bool ok;
+        if (how == Replace::Hardlink) {
+            ok = link(keeper.c_str(), temp.c_str()) == 0;
+            if (!ok) error = errno == EXDEV ? "Different filesystem" : "Cannot create hard link";
+        } else {
+            int tempFd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, dupStat.st_mode & 07777);
+            ok = tempFd >= 0 && CopyEngine::reflink(keepFd, tempFd);
+            if (!ok) error = "Filesystem does not support reflinks";
+            if (tempFd >= 0) {
+                if (ok) {
+                    fchmod(tempFd, dupStat.st_mode & 07777);
+                    struct timespec times[2] = {dupStat.st_atim, dupStat.st_mtim};
+                    futimens(tempFd, times);
+                }
+                close(tempFd);
+                if (!ok) unlink(temp.c_str());
+            }
+        }
+        close(keepFd);
+        if (!ok) return false;
+        
+        if (rename(temp.c_str(), dup.c_str()) != 0) {
+            unlink(temp.c_str());
+            error = "Cannot replace file";
+            return false;
+        }
+        return true;
+    }
+};
+
+// find-style metadata search expression: -name/-iname GLOB, -type
+// f|d|l|p|s|c|b, -size [+-]N[bcwkMG], -mtime/-mmin [+-]N, -user, -group,
+// -perm [-/]MODE, combined with implicit AND, -o, ! and parentheses, plus
+// -mindepth/-maxdepth. The planner orders the operands of every AND and
+// OR so that depth, d_type and name tests run before anything that needs
+// statx, and computes the union of fields the stat tests read; an entry
+// is stat-ed at most once, with that mask, and only when a cheap test
+// did not already decide the expression.
+class SearchQuery {
+public:
+    // State for one entry while the expression is evaluated
+    struct EntryProbe {
+        const WalkEntry& entry;
+        unsigned mask;
+        EntryMeta info;
+        bool fetched = false;
+        bool failed = false;
+        uint64_t statCalls = 0;
+        
+        EntryProbe(const WalkEntry& e, unsigned fields) : entry(e), mask(fields | MetaFetcher::Type) {}
+        
+        const EntryMeta* meta() {
+            if (!fetched) {
+                fetched = true;
+                statCalls++;
+                failed = !MetaFetcher(mask).fetch(entry.dirFd, entry.name.data(), entry.type, info);
+            }
+            return failed ? nullptr : &info;
+        }
+    };
+    
+private:
+    enum class Op { And, Or, Not, Name, Type, Size, MTime, User, Group, Perm };
+    
+    struct Node {
+        Op op;
+        vector<unique_ptr<Node>> kids;
+        unique_ptr<NameMatcher> matcher;
+        string text;            // operand as written, for describe()
+        char cmp = '=';         // '<', '=' or '>'
+        int64_t value = 0;
+        int64_t unit = 1;       // bytes per size unit, seconds per time unit
+        unsigned char dtype = DT_UNKNOWN;
+        char permKind = '=';    // '=' exact, '-' all bits, '/' any bit
+        unsigned cost = 0;
+        unsigned fields = 0;
+    };
+    
+    unique_ptr<Node> root;
+    string err;
+    unsigned minDepth = 0;
+    unsigned maxDepth = UINT_MAX;
+    unsigned statMask = 0;
+    time_t now = time(nullptr);
+    
+    const vector<string>* words = nullptr;
+    size_t pos = 0;
+    
+    bool fail(const string& message) {
+        if (err.empty()) err = message;
+        return false;
+    }
+    
+    bool operand(string& out) {
+        if (pos >= words->size()) return fail((*words)[pos - 1] + " needs an argument");
+        out = (*words)[pos++];
+        return true;
+    }
+    
+    // "+N", "-N" or "N" with an optional unit suffix from units
+    bool comparison(Node& n, const string& arg, const char* units, const int64_t* scales) {
+        size_t i = 0;
+        if (!arg.empty() && (arg[0] == '+' || arg[0] == '-')) {
+            n.cmp = arg[0] == '+' ? '>' : '<';
+            i = 1;
+        }
+        const char* begin = arg.c_str() + i;
+        char* end;
+        n.value = strtoll(begin, &end, 10);
+        if (end == begin || n.value < 0) return fail("bad number: " + arg);
+        if (*end) {
+            const char* u = strchr(units, *end);
+            if (!u || end[1]) return fail("bad unit in " + arg);
+            n.unit = scales[u - units];
+        }
+        return true;
+    }
+    
+    static bool lookupUser(const string& name, uint32_t& id) {
+        char* end;
+        unsigned long v = strtoul(name.c_str(), &end, 10);
+        if (!name.empty() && !*end) {
+            id = v;
+            return true;
+        }
+        struct passwd pw, *found = nullptr;
+        char buf[4096];
+        if (getpwnam_r(name.c_str(), &pw, buf, sizeof(buf), &found) != 0 || !found) return false;
+        id = pw.pw_uid;
+        return true;
+    }
+    
+    static bool lookupGroup(const string& name, uint32_t& id) {
+        char* end;
+        unsigned long v = strtoul(name.c_str(), &end, 10);
+        if (!name.empty() && !*end) {
+            id = v;
+            return true;
+        }
+        struct group gr, *found = nullptr;
+        char buf[4096];
+        if (getgrnam_r(name.c_str(), &gr, buf, sizeof(buf), &found) != 0 || !found) return false;
+        id = gr.gr_gid;
+        return true;
+    }
+    
+    unique_ptr<Node> primary() {
+        string word = (*words)[pos++];
+        auto n = make_unique<Node>();
+        string arg;
+        if (word == "(") {
+            n = orExpr();
+            if (!n) return nullptr;
+            if (pos >= words->size() || (*words)[pos] != ")") {
+                fail("missing )");
+                return nullptr;
+            }
+            pos++;
+            return n;
+        }
+        if (word == "!" || word == "-not") {
+            if (pos >= words->size()) {
+                fail(word + " needs an expression");
+                return nullptr;
+            }
+            unique_ptr<Node> kid = primary();
+            if (!kid) return nullptr;
+            n->op = Op::Not;
+            n->kids.push_back(move(kid));
+            return n;
+        }
+        if (word == "-mindepth" || word == "-maxdepth") {
+            if (!operand(arg)) return nullptr;
+            char* end;
+            unsigned long v = strtoul(arg.c_str(), &end, 10);
+            if (arg.empty() || *end) {
+                fail("bad depth: " + arg);
+                return nullptr;
+            }
+            (word == "-mindepth" ? minDepth : maxDepth) = v;
+            // Global options; they match everything where they stand
+            n->op = Op::And;
+            return n;
+        }
+        if (!operand(arg)) return nullptr;
+        n->text = arg;
+        
+        if (word == "-name" || word == "-iname") {
+            n->op = Op::Name;
+            n->matcher = make_unique<NameMatcher>(arg, NameMatcher::Syntax::Glob, word == "-iname");
+            if (!n->matcher->ok()) {
+                fail("bad pattern " + arg + ": " + n->matcher->error());
+                return nullptr;
+            }
+        } else if (word == "-type") {
+            static const char letters[] = "fdlpscb";
+            static const unsigned char types[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK};
+            const char* t = arg.size() == 1 ? strchr(letters, arg[0]) : nullptr;
+            if (!t || !*t) {
+                fail("bad type: " + arg);
+                return nullptr;
+            }
+            n->op = Op::Type;
+            n->dtype = types[t - letters];
+        } else if (word == "-size") {
+            // As in find, a bare number counts 512-byte blocks; c is bytes
+            static const int64_t scales[] = {512, 1, 2, 1 << 10, 1 << 20, 1 << 30};
+            n->op = Op::Size;
+            n->fields = MetaFetcher::Size;
+            n->unit = 512;
+            if (!comparison(*n, arg, "bcwkMG", scales)) return nullptr;
+        } else if (word == "-mtime" || word == "-mmin") {
+            static const int64_t none[] = {1};
+            n->op = Op::MTime;
+            n->fields = MetaFetcher::MTime;
+            if (!comparison(*n, arg, "", none)) return nullptr;
+            n->unit = word == "-mtime" ? 86400 : 60;
+        } else if (word == "-user" || word == "-group") {
+            uint32_t id;
+            if (!(word == "-user" ? lookupUser(arg, id) : lookupGroup(arg, id))) {
+                fail("unknown " + word.substr(1) + ": " + arg);
+                return nullptr;
+            }
+            n->op = word == "-user" ? Op::User : Op::Group;
+            n->fields = word == "-user" ? STATX_UID : STATX_GID;
+            n->value = id;
+        } else if (word == "-perm") {
+            size_t i = 0;
+            if (arg[0] == '-' || arg[0] == '/') n->permKind = arg[i++];
+            char* end;
+            n->value = strtol(arg.c_str() + i, &end, 8);
+            if (end == arg.c_str() + i || *end || n->value > 07777) {
+                fail("bad mode: " + arg);
+                return nullptr;
+            }
+            n->op = Op::Perm;
+            n->fields = MetaFetcher::Mode;
+        } else {
+            fail("unknown predicate " + word);
+            return nullptr;
+        }
+        return n;
+    }
+    
+    unique_ptr<Node> andExpr() {
+        auto n = make_unique<Node>();
+        n->op = Op::And;
+        while (pos < words->size()) {
+            const string& w = (*words)[pos];
+            if (w == ")" || w == "-o" || w == "-or") break;
+            if (w == "-a" || w == "-and") {
+                pos++;
+                continue;
+            }
+            unique_ptr<Node> kid = primary();
+            if (!kid) return nullptr;
+            // Depth options leave an empty AND (true) behind; drop it
+            if (kid->op != Op::And || !kid->kids.empty()) n->kids.push_back(move(kid));
+        }
+        if (n->kids.size() == 1) return move(n->kids[0]);
+        return n;
+    }
+    
+    unique_ptr<Node> orExpr() {
+        unique_ptr<Node> first = andExpr();
+        if (!first) return nullptr;
+        if (pos >= words->size() || ((*words)[pos] != "-o" && (*words)[pos] != "-or")) return first;
+        auto n = make_unique<Node>();
+        n->op = Op::Or;
+        n->kids.push_back(move(first));
+        while (pos < words->size() && ((*words)[pos] == "-o" || (*words)[pos] == "-or")) {
+            pos++;
+            unique_ptr<Node> kid = andExpr();
+            if (!kid) return nullptr;
+            n->kids.push_back(move(kid));
+        }
+        return n;
+    }
+    
+    // Cost classes: 0 d_type, 1 name, 2 statx. Operands are stably sorted
+    // by cost, which is safe because no predicate has side effects.
+    static void plan(Node& n) {
+        switch (n.op) {
+            case Op::Type: n.cost = 0; return;
+            case Op::Name: n.cost = 1; return;
+            case Op::And:
+            case Op::Or:
+            case Op::Not:
+                n.cost = 0;
+                for (auto& k : n.kids) {
+                    plan(*k);
+                    n.cost = max(n.cost, k->cost);
+                    n.fields |= k->fields;
+                }
+                stable_sort(n.kids.begin(), n.kids.end(),
+                            [](const unique_ptr<Node>& a, const unique_ptr<Node>& b) { return a->cost < b->cost; });
+                return;
+            default:
+                n.cost = 2;
+                return;
+        }
+    }
+    
+    static bool compare(const Node& n, int64_t v) {
+        return n.cmp == '>' ? v > n.value : n.cmp == '<' ? v < n.value : v == n.value;
+    }
+    
+    bool eval(const Node& n, EntryProbe& p) const {
+        const EntryMeta* m;
+        switch (n.op) {
+            case Op::And:
+                for (const auto& k : n.kids) {
+                    if (!eval(*k, p)) return false;
+                }
+                return true;
+            case Op::Or:
+                for (const auto& k : n.kids) {
+                    if (eval(*k, p)) return true;
+                }
+                return false;
+            case Op::Not:
+                return !eval(*n.kids[0], p);
+            case Op::Name:
+                return n.matcher->matches(p.entry.name);
+            case Op::Type:
+                return p.entry.type == n.dtype;
+            case Op::Size:
+                // Rounded up to whole units, as find does
+                return (m = p.meta()) && compare(n, (static_cast<int64_t>(m->size) + n.unit - 1) / n.unit);
+            case Op::MTime:
+                return (m = p.meta()) && compare(n, (now - m->mtime.tv_sec) / n.unit);
+            case Op::User:
+                return (m = p.meta()) && m->uid == static_cast<uid_t>(n.value);
+            case Op::Group:
+                return (m = p.meta()) && m->gid == static_cast<gid_t>(n.value);
+            case Op::Perm: {
+                if (!(m = p.meta())) return false;
+                unsigned mode = m->mode & 07777;
+                unsigned want = n.value;
+                if (n.permKind == '-') return (mode & want) == want;
+                if (n.permKind == '/') return want == 0 || (mode & want) != 0;
+                return mode == want;
+            }
+        }
+        return false;
+    }
+    
+    static void describe(const Node& n, string& out) {
+        static const char* const names[] = {"", "", "", "name", "type", "size", "mtime", "user", "group", "perm"};
+        switch (n.op) {
+            case Op::And:
+            case Op::Or:
+                if (n.kids.empty()) {
+                    out += "true";
+                    return;
+                }
+                out += '(';
+                for (size_t i = 0; i < n.kids.size(); i++) {
+                    if (i) out += n.op == Op::And ? " AND " : " OR ";
+                    describe(*n.kids[i], out);
+                }
+                out += ')';
+                return;
+            case Op::Not:
+                out += "NOT ";
+                describe(*n.kids[0], out);
+                return;
+            default:
+                out += names[static_cast<int>(n.op)];
+                out += ' ';
+                out += n.text;
+                if (n.cost == 2) out += " [statx]";
+        }
+    }
+    
+public:
+    // Parses the expression words; check ok() afterwards
+    explicit SearchQuery(const vector<string>& expression) {
+        words = &expression;
+        if (expression.empty()) {
+            root = make_unique<Node>();
+            root->op = Op::And;
+        } else {
+            root = orExpr();
+            if (root && pos < expression.size()) {
+                fail("unexpected " + expression[pos]);
+            }
+        }
+        words = nullptr;
+        if (!err.empty()) {
+            root.reset();
+            return;
+        }
+        plan(*root);
+        statMask = root->fields;
+    }
+    
+    bool ok() const { return root != nullptr; }
+    const string& error() const { return err; }
+    
+    // statx fields an entry may need; empty when names and types decide
+    unsigned fields() const { return statMask; }
+    
+    // The expression in evaluation order
+    string describe() const {
+        string out;
+        if (root) describe(*root, out);
+        return out;
+    }
+    
+    // find depth: 1 for entries directly inside the root
+    bool matches(EntryProbe& p) const {
+        unsigned depth = p.entry.depth + 1;
+        if (depth < minDepth || depth > maxDepth) return false;
+        return eval(*root, p);
+    }
+    
+    // Whether the walk still needs to descend into a directory entry
+    bool descend(const WalkEntry& e) const {
+        return e.depth + 1 < maxDepth;
+    }
+};
+
+// One line of file content that contains the searched text
+struct ContentHit {
+    uint64_t line;          // 1-based
+    uint64_t offset;        // byte offset of the match in the file
+    string_view text;       // the line, without its newline; valid during the callback
+};
+
+// Finds a literal in file contents. Files are read in kChunk pieces (not
+// mapped: a file truncated mid-scan would raise SIGBUS), carrying the
+// unfinished last line into the next piece so lines and matches that
+// straddle a boundary are still seen whole. Each matching line is reported
+// once, at its first match; a line longer than a piece is reported with the
+// part of it that piece holds. A NUL byte in the first kProbe bytes marks a
+// file as binary.
+class ContentScanner {
+public:
+    using HitFn = function<bool(const ContentHit&)>;
+    
+private:
+    string needle;
+    bool fold;
+    
+    static constexpr size_t kChunk = 4 << 20;
+    static constexpr size_t kProbe = 8192;
+    
+    // Scans complete lines in [data, data + len); base is the file offset of
+    // data and line the number of the line it starts on. Returns false if
+    // the callback asked to stop.
+    bool scanBlock(const char* data, size_t len, uint64_t base, uint64_t& line, const HitFn& hit) const {
+        size_t pos = 0, counted = 0;
+        while (pos < len) {
+            size_t at = NameMatcher::findLiteral(data + pos, len - pos, needle.data(), needle.size(), fold);
+            if (at == string_view::npos) break;
+            at += pos;
+            
+            line += count(data + counted, data + at, '\n');
+            const char* lineStart = data + at;
+            while (lineStart > data && lineStart[-1] != '\n') lineStart--;
+            const char* lineEnd = static_cast<const char*>(memchr(data + at, '\n', len - at));
+            if (!lineEnd) lineEnd = data + len;
+            size_t textLen = lineEnd - lineStart;
+            if (textLen > 0 && lineStart[textLen - 1] == '\r') textLen--;
+            
+            if (!hit(ContentHit{line, base + at, string_view(lineStart, textLen)})) return false;
+            
+            // Continue after this line; its newline is counted with the rest
+            counted = lineEnd - data;
+            pos = counted + 1;
+        }
+        line += count(data + counted, data + len, '\n');
+        return true;
+    }
+    
+public:
+    ContentScanner(const string& text, bool ignoreCase)
+        : needle(ignoreCase ? NameMatcher::lowerCase(text) : text), fold(ignoreCase) {}
+    
+    // Scans an open regular file of the given size. Returns false if the
+    // file was skipped as binary or could not be read.
+    bool scan(int fd, uint64_t size, bool includeBinary, const HitFn& hit, vector<char>& scratch) const {
+        if (size == 0 || needle.empty()) return true;
+        uint64_t line = 1;
+        
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        scratch.resize(kChunk * 2);
+        size_t carry = 0;       // unfinished line kept at the front of scratch
+        uint64_t carryBase = 0; // file offset of scratch[0]
+        uint64_t readPos = 0;
+        bool first = true;
+        bool skipping = false;  // inside an enormous line that already matched
+        
+        while (true) {
+            if (scratch.size() < carry + kChunk) scratch.resize(carry + kChunk);
+            ssize_t n = FE_TIMED(Read, pread(fd, scratch.data() + carry, kChunk, readPos));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (first) {
+                first = false;
+                if (!includeBinary && memchr(scratch.data(), '\0', min<size_t>(n, kProbe))) return false;
+            }
+            readPos += n;
+            size_t avail = carry + n;
+            bool eof = n == 0;
+            
+            if (skipping) {
+                // Drop the rest of that line, up to and including its newline
+                const char* nl = static_cast<const char*>(memchr(scratch.data(), '\n', avail));
+                if (!nl) {
+                    if (eof) return true;
+                    carry = 0;
+                    carryBase += avail;
+                    continue;
+                }
+                size_t skip = nl - scratch.data() + 1;
+                line++;
+                skipping = false;
+                memmove(scratch.data(), scratch.data() + skip, avail - skip);
+                avail -= skip;
+                carryBase += skip;
+            }
+            
+            // Everything up to the last newline is complete; at EOF, all of it
+            size_t complete = avail;
+            bool partial = false;
+            if (!eof) {
+                const char* nl = static_cast<const char*>(memrchr(scratch.data(), '\n', avail));
+                complete = nl ? nl - scratch.data() + 1 : 0;
+                if (complete == 0 && avail >= kChunk) {
+                    // One enormous line: scan all but a needle's worth and keep going
+                    complete = avail - (needle.size() - 1);
+                    partial = true;
+                }
+            }
+            if (partial) {
+                bool matched = false;
+                auto once = [&](const ContentHit& h) {
+                    matched = true;
+                    return hit(h);
+                };
+                if (!scanBlock(scratch.data(), complete, carryBase, line, once)) return true;
+                if (matched) {
+                    // The line is reported; its later pieces are skipped
+                    skipping = true;
+                    carry = 0;
+                    carryBase += avail;
+                    continue;
+                }
+            } else if (!scanBlock(scratch.data(), complete, carryBase, line, hit)) {
+                return true;
+            }
+            if (eof) return true;
+            
+            memmove(scratch.data(), scratch.data() + complete, avail - complete);
+            carry = avail - complete;
+            carryBase += complete;
+        }
+    }
+};
+
+// What a content search looks for and which files it reads
+struct ContentQuery {
+    string text;
+    bool ignoreCase = false;
+    string nameGlob;                    // only files whose name matches; empty for all
+    uint64_t minSize = 0;
+    uint64_t maxSize = UINT64_MAX;
+    bool includeBinary = false;
+    size_t maxHitsPerFile = 100;
+};
+
+// Read-only view of one possibly huge file. Local files are mapped; on
+// network and FUSE filesystems, where a page fault can stall on the wire or
+// the file can change under the mapping, and for files being followed, data
+// is read through pread windows instead. A background thread indexes line
+// starts with an SSE2 newline scan, recording one checkpoint every kStride
+// lines, so any line is reached by a checkpoint lookup plus a scan of at
+// most kStride lines, and memory stays small even for billions of lines.
+// The index can be extended when the file grows, which is how tail-follow
+// avoids rereading.
+class FileViewer {
+public:
+    static constexpr uint64_t kStride = 1024;
+    
+private:
+    int fd = -1;
+    uint64_t fileSize = 0;
+    const char* map = nullptr;
+    uint64_t mapSize = 0;
+    
+    mutable mutex idxMtx;
+    condition_variable idxCv;
+    vector<uint64_t> checkpoints;       // checkpoints[k] = offset where line k * kStride + 1 starts
+    uint64_t indexedTo = 0;             // bytes scanned so far
+    uint64_t newlines = 0;              // newlines seen in [0, indexedTo)
+    bool indexing = false;
+    atomic<bool> stopIndexing{false};
+    mutex scanMtx;                      // one scanner at a time
+    thread indexer;
+    
+    static bool remoteFilesystem(int fd) {
+        struct statfs fs;
+        if (fstatfs(fd, &fs) != 0) return false;
+        switch (static_cast<unsigned long>(fs.f_type)) {
+            case 0x6969:        // NFS
+            case 0x517B:        // SMB
+            case 0xFF534D42:    // CIFS
+            case 0xFE534D42:    // SMB2
+            case 0x65735546:    // FUSE
+                return true;
+            default:
+                return false;
+        }
+    }
+    
+    // Counts newlines in [p, p + n), which starts at file offset base, and
+    // appends a checkpoint for every kStride-th line start
+    static void scanBlock(const char* p, size_t n, uint64_t base, uint64_t& lines, vector<uint64_t>& found) {
+        size_t i = 0;
+        auto onNewline = [&](size_t at) {
+            lines++;
+            if (lines % kStride == 0) found.push_back(base + at + 1);
+        };
+#if defined(__SSE2__)
+        const __m128i nl = _mm_set1_epi8('\n');
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+            if (!mask) continue;
+            unsigned count = __builtin_popcount(mask);
+            // Fast path: no checkpoint falls inside this block
+            if ((lines % kStride) + count < kStride) {
+                lines += count;
+                continue;
+            }
+            while (mask) {
+                onNewline(i + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            if (p[i] == '\n') onNewline(i);
+        }
+    }
+    
+    // Indexes [indexedTo, limit) in large blocks, publishing progress as it goes
+    void indexRange(uint64_t limit) {
+        lock_guard<mutex> scanLock(scanMtx);
+        vector<char> buffer;
+        uint64_t pos, lines;
+        {
+            lock_guard<mutex> lock(idxMtx);
+            pos = indexedTo;
+            lines = newlines;
+        }
+        const size_t block = 4 << 20;
+        while (pos < limit && !stopIndexing.load(memory_order_relaxed)) {
+            size_t want = min<uint64_t>(block, limit - pos);
+            string_view data = readCopy(pos, want, buffer);
+            if (data.empty()) break;
+            vector<uint64_t> found;
+            scanBlock(data.data(), data.size(), pos, lines, found);
+            pos += data.size();
+            {
+                lock_guard<mutex> lock(idxMtx);
+                checkpoints.insert(checkpoints.end(), found.begin(), found.end());
+                indexedTo = pos;
+                newlines = lines;
+            }
+            idxCv.notify_all();
+        }
+    }
+    
+    // pread into buffer, never the mapping: a truncated file then gives a
+    // short read here instead of SIGBUS
+    string_view readCopy(uint64_t offset, size_t len, vector<char>& buffer) const {
+        buffer.resize(len);
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = FE_TIMED(Read, pread(fd, buffer.data() + got, len - got, offset + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        return string_view(buffer.data(), got);
+    }
+    
+    // Waits until the index covers offset (or indexing ends)
+    void waitFor(unique_lock<mutex>& lock, function<bool()> ready) {
+        idxCv.wait(lock, [&] { return ready() || !indexing || indexedTo >= fileSize; });
+    }
+    
+public:
+    FileViewer() = default;
+    
+    ~FileViewer() {
+        close();
+    }
+    
+    FileViewer(const FileViewer&) = delete;
+    FileViewer& operator=(const FileViewer&) = delete;
+    
+    // follow opens the file for tail -f: it is never mapped, since a log
+    // rotated by copytruncate shrinks under the reader at any moment
+    bool open(int dirFd, const char* name, bool follow = false) {
+        close();
+        fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close();
+            errno = EINVAL;
+            return false;
+        }
+        fileSize = st.st_size;
+        if (fileSize > 0 && !follow && !remoteFilesystem(fd)) {
+            // The mapping is only read by the caller's thread (the indexer
+            // preads). Another process truncating the file while a page
+            // past its new end is read still raises SIGBUS; refresh()
+            // unmaps only once it has seen the shrink.
+            void* m = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                map = static_cast<const char*>(m);
+                mapSize = fileSize;
+            }
+        }
+        checkpoints.assign(1, 0);
+        indexedTo = 0;
+        newlines = 0;
+        stopIndexing = false;
+        indexing = true;
+        uint64_t limit = fileSize;
+        indexer = thread([this, limit] {
+            indexRange(limit);
+            {
+                lock_guard<mutex> lock(idxMtx);
+                indexing = false;
+            }
+            idxCv.notify_all();
+        });
+        return true;
+    }
+    
+    void close() {
+        stopIndexing = true;
+        if (indexer.joinable()) indexer.join();
+        if (map) munmap(const_cast<char*>(map), mapSize);
+        map = nullptr;
+        mapSize = 0;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        fileSize = 0;
+    }
+    
+    uint64_t size() const { return fileSize; }
+    bool mapped() const { return map != nullptr; }
+    
+    // Bytes [offset, offset + len) clipped to the file. Served from the
+    // mapping when possible, otherwise read into buffer.
+    string_view read(uint64_t offset, size_t len, vector<char>& buffer) const {
+        if (offset >= fileSize) return string_view();
+        len = min<uint64_t>(len, fileSize - offset);
+        if (map && offset + len <= mapSize) return string_view(map + offset, len);
+        return readCopy(offset, len, buffer);
+    }
+    
+    // Lines known so far; complete tells whether the whole file is indexed
+    uint64_t lineCount(bool& complete) const {
+        lock_guard<mutex> lock(idxMtx);
+        complete = indexedTo >= fileSize;
+        uint64_t lines = newlines;
+        if (complete && fileSize > 0) {
+            vector<char> buf;
+            string_view last = read(fileSize - 1, 1, buf);
+            if (!last.empty() && last[0] != '\n') lines++;
+        }
+        return lines;
+    }
+    
+    // Number of newline-terminated lines; waits for the index to finish
+    uint64_t completeLines() {
+        unique_lock<mutex> lock(idxMtx);
+        waitFor(lock, [&] { return indexedTo >= fileSize; });
+        return newlines;
+    }
+    
+    double indexedFraction() const {
+        lock_guard<mutex> lock(idxMtx);
+        return fileSize ? static_cast<double>(indexedTo) / fileSize : 1.0;
+    }
+    
+    // Start offset of a 1-based line. Waits for the indexer to reach it.
+    bool lineOffset(uint64_t line, uint64_t& offset) {
+        if (line == 0) line = 1;
+        uint64_t k = (line - 1) / kStride;
+        uint64_t skip = (line - 1) % kStride;
+        {
+            unique_lock<mutex> lock(idxMtx);
+            waitFor(lock, [&] { return checkpoints.size() > k; });
+            if (checkpoints.size() <= k) return false;
+            offset = checkpoints[k];
+        }
+        vector<char> buffer;
+        while (skip > 0) {
+            string_view data = read(offset, 1 << 20, buffer);
+            if (data.empty()) return false;
+            const char* p = data.data();
+            const char* end = p + data.size();
+            while (skip > 0 && p < end) {
+                const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (!nl) {
+                    p = end;
+                    break;
+                }
+                p = nl + 1;
+                skip--;
+            }
+            offset += p - data.data();
+        }
+        return offset < fileSize || (offset == fileSize && line == 1);
+    }
+    
+    // 1-based number of the line containing offset
+    uint64_t lineAt(uint64_t offset) {
+        offset = min(offset, fileSize);
+        uint64_t k, start;
+        {
+            unique_lock<mutex> lock(idxMtx);
+            waitFor(lock, [&] { return indexedTo > offset; });
+            k = upper_bound(checkpoints.begin(), checkpoints.end(), offset) - checkpoints.begin() - 1;
+            start = checkpoints[k];
+        }
+        uint64_t line = k * kStride + 1;
+        vector<char> buffer;
+        while (start < offset) {
+            string_view data = read(start, min<uint64_t>(1 << 20, offset - start), buffer);
+            if (data.empty()) break;
+            line += count(data.begin(), data.end(), '\n');
+            start += data.size();
+        }
+        return line;
+    }
+    
+    // Offset where the line containing offset begins
+    uint64_t lineStart(uint64_t offset) {
+        vector<char> buffer;
+        while (offset > 0) {
+            uint64_t from = offset > 4096 ? offset - 4096 : 0;
+            string_view data = read(from, offset - from, buffer);
+            const void* nl = memrchr(data.data(), '\n', data.size());
+            if (nl) return from + (static_cast<const char*>(nl) - data.data()) + 1;
+            offset = from;
+        }
+        return 0;
+    }
+    
+    // Renders up to count lines starting at offset (a line start numbered
+    // firstLine, or 0 to leave lines unnumbered). Long lines are cut at
+    // maxWidth bytes. Returns the offset just past the last line shown.
+    uint64_t render(OutputBuffer& out, uint64_t offset, uint64_t firstLine, size_t count, size_t maxWidth = 512) const {
+        vector<char> buffer;
+        for (size_t shown = 0; shown < count && offset < fileSize; shown++) {
+            string_view data = read(offset, maxWidth + 1, buffer);
+            size_t nl = data.find('\n');
+            size_t textLen = min(nl == string_view::npos ? data.size() : nl, maxWidth);
+            
+            if (firstLine) {
+                string num = to_string(firstLine + shown);
+                out.color(YELLOW).fill(' ', num.size() < 8 ? 8 - num.size() : 0).put(num).color(RESET).put("  ", 2);
+            }
+            for (size_t i = 0; i < textLen; i++) {
+                unsigned char c = data[i];
+                out.put(c < 32 && c != '\t' ? '.' : static_cast<char>(c));
+            }
+            
+            uint64_t next;
+            if (nl != string_view::npos) {
+                next = offset + nl + 1;
+            } else {
+                // Cut line: skip ahead to its end
+                out.color(CYAN).put(" ...").color(RESET);
+                next = offset + data.size();
+                while (next < fileSize) {
+                    string_view more = read(next, 1 << 20, buffer);
+                    const void* p = memchr(more.data(), '\n', more.size());
+                    if (p) {
+                        next += static_cast<const char*>(p) - more.data() + 1;
+                        break;
+                    }
+                    next += more.size();
+                }
+            }
+            out.put('\n');
+            offset = next;
+        }
+        return offset;
+    }
+    
+    // Picks up appended data: extends the index over it and returns the
+    // previous size. A file that shrank is reported by returning a value
+    // larger than size(); the index is rebuilt from scratch in that case.
+    uint64_t refresh() {
+        struct stat st;
+        uint64_t old = fileSize;
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) == old) return old;
+        uint64_t now = st.st_size;
+        if (indexer.joinable()) indexer.join();
+        if (now < old) {
+            // Pages past the new end would fault; fall back to pread
+            if (map) munmap(const_cast<char*>(map), mapSize);
+            map = nullptr;
+            mapSize = 0;
+            lock_guard<mutex> lock(idxMtx);
+            checkpoints.assign(1, 0);
+            indexedTo = 0;
+            newlines = 0;
+        }
+        {
+            lock_guard<mutex> lock(idxMtx);
+            fileSize = now;
+        }
+        // Bytes past the original mapping are served by pread
+        indexRange(now);
+        return old;
+    }
+};
+
+// The current directory as a stack of its ancestors from "/", each level
+// holding, once it has been opened, a descriptor. The path is canonical:
+// a walk that met no symlink (openat2 with RESOLVE_NO_SYMLINKS) is taken
+// at its word, any other is named by the kernel via /proc/self/fd, so
+// symlinks, "." and ".." never pile up in it. "cd .." pops a level after
+// one stat of "..", a plain name is one single-component open, and other
+// targets start from the deepest open ancestor they share with the
+// current path. Directories jumped between stay open in a small LRU keyed
+// by canonical path; a hit is trusted while the kernel still gives the
+// descriptor that name, which catches renames and deletes without a walk.
+// Procfs magic links are never followed.
+class PathResolver {
+private:
+    struct Handle {
+        int fd;
+        bool known = false;     // dev and ino filled in
+        dev_t dev = 0;
+        ino_t ino = 0;
+        explicit Handle(int f) : fd(f) {}
+        ~Handle() { ::close(fd); }
+        
+        bool is(const struct stat& st) {
+            if (!known) {
+                struct stat own;
+                if (fstat(fd, &own) != 0) return false;
+                dev = own.st_dev;
+                ino = own.st_ino;
+                known = true;
+            }
+            return dev == st.st_dev && ino == st.st_ino;
+        }
+    };
+    struct Level {
+        size_t end;                 // length of this level's path in canonical
+        shared_ptr<Handle> dir;     // null until this level is opened
+    };
+    
+    static constexpr size_t kCacheSize = 32;
+    static atomic<bool> openat2Missing;
+    
+    vector<Level> levels;           // levels[0] is "/"
+    string canonical = "/";
+    list<pair<string, shared_ptr<Handle>>> lru;     // front = most recent
+    unordered_map<string, list<pair<string, shared_ptr<Handle>>>::iterator> cache;
+    
+    // Opens a directory; with noSymlinks, fails with ELOOP rather than
+    // follow a symlink anywhere in path. Without openat2 noSymlinks is
+    // ignored and literal is cleared, as nothing is known about the walk.
+    static int openDir(int base, const char* path, bool noSymlinks, bool& literal) {
+        literal = false;
+        if (!openat2Missing.load(memory_order_relaxed)) {
+            struct open_how how = {};
+            how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            how.resolve = RESOLVE_NO_MAGICLINKS | (noSymlinks ? RESOLVE_NO_SYMLINKS : 0);
+            long fd = syscall(SYS_openat2, base, path, &how, sizeof(how));
+            if (fd >= 0) literal = noSymlinks;
+            if (fd >= 0 || errno != ENOSYS) return static_cast<int>(fd);
+            openat2Missing = true;
+        }
+        return openat(base, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    
+    // The kernel's current name for the directory open as fd; false when
+    // /proc is not mounted or the directory has been removed
+    static bool kernelPath(int fd, string& out) {
+        char link[32], target[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        ssize_t n = readlink(link, target, sizeof(target));
+        if (n <= 0 || n == static_cast<ssize_t>(sizeof(target)) || target[0] != '/') return false;
+        out.assign(target, n);
+        static const string deleted = " (deleted)";
+        return !(out.size() > deleted.size() && out.compare(out.size() - deleted.size(), deleted.size(), deleted) == 0);
+    }
+    
+    static bool hasDotDot(const string& path) {
+        for (size_t pos = path.find(".."); pos != string::npos; pos = path.find("..", pos + 1)) {
+            if ((pos == 0 || path[pos - 1] == '/') && (pos + 2 == path.size() || path[pos + 2] == '/')) return true;
+        }
+        return false;
+    }
+    
+    // Drops empty and "." components and applies ".." textually
+    static string lexical(const string& path) {
+        vector<string_view> parts;
+        string_view rest(path);
+        while (!rest.empty()) {
+            size_t slash = rest.find('/');
+            string_view part = rest.substr(0, slash);
+            rest = slash == string_view::npos ? string_view() : rest.substr(slash + 1);
+            if (part.empty() || part == ".") continue;
+            if (part == "..") {
+                if (!parts.empty()) parts.pop_back();
+            } else {
+                parts.push_back(part);
+            }
+        }
+        string out;
+        for (string_view part : parts) out.append(1, '/').append(part);
+        return out.empty() ? "/" : out;
+    }
+    
+    // Cached descriptor for a canonical path, if the kernel still agrees
+    shared_ptr<Handle> lookup(const string& path) {
+        auto it = cache.find(path);
+        if (it == cache.end()) return nullptr;
+        string now;
+        if (!kernelPath(it->second->second->fd, now) || now != path) {
+            lru.erase(it->second);
+            cache.erase(it);
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        return lru.front().second;
+    }
+    
+    void remember(const string& path, const shared_ptr<Handle>& dir) {
+        auto it = cache.find(path);
+        if (it != cache.end()) {
+            it->second->second = dir;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        lru.emplace_front(path, dir);
+        cache[path] = lru.begin();
+        if (lru.size() > kCacheSize) {
+            cache.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+    
+    // Makes path (canonical) with descriptor dir the top of the stack,
+    // keeping the levels it shares with the current one. Both ends of the
+    // jump are cached; single steps up and down need no cache.
+    void moveTo(const string& path, const shared_ptr<Handle>& dir) {
+        if (levels.back().dir) remember(canonical, levels.back().dir);
+        size_t keep = 1;
+        while (keep < levels.size()) {
+            size_t end = levels[keep].end;
+            if (path.compare(0, end, canonical, 0, end) != 0 || (path.size() > end && path[end] != '/')) break;
+            keep++;
+        }
+        levels.resize(keep);
+        for (size_t pos = levels.back().end + (keep > 1); pos < path.size();) {
+            size_t end = path.find('/', pos);
+            if (end == string::npos) end = path.size();
+            levels.push_back(Level{end, nullptr});
+            pos = end + 1;
+        }
+        levels.back().dir = dir;
+        canonical = path;
+        remember(path, dir);
+    }
+    
+    // "..": the parent level, when it is open and still the parent
+    bool popLevel() {
+        if (levels.size() == 1) return true;
+        Level& parent = levels[levels.size() - 2];
+        struct stat st;
+        if (fstatat(fd(), "..", &st, AT_SYMLINK_NOFOLLOW) != 0) return false;
+        if (!parent.dir) {
+            int pfd = openat(fd(), "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (pfd < 0) return false;
+            parent.dir = make_shared<Handle>(pfd);
+        }
+        if (!parent.dir->is(st)) return false;
+        levels.pop_back();
+        canonical.resize(levels.back().end);
+        return true;
+    }
+    
+    // A plain name opened from the current directory without symlinks
+    void pushLevel(const string& name, const shared_ptr<Handle>& dir) {
+        if (levels.size() > 1) canonical += '/';
+        canonical += name;
+        levels.push_back(Level{canonical.size(), dir});
+    }
+    
+    // Deepest open level whose path is path or a prefix of it; end
+    // receives the length of that level's path
+    const Level* anchorFor(const string& path, size_t& end) const {
+        const Level* best = levels[0].dir ? &levels[0] : nullptr;
+        end = 1;
+        for (size_t i = 1; i < levels.size(); i++) {
+            size_t at = levels[i].end;
+            if (path.compare(0, at, canonical, 0, at) != 0 || (path.size() > at && path[at] != '/')) break;
+            if (levels[i].dir) {
+                best = &levels[i];
+                end = at;
+            }
+        }
+        return best;
+    }
+    
+public:
+    PathResolver() {
+        levels.push_back(Level{1, nullptr});
+    }
+    
+    PathResolver(const PathResolver&) = delete;
+    PathResolver& operator=(const PathResolver&) = delete;
+    
+    // Descriptor of the current directory (-1 before the first change)
+    int fd() const {
+        return levels.back().dir ? levels.back().dir->fd : -1;
+    }
+    
+    const string& path() const {
+        return canonical;
+    }
+    
+    // Moves to target, relative to the current directory unless absolute.
+    // Leaves the current directory alone and sets errno on failure.
+    bool change(const string& target) {
+        if (target.empty()) {
+            errno = ENOENT;
+            return false;
+        }
+        if (target == ".." && fd() >= 0 && popLevel()) return true;
+        
+        bool absolute = target[0] == '/';
+        if (!absolute && fd() < 0) {
+            errno = EBADF;
+            return false;
+        }
+        bool plain = !absolute && target.find('/') == string::npos && target != "." && target != "..";
+        int base = absolute ? AT_FDCWD : fd();
+        string walk, guess;
+        if (!plain) {
+            guess = lexical(absolute ? target : canonical + "/" + target);
+            if (!hasDotDot(target)) {
+                // Without ".." the text names the directory it reaches unless
+                // a symlink is in the way, and then it is no canonical path:
+                // go to an open ancestor or a cached directory, or walk on
+                // from the deepest open ancestor
+                size_t end;
+                const Level* anchor = anchorFor(guess, end);
+                if (anchor && end == guess.size()) {
+                    shared_ptr<Handle> dir = anchor->dir;   // moveTo() reshapes levels
+                    moveTo(guess, dir);
+                    return true;
+                }
+                if (shared_ptr<Handle> hit = lookup(guess)) {
+                    moveTo(guess, hit);
+                    return true;
+                }
+                if (anchor) {
+                    base = anchor->dir->fd;
+                    walk = guess.substr(end + (end > 1));
+                }
+            }
+        }
+        const char* rel = walk.empty() ? target.c_str() : walk.c_str();
+        
+        // A walk that met no symlink went exactly where the text says;
+        // otherwise ask the kernel where it ended up
+        bool literal;
+        int newFd = openDir(base, rel, true, literal);
+        if (newFd < 0 && errno == ELOOP) newFd = openDir(base, rel, false, literal);
+        if (newFd < 0) return false;
+        auto dir = make_shared<Handle>(newFd);
+        if (plain && literal) {
+            pushLevel(target, dir);
+            return true;
+        }
+        if (plain) guess = lexical(canonical + "/" + target);
+        string path;
+        if (literal || !kernelPath(newFd, path)) path = guess;
+        moveTo(path, dir);
+        return true;
+    }
+};
+
+atomic<bool> PathResolver::openat2Missing{false};
+
 class FileExplorer {
 private:
     string currentPath;
+    PathResolver resolver;      // owns the descriptors of currentPath and its ancestors
+    int dirFd = -1;             // resolver's descriptor for currentPath; names resolve against it
+    bool orderedResults = true;
+    OutputFormat outputFormat = OutputFormat::Text;
+    unique_ptr<FileIndex> index;
+    unique_ptr<IndexWatcher> watcher;
+    unsigned batchQueueDepth = 32;
+    Throttle throttle;          // pace of bulk copies and deletes; unlimited by default
+    size_t listingSortBudget = 64 << 20;   // bytes of names sorted in memory before spilling
+    ListingCache listingCache;
+    unique_ptr<ListingPrefetcher> prefetcher;  // declared after the cache it fills, so it stops first
+    shared_ptr<const DirSnapshot> snapshot;     // last detailed listing, for re-sorting without re-stat
+    string snapshotPath;
+    unique_ptr<UsageAnalyzer::Report> usage;    // last disk usage walk, reused for subdirectories
+    
+    // Picks up a saved index for currentPath if the loaded one doesn't cover it
+    FileIndex* indexForCurrentPath() {
+        if (index && index->isLoaded() && index->covers(currentPath)) return index.get();
+        auto candidate = make_unique<FileIndex>(currentPath);
+        if (!candidate->load()) return nullptr;
+        replaceIndex(move(candidate));
+        return index.get();
+    }
+    
+    // Swaps in a new index, moving a running watcher over to it
+    void replaceIndex(unique_ptr<FileIndex> fresh) {
+        bool watching = watcher && watcher->running();
+        watcher.reset();
+        index = move(fresh);
+        if (watching) startWatcher();
+    }
+    
+    bool startWatcher() {
+        // Changes the watcher sees also retire cached listings of those directories
+        watcher = make_unique<IndexWatcher>(*index, [this](const vector<string>& dirs) {
+            for (const auto& dir : dirs) listingCache.invalidate(AT_FDCWD, dir.c_str());
+        });
+        if (!watcher->start()) {
+            watcher.reset();
+            return false;
+        }
+        return true;
+    }
+    
+    // Helper function to print the listing banner
+    void renderBanner(OutputBuffer& out) {
+        out.color(BOLD).color(CYAN).put("\nCurrent Directory: ").put(currentPath).color(RESET).newline();
+        out.fill('=', 80).newline();
+    }
+    
+    // Runs the listing pipeline for one view over the current directory
+    template <class View, class Filter = KeepAll>
+    shared_ptr<const DirSnapshot> runListing(const Filter& filter = Filter()) {
+        typename ListingPipeline<View>::Context ctx{listingCache, listingSortBudget,
+                                                    [this](OutputBuffer& out) { renderBanner(out); }};
+        OutputBuffer out;
+        bool ok;
+        shared_ptr<const DirSnapshot> shown = ListingPipeline<View>::run(dirFd, ctx, out, ok, filter);
+        if (!ok) {
+            cerr << RED << "Error: Cannot read directory: " << strerror(errno) << RESET << endl;
+            return nullptr;
+        }
+        if (View::Rows::kDecorated) out.fill('=', 80).newline();
+        return shown;
+    }
+    
+    // Same, keeping only names that contain filter (all when empty), or
+    // that match it when it has glob wildcards
+    template <class View>
+    shared_ptr<const DirSnapshot> listView(const string& filter) {
+        if (filter.empty()) return runListing<View>();
+        if (filter.find_first_of("*?[") == string::npos) return runListing<View>(NameContains{filter});
+        NameMatcher matcher(filter, NameMatcher::Syntax::Glob);
+        return runListing<View>(NameMatches{matcher});
+    }
+    
+    // Lists in directory order as entries are read
+    template <class View>
+    void streamListing(size_t pageSize, const function<bool()>& more) {
+        DirReader reader;
+        if (!reader.openAt(dirFd, ".", true)) {
+            cerr << RED << "Error: Cannot open directory" << RESET << endl;
+            return;
+        }
+        bool stopped;
+        size_t shown;
+        {
+            OutputBuffer out;
+            renderBanner(out);
+            View::Rows::header(out);
+            if (pageSize) {
+                out.flush();
+                shown = ListingPipeline<View>::stream(reader, out, [](size_t) { return false; }, pageSize, more, stopped);
+            } else {
+                // Push the first screenful out at once, then let the buffer batch
+                shown = ListingPipeline<View>::stream(reader, out, [](size_t n) { return n == 32 || n % 4096 == 0; },
+                                                      0, more, stopped);
+            }
+            out.fill('=', 80).newline();
+        }
+        if (pageSize) {
+            OutputBuffer out;
+            out.put("Shown: ").number(shown).put(stopped ? " (stopped early)" : "").newline();
+        }
+    }
+    
+    // Drops the cached listing of the directory holding name; used after
+    // changes that do not update that directory's mtime (overwrites, chmod)
+    void invalidateListingOf(const string& name) {
+        size_t slash = name.find_last_of('/');
+        string parent = slash == string::npos ? "." : (slash == 0 ? "/" : name.substr(0, slash));
+        listingCache.invalidate(dirFd, parent.c_str());
+    }
+    
+    // Helper function to copy file contents
+    CopyResult copyFileContents(const string& src, const string& dest, bool verify = false) {
+        return CopyEngine::copyAt(dirFd, src.c_str(), dirFd, dest.c_str(), verify,
+                                  throttle.active() ? &throttle.bytes : nullptr);
+    }
+    
+    // Runs a batch relative to currentPath, reporting failures and a summary.
+    // Returns the number of items that succeeded.
+    size_t runBatch(BatchExecutor::Op op, const vector<pair<string, string>>& names, const char* verb) {
+        vector<BatchItem> items;
+        items.reserve(names.size());
+        for (const auto& n : names) items.push_back(BatchItem{n.first, n.second});
+        
+        BatchExecutor executor(batchQueueDepth);
+        if (throttle.active()) executor.setThrottle(&throttle);
+        BatchOutcome outcome = executor.run(op, items, [](const BatchItem& item, int err) {
+            if (err != 0) cerr << RED << "Error: " << item.src << ": " << strerror(err) << RESET << endl;
+        }, dirFd);
+        
+        cout << GREEN << verb << " " << outcome.succeeded << " of " << items.size() << " item(s) via "
+             << outcome.backend << RESET;
+        if (op == BatchExecutor::Op::Copy && outcome.seconds > 0) {
+            cout << " (" << OutputBuffer::sizeString(outcome.bytes) << ", "
+                 << OutputBuffer::sizeString(outcome.bytes / outcome.seconds) << "/s)";
+        }
+        cout << endl;
+        return outcome.succeeded;
+    }
+    
+    // Full path for the few callers that still need one (tree operations)
+    string resolvePath(const string& name) const {
+        return !name.empty() && name[0] == '/' ? name : currentPath + "/" + name;
+    }
+    
+    // Path as the usage report keys it: no "." component, no trailing slash
+    string usagePath(const string& name) const {
+        string path = name.empty() || name == "." ? currentPath : resolvePath(name);
+        while (path.size() > 1 && path.back() == '/') path.pop_back();
+        if (path.size() > 2 && path.compare(path.size() - 2, 2, "/.") == 0) path.resize(path.size() - 2);
+        return path.empty() ? "/" : path;
+    }
+    
+    void printUsageRows(const vector<pair<string, UsageTotals>>& rows, const string& base) {
+        for (const auto& row : rows) {
+            string shown = row.first.compare(0, base.size(), base) == 0 ? row.first.substr(base.size()) : row.first;
+            if (!shown.empty() && shown[0] == '/') shown.erase(0, 1);
+            cout << "  " << left << setw(12) << OutputBuffer::sizeString(row.second.diskBytes) << right
+                 << setw(10) << row.second.files << " files  " << BLUE << shown << RESET << endl;
+        }
+    }
+    
+public:
+    FileExplorer() {
+        char cwd[1024];
+        if (getcwd(cwd, sizeof(cwd)) == nullptr || !resolver.change(cwd)) resolver.change("/");
+        currentPath = resolver.path();
+        dirFd = resolver.fd();
+    }
+    
+    // DAY 1: List files in current directory
+    void listFiles(bool detailed = false, const string& filter = "") {
+        switch (outputFormat) {
+            case OutputFormat::Nul: listView<NulListing>(filter); return;
+            case OutputFormat::JsonLines: listView<JsonListing>(filter); return;
+            case OutputFormat::Binary: listView<BinaryListing>(filter); return;
+            case OutputFormat::Text: break;
+        }
+        if (!detailed) {
+            shared_ptr<const DirSnapshot> shown = listView<SimpleListing>(filter);
+            if (shown && prefetcher) prefetcher->schedule(dirFd, *shown);
+            return;
+        }
+        // The detailed listing becomes the snapshot sortListing() uses
+        shared_ptr<const DirSnapshot> shown = listView<DetailedListing>(filter);
+        if (shown) {
+            if (prefetcher) prefetcher->schedule(dirFd, *shown);
+            snapshot = move(shown);
+            snapshotPath = currentPath;
+        }
+    }
+    
+    // Detailed listing ordered largest first (directories on top)
+    void listFilesBySize(const string& filter = "") {
+        listView<SizeListing>(filter);
+    }
+    
+    // Lists entries in directory order as they are read, without sorting.
+    // The first lines reach the terminal before the directory is exhausted.
+    void listFilesStreaming(bool detailed = false) {
+        if (detailed) streamListing<DetailedListing>(0, nullptr);
+        else streamListing<SimpleListing>(0, nullptr);
+    }
+    
+    // Lists entries in directory order one page at a time. Only the current
+    // page and the reader position are held; more() is asked before each
+    // further page and stops the listing by returning false.
+    void listFilesPaged(size_t pageSize, const function<bool()>& more, bool detailed = false) {
+        if (pageSize == 0) pageSize = 1;
+        if (detailed) streamListing<DetailedListing>(pageSize, more);
+        else streamListing<SimpleListing>(pageSize, more);
+    }
+    
+    // Re-displays the last detailed listing of this directory sorted by key,
+    // optionally keeping only names containing filter. Uses the captured
+    // snapshot, so nothing is stat-ed again.
+    bool sortListing(DirSnapshot::Key key, bool descending, const string& filter = "") {
+        if (!snapshot || snapshot->empty() || snapshotPath != currentPath) {
+            cerr << RED << "Error: No detailed listing of this directory yet (use option 2 first)" << RESET << endl;
+            return false;
+        }
+        
+        auto start = chrono::steady_clock::now();
+        const DirSnapshot& snap = *snapshot;
+        vector<uint32_t> rows = filter.empty() ? snap.all()
+            : snap.select([&](uint32_t i) { return snap.name(i).find(filter) != string_view::npos; });
+        snap.sort(rows, key, descending);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        
+        OutputBuffer out;
+        renderBanner(out);
+        DetailedRows::header(out);
+        for (uint32_t i : rows) {
+            DetailedRows::row(out, snap.name(i), snap.meta(i));
+        }
+        out.fill('=', 80).newline();
+        out.flush();
+        cout << GREEN << "Ordered " << rows.size() << " of " << snap.size() << " entries in "
+             << fixed << setprecision(2) << ms << " ms" << RESET << endl;
+        return true;
+    }
+    
+    void setListingCacheBudget(size_t bytes) {
+        listingCache.setBudget(bytes);
+    }
+    
+    void showListingCacheStats() {
+        ListingCache::Stats st = listingCache.stats();
+        uint64_t lookups = st.hits + st.misses;
+        cout << BOLD << CYAN << "\nListing Cache" << RESET << endl;
+        cout << string(40, '=') << endl;
+        cout << "Entries:     " << st.entries << endl;
+        cout << "Memory:      " << OutputBuffer::sizeString(st.bytes) << " of "
+             << OutputBuffer::sizeString(st.budget) << endl;
+        cout << "Hits:        " << st.hits << endl;
+        cout << "Misses:      " << st.misses << " (" << st.stale << " stale)" << endl;
+        cout << "Evictions:   " << st.evictions << endl;
+        if (lookups > 0) {
+            cout << "Hit rate:    " << fixed << setprecision(1) << 100.0 * st.hits / lookups << "%" << defaultfloat << endl;
+        }
+        if (prefetcher) {
+            ListingPrefetcher::Stats pf = prefetcher->stats();
+            cout << "Prefetched:  " << pf.stored << " (" << pf.skipped << " skipped, "
+                 << pf.cancelled << " cancelled)" << endl;
+        }
+        cout << string(40, '=') << endl;
+    }
+    
+    // Turns background prefetching of listed subdirectories on or off
+    bool togglePrefetch() {
+        if (prefetcher) {
+            prefetcher.reset();
+            cout << GREEN << "Directory prefetch stopped" << RESET << endl;
+        } else {
+            prefetcher = make_unique<ListingPrefetcher>(listingCache);
+            cout << GREEN << "Directory prefetch started (subdirectories of each listing, idle I/O priority)"
+                 << RESET << endl;
+        }
+        return true;
+    }
+    
+    bool prefetching() const {
+        return prefetcher != nullptr;
+    }
+    
+    // DAY 2: Navigate to directory
+    bool changeDirectory(const string& path) {
+        // Work for the directory being left is no longer wanted
+        if (prefetcher) prefetcher->cancel();
+        
+        // Relative paths (and "..") resolve against the current directory fd;
+        // the shown path is the canonical one
+        string previous = currentPath;
+        if (resolver.change(path)) {
+            if (fchdir(resolver.fd()) == 0) {
+                dirFd = resolver.fd();
+                currentPath = resolver.path();
+                cout << GREEN << "Changed to: " << currentPath << RESET << endl;
+                return true;
+            }
+            // No search permission: back to where we were (still cached)
+            resolver.change(previous);
+            dirFd = resolver.fd();
+            currentPath = resolver.path();
+        }
+        cerr << RED << "Error: Cannot change to directory" << RESET << endl;
+        return false;
+    }
+    
+    string getCurrentPath() const {
+        return currentPath;
+    }
+    
+    // DAY 3: Create directory
+    bool createDirectory(const string& name) {
+        if (mkdirat(dirFd, name.c_str(), 0755) == 0) {
+            cout << GREEN << "Directory created: " << name << RESET << endl;
+            return true;
+        } else {
+            cerr << RED << "Error: Cannot create directory" << RESET << endl;
+            return false;
+        }
+    }
+    
+    // DAY 3: Create file
+    bool createFile(const string& name) {
+        int fd = openat(dirFd, name.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(fd);
+            cout << GREEN << "File created: " << name << RESET << endl;
+            return true;
+        } else {
+            cerr << RED << "Error: Cannot create file" << RESET << endl;
+            return false;
+        }
+    }
+    
+    // DAY 3: Delete file or directory
+    bool deleteItem(const string& name) {
+        struct stat fileStat;
+        
+        if (fstatat(dirFd, name.c_str(), &fileStat, AT_SYMLINK_NOFOLLOW) != 0) {
+            cerr << RED << "Error: Item not found" << RESET << endl;
+            return false;
+        }
+        
+        if (S_ISDIR(fileStat.st_mode)) {
+            if (unlinkat(dirFd, name.c_str(), AT_REMOVEDIR) == 0) {
+                cout << GREEN << "Directory deleted: " << name << RESET << endl;
+                return true;
+            } else {
+                cerr << RED << "Error: Cannot delete directory (may not be empty)" << RESET << endl;
+                return false;
+            }
+        } else {
+            if (unlinkat(dirFd, name.c_str(), 0) == 0) {
+                cout << GREEN << "File deleted: " << name << RESET << endl;
+                return true;
+            } else {
+                cerr << RED << "Error: Cannot delete file" << RESET << endl;
+                return false;
+            }
+        }
+    }
+    
+    // Deletes a directory and everything below it
+    bool deleteRecursive(const string& name) {
+        struct stat fileStat;
+        if (fstatat(dirFd, name.c_str(), &fileStat, AT_SYMLINK_NOFOLLOW) != 0) {
+            cerr << RED << "Error: Item not found" << RESET << endl;
+            return false;
+        }
+        if (!S_ISDIR(fileStat.st_mode)) return deleteItem(name);
+        
+        TreeOptions opts;
+        if (throttle.active()) opts.throttle = &throttle;
+        ProgressMeter progress("files");
+        TreeResult result = TreeOps::removeTree(resolvePath(name), &progress, opts);
+        progress.stop();
+        
+        cout << GREEN << "Deleted " << result.files << " file(s) and " << result.dirs << " director"
+             << (result.dirs == 1 ? "y" : "ies") << " in " << fixed << setprecision(2) << result.seconds << "s"
+             << defaultfloat << RESET << endl;
+        if (result.errors > 0) {
+            cerr << RED << "Error: " << result.errors << " item(s) could not be deleted" << RESET << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    bool isDirectory(const string& name) {
+        struct stat fileStat;
+        return fstatat(dirFd, name.c_str(), &fileStat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(fileStat.st_mode);
+    }
+    
+    // Batch delete of files and empty directories
+    size_t deleteItem(const vector<string>& names) {
+        vector<pair<string, string>> items;
+        for (const auto& n : names) items.emplace_back(n, string());
+        return runBatch(BatchExecutor::Op::Delete, items, "Deleted");
+    }
+    
+    // DAY 3: Copy file
+    bool copyFile(const string& src, const string& dest, bool verify = false, bool resume = false) {
+        struct stat srcStat;
+        if (fstatat(dirFd, src.c_str(), &srcStat, 0) != 0) {
+            cerr << RED << "Error: Source is not a file or doesn't exist" << RESET << endl;
+            return false;
+        }
+        if (S_ISDIR(srcStat.st_mode)) {
+            if (verify) cout << YELLOW << "Note: verification applies to file copies only" << RESET << endl;
+            return copyDirectory(resolvePath(src), resolvePath(dest), src, dest, resume);
+        }
+        if (resume) {
+            // A single file has nothing to resume; only skip it if unchanged
+            struct stat destStat;
+            if (fstatat(dirFd, dest.c_str(), &destStat, 0) == 0 && S_ISREG(destStat.st_mode) &&
+                destStat.st_size == srcStat.st_size && destStat.st_mtim.tv_sec == srcStat.st_mtim.tv_sec &&
+                destStat.st_mtim.tv_nsec == srcStat.st_mtim.tv_nsec) {
+                cout << GREEN << "Up to date: " << dest << RESET << endl;
+                return true;
+            }
+        }
+        
+        CopyResult result = copyFileContents(src, dest, verify);
+        invalidateListingOf(dest);
+        if (result.ok) {
+            fchmodat(dirFd, dest.c_str(), srcStat.st_mode & 07777, 0);
+            if (resume) {
+                struct timespec times[2] = {{0, UTIME_OMIT}, srcStat.st_mtim};
+                utimensat(dirFd, dest.c_str(), times, 0);
+            }
+            cout << GREEN << "File copied: " << src << " -> " << dest << RESET << endl;
+            cout << "  via " << result.method << ", " << OutputBuffer::sizeString(result.bytes) << " in "
+                 << fixed << setprecision(3) << result.seconds << "s";
+            if (result.seconds > 0) cout << " (" << OutputBuffer::sizeString(result.bytesPerSecond()) << "/s)";
+            cout << defaultfloat << endl;
+            if (result.verified) cout << "  verified, checksum " << TreeHash::hex(result.checksum) << endl;
+            return true;
+        } else {
+            cerr << RED << "Error: Cannot copy file";
+            if (result.error) cerr << " (" << result.error << ")";
+            cerr << RESET << endl;
+            return false;
+        }
+    }
+    
+    // Recursive copy of a directory; an existing destination directory
+    // receives the source as a new child, like cp -r. With resume the copy
+    // is journaled and repeatable: running it again continues (or syncs)
+    // into the same destination and skips files already there unchanged.
+    bool copyDirectory(string srcPath, string destPath, const string& src, const string& dest,
+                       bool resume = false) {
+        srcPath = TreeOps::rootPath(srcPath);
+        destPath = TreeOps::rootPath(destPath);
+        struct stat destStat;
+        if (stat(destPath.c_str(), &destStat) == 0 && !(resume && CopyJournal::exists(destPath))) {
+            if (!S_ISDIR(destStat.st_mode)) {
+                cerr << RED << "Error: Destination exists and is not a directory" << RESET << endl;
+                return false;
+            }
+            destPath += srcPath.substr(srcPath.find_last_of('/'));
+        }
+        struct stat srcStat;
+        if (stat(srcPath.c_str(), &srcStat) == 0 && TreeOps::isWithin(destPath, srcStat)) {
+            cerr << RED << "Error: Cannot copy a directory into itself" << RESET << endl;
+            return false;
+        }
+        
+        TreeOptions opts;
+        if (throttle.active()) opts.throttle = &throttle;
+        CopyJournal journal;
+        if (resume) {
+            if (!journal.open(srcPath, destPath)) {
+                cerr << RED << "Error: Cannot write journal " << destPath << CopyJournal::kSuffix << ": "
+                     << strerror(errno) << RESET << endl;
+                return false;
+            }
+            opts.journal = &journal;
+            opts.incremental = true;
+            if (journal.size() > 0) {
+                cout << YELLOW << "Resuming: " << journal.size() << " file(s) already copied" << RESET << endl;
+            }
+        }
+        
+        cout << YELLOW << "Copying directory " << src << " -> " << dest << "..." << RESET << endl;
+        ProgressMeter progress("files");
+        TreeResult result = TreeOps::copyTree(srcPath, destPath, &progress, opts);
+        progress.stop();
+        
+        cout << GREEN << "Copied " << result.files << " file(s) in " << result.dirs << " director"
+             << (result.dirs == 1 ? "y" : "ies") << ", " << OutputBuffer::sizeString(result.bytes) << " in "
+             << fixed << setprecision(2) << result.seconds << "s";
+        if (result.seconds > 0) cout << " (" << OutputBuffer::sizeString(result.bytes / result.seconds) << "/s)";
+        cout << defaultfloat << RESET << endl;
+        if (result.skipped > 0) cout << "  " << result.skipped << " file(s) already up to date" << endl;
+        if (result.errors > 0) {
+            cerr << RED << "Error: " << result.errors << " item(s) could not be copied" << RESET << endl;
+            if (resume) cerr << YELLOW << "Run the same copy with resume again to continue" << RESET << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Sets the pace of bulk copies and deletes; 0 lifts a limit
+    void setBulkLimits(uint64_t bytesPerSecond, uint64_t opsPerSecond) {
+        throttle.bytes.setRate(bytesPerSecond);
+        throttle.ops.setRate(opsPerSecond);
+        showBulkLimits();
+    }
+    
+    void showBulkLimits() {
+        cout << GREEN << "Bulk limits: "
+             << (throttle.bytes.rate() ? OutputBuffer::sizeString(throttle.bytes.rate()) + "/s"
+                                       : string("unlimited bandwidth")) << ", "
+             << (throttle.ops.rate() ? to_string(throttle.ops.rate()) + " ops/s" : string("unlimited ops"))
+             << RESET << endl;
+    }
+    
+    // Prints the tree hash of each file, hashing chunks on all cores
+    bool checksumFiles(const vector<string>& names) {
+        bool ok = true;
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        for (const auto& name : names) {
+            int fd = FE_TIMED(Open, openat(dirFd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY));
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                cerr << RED << "Error: " << name << ": " << (fd < 0 ? strerror(errno) : "not a regular file")
+                     << RESET << endl;
+                if (fd >= 0) close(fd);
+                ok = false;
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            uint64_t digest;
+            bool hashed = TreeHash::hashFile(fd, st.st_size, threads, digest);
+            int err = errno;
+            close(fd);
+            if (!hashed) {
+                cerr << RED << "Error: " << name << ": " << strerror(err) << RESET << endl;
+                ok = false;
+                continue;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << TreeHash::hex(digest) << "  " << name;
+            if (st.st_size >= (64 << 20) && seconds > 0) {
+                cout << CYAN << "  (" << OutputBuffer::sizeString(st.st_size / seconds) << "/s)" << RESET;
+            }
+            cout << endl;
+        }
+        return ok;
+    }
+    
+    // Batch copy: many (source, destination) pairs in one call
+    size_t copyFile(const vector<pair<string, string>>& items) {
+        return runBatch(BatchExecutor::Op::Copy, items, "Copied");
+    }
+    
+    // DAY 3: Move/Rename file
+    bool moveFile(const string& src, const string& dest) {
+        if (renameat(dirFd, src.c_str(), dirFd, dest.c_str()) == 0) {
+            cout << GREEN << "Moved/Renamed: " << src << " -> " << dest << RESET << endl;
+            return true;
+        } else {
+            cerr << RED << "Error: Cannot move/rename" << RESET << endl;
+            return false;
+        }
+    }
+    
+    // Batch move/rename: many (source, destination) pairs in one call
+    size_t moveFile(const vector<pair<string, string>>& items) {
+        return runBatch(BatchExecutor::Op::Move, items, "Moved");
+    }
+    
+    // Helper function to encode one search hit in a machine format;
+    // JSON and binary records carry the entry's metadata too
+    template <class Sink>
+    void encodeHit(Sink& out, string_view path, int atFd, const char* name, unsigned char dtype) {
+        if (outputFormat == OutputFormat::Nul) {
+            RecordFormat::nul(out, path);
+            return;
+        }
+        EntryMeta info;
+        if (!MetaFetcher(kAllStatFields).fetch(atFd, name, dtype, info)) info.mode = DTTOIF(dtype);
+        if (outputFormat == OutputFormat::JsonLines) {
+            RecordFormat::json(out, "path", path, info, kAllStatFields);
+        } else {
+            RecordFormat::binary(out, path, info);
+        }
+    }
+    
+    // DAY 4: Search for files
+    void searchFiles(const string& pattern, NameMatcher::Syntax syntax = NameMatcher::Syntax::Substring,
+                     bool ignoreCase = false) {
+        NameMatcher matcher(pattern, syntax, ignoreCase);
+        if (!matcher.ok()) {
+            cerr << RED << "Error: Invalid pattern: " << matcher.error() << RESET << endl;
+            return;
+        }
+        bool text = outputFormat == OutputFormat::Text;
+        OutputBuffer records;
+        if (text) {
+            cout << YELLOW << "\nSearching for '" << pattern << "' in " << currentPath << "..." << RESET << endl;
+        } else if (outputFormat == OutputFormat::Binary) {
+            records.put(string_view(RecordFormat::kMagic, 8));
+        }
+        
+        if (FileIndex* idx = indexForCurrentPath()) {
+            if (text) cout << CYAN << "(using index of " << idx->rootPath() << ")" << RESET << endl;
+            size_t found = idx->query(matcher, currentPath, [&](const string& result) {
+                if (text) {
+                    cout << "  " << result << '\n';
+                } else {
+                    encodeHit(records, result, AT_FDCWD, result.c_str(), DT_UNKNOWN);
+                }
+            });
+            if (!text) return;
+            if (found == 0) {
+                cout << "No files found matching pattern." << endl;
+            } else {
+                cout << GREEN << "Found " << found << " result(s)" << RESET << endl;
+            }
+            return;
+        }
+        
+        ParallelWalker walker;
+        // Regex matchers serialise inside glibc, so each worker gets its own
+        vector<unique_ptr<NameMatcher>> perWorker;
+        if (syntax == NameMatcher::Syntax::Regex) {
+            for (unsigned w = 0; w < walker.workers(); w++) {
+                perWorker.push_back(make_unique<NameMatcher>(pattern, syntax, ignoreCase));
+            }
+        }
+        
+        // Records are encoded on the worker threads straight into arena
+        // batches; the merger only moves finished bytes to the output
+        ResultMerger merger(orderedResults);
+        vector<string> hitPaths(walker.workers());
+        size_t found = walker.walkAndMerge(currentPath, merger,
+            [&](const WalkEntry& e, ResultBatch& out) {
+                const NameMatcher& m = perWorker.empty() ? matcher : *perWorker[e.worker];
+                if (!m.matches(e.name)) return true;
+                string_view sep = e.dirPath.back() == '/' ? "" : "/";
+                if (text) {
+                    out.add({e.dirPath, sep, e.name});
+                } else {
+                    // The path is spelled out once, in a worker-local buffer
+                    string& path = hitPaths[e.worker];
+                    path.assign(e.dirPath).append(sep).append(e.name);
+                    out.begin();
+                    encodeHit(out, path, e.dirFd, e.name.data(), e.type);
+                    out.end();
+                }
+                return true;
+            },
+            [&](string_view result) {
+                if (text) {
+                    cout << "  " << result << '\n';
+                } else {
+                    records.put(result);
+                }
+            });
+        
+        if (!text) return;
+        if (found == 0) {
+            cout << "No files found matching pattern." << endl;
+        } else {
+            cout << GREEN << "Found " << found << " result(s)" << RESET << endl;
+        }
+    }
+    
+    // Metadata search below currentPath with a find-style expression (see
+    // SearchQuery). Only entries that get past the name and type tests are
+    // stat-ed, once each, for just the fields the expression reads.
+    bool searchByPredicates(const vector<string>& expression) {
+        SearchQuery query(expression);
+        if (!query.ok()) {
+            cerr << RED << "Error: Invalid expression: " << query.error() << RESET << endl;
+            return false;
+        }
+        bool text = outputFormat == OutputFormat::Text;
+        OutputBuffer records;
+        if (text) {
+            cout << YELLOW << "\nSearching " << currentPath << " for " << query.describe() << "..." << RESET << endl;
+        } else if (outputFormat == OutputFormat::Binary) {
+            records.put(string_view(RecordFormat::kMagic, 8));
+        }
+        
+        ParallelWalker walker;
+        ResultMerger merger(orderedResults);
+        vector<string> hitPaths(walker.workers());
+        atomic<uint64_t> visited{0}, statCalls{0};
+        unsigned mask = query.fields();
+        auto start = chrono::steady_clock::now();
+        
+        size_t found = walker.walkAndMerge(currentPath, merger,
+            [&](const WalkEntry& e, ResultBatch& out) {
+                visited.fetch_add(1, memory_order_relaxed);
+                SearchQuery::EntryProbe probe{e, mask};
+                bool hit = query.matches(probe);
+                if (probe.statCalls) statCalls.fetch_add(probe.statCalls, memory_order_relaxed);
+                if (hit) {
+                    string_view sep = e.dirPath.back() == '/' ? "" : "/";
+                    if (text) {
+                        out.add({e.dirPath, sep, e.name});
+                    } else {
+                        string& path = hitPaths[e.worker];
+                        path.assign(e.dirPath).append(sep).append(e.name);
+                        out.begin();
+                        encodeHit(out, path, e.dirFd, e.name.data(), e.type);
+                        out.end();
+                    }
+                }
+                return e.type == DT_DIR && query.descend(e);
+            },
+            [&](string_view result) {
+                if (text) {
+                    cout << "  " << result << '\n';
+                } else {
+                    records.put(result);
+                }
+            });
+        
+        if (!text) return true;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (found == 0) {
+            cout << "No files found matching expression." << endl;
+        } else {
+            cout << GREEN << "Found " << found << " result(s)" << RESET << endl;
+        }
+        cout << CYAN << "Visited " << visited << " entries, stat-ed " << statCalls << " in "
+             << fixed << setprecision(2) << seconds * 1000 << " ms" << defaultfloat << RESET << endl;
+        return true;
+    }
     
-    // Helper function to get file permissions as string
-    string getPermissions(mode_t mode) {
-        string perms;
-        perms += (S_ISDIR(mode)) ? 'd' : '-';
-        perms += (mode & S_IRUSR) ? 'r' : '-';
-        perms += (mode & S_IWUSR) ? 'w' : '-';
-        perms += (mode & S_IXUSR) ? 'x' : '-';
-        perms += (mode & S_IRGRP) ? 'r' : '-';
-        perms += (mode & S_IWGRP) ? 'w' : '-';
-        perms += (mode & S_IXGRP) ? 'x' : '-';
-        perms += (mode & S_IROTH) ? 'r' : '-';
-        perms += (mode & S_IWOTH) ? 'w' : '-';
-        perms += (mode & S_IXOTH) ? 'x' : '-';
-        return perms;
+    // Grep mode: search file contents below currentPath. Files are
+    // scanned on the walker's threads and each file's matching lines are
+    // printed as soon as that file is done.
+    void searchContents(const ContentQuery& query) {
+        if (query.text.empty()) {
+            cerr << RED << "Error: Search text is empty" << RESET << endl;
+            return;
+        }
+        NameMatcher names(query.nameGlob.empty() ? "*" : query.nameGlob, NameMatcher::Syntax::Glob);
+        ContentScanner scanner(query.text, query.ignoreCase);
+        cout << YELLOW << "\nSearching contents for '" << query.text << "' in " << currentPath << "..."
+             << RESET << endl;
+        
+        ParallelWalker walker;
+        ResultMerger merger(false);
+        vector<vector<char>> scratch(walker.workers());
+        atomic<uint64_t> scanned{0}, binary{0}, bytes{0}, filesHit{0};
+        auto start = chrono::steady_clock::now();
+        
+        thread runner([&] {
+            walker.walk(currentPath, [&](const WalkEntry& e) {
+                if (e.type == DT_DIR) return true;
+                if (e.type != DT_REG || !names.matches(e.name)) return false;
+                
+                int fd = FE_TIMED(Open, openat(e.dirFd, e.name.data(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY));
+                if (fd < 0) return false;
+                struct stat st;
+                if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+                    static_cast<uint64_t>(st.st_size) < query.minSize ||
+                    static_cast<uint64_t>(st.st_size) > query.maxSize) {
+                    close(fd);
+                    return false;
+                }
+                
+                // Rows are assembled in the batch arena; files without a
+                // hit never have their path spelled out
+                string_view sep = e.dirPath.back() == '/' ? "" : "/";
+                ResultBatch hits;
+                bool text = scanner.scan(fd, st.st_size, query.includeBinary, [&](const ContentHit& h) {
+                    hits.begin();
+                    hits.put(e.dirPath);
+                    hits.put(sep);
+                    hits.put(e.name);
+                    hits.put(':');
+                    RecordFormat::number(hits, h.line);
+                    hits.put(':');
+                    RecordFormat::number(hits, h.offset);
+                    hits.put(": ");
+                    hits.put(h.text.substr(0, 200));
+                    hits.end();
+                    return hits.size() < query.maxHitsPerFile;
+                }, scratch[e.worker]);
+                close(fd);
+                
+                scanned++;
+                bytes += st.st_size;
+                if (!text) binary++;
+                if (!hits.empty()) {
+                    filesHit++;
+                    merger.push(move(hits));
+                }
+                return false;
+            });
+            merger.finish();
+        });
+        
+        size_t found = merger.drain([](string_view row) {
+            cout << "  " << row << '\n';
+        });
+        runner.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        if (found == 0) {
+            cout << "No matching lines found." << endl;
+        } else {
+            cout << GREEN << "Found " << found << " line(s) in " << filesHit << " file(s)" << RESET << endl;
+        }
+        cout << "  " << scanned << " files scanned (" << binary << " binary skipped), "
+             << OutputBuffer::sizeString(bytes) << " in " << fixed << setprecision(2) << seconds << "s"
+             << defaultfloat << endl;
+    }
+    
+    // Disk usage (du mode): allocated space of a directory tree with its
+    // largest subdirectories. A directory inside the last analysed tree is
+    // answered from that report unless rescan is set.
+    bool analyzeUsage(const string& name = ".", size_t topN = 10, bool rescan = false) {
+        string path = usagePath(name);
+        bool reused = !rescan && usage && usage->covers(path);
+        if (!reused) {
+            cout << YELLOW << "Analysing disk usage of " << path << "..." << RESET << endl;
+            auto report = make_unique<UsageAnalyzer::Report>();
+            if (!UsageAnalyzer::analyze(path, *report)) {
+                cerr << RED << "Error: Not a directory" << RESET << endl;
+                return false;
+            }
+            usage = move(report);
+        }
+        
+        const UsageTotals& total = usage->subtrees.at(path);
+        cout << BOLD << CYAN << "\nDisk Usage: " << path << RESET << endl;
+        cout << string(60, '=') << endl;
+        cout << "On disk:     " << OutputBuffer::sizeString(total.diskBytes) << endl;
+        cout << "Apparent:    " << OutputBuffer::sizeString(total.apparentBytes) << endl;
+        cout << "Contents:    " << total.files << " files, " << total.dirs - 1 << " directories" << endl;
+        
+        auto children = UsageAnalyzer::children(*usage, path);
+        if (children.size() > topN) children.resize(topN);
+        if (!children.empty()) {
+            cout << CYAN << "\nLargest subdirectories:" << RESET << endl;
+            printUsageRows(children, path);
+            cout << CYAN << "\nLargest directories anywhere below:" << RESET << endl;
+            printUsageRows(UsageAnalyzer::largest(*usage, path, topN), path);
+        }
+        
+        cout << string(60, '-') << endl;
+        if (reused) {
+            double age = chrono::duration<double>(chrono::steady_clock::now() - usage->taken).count();
+            cout << "From the analysis of " << usage->root << ", " << static_cast<long>(age) << "s ago" << endl;
+        } else {
+            cout << "Walked in " << fixed << setprecision(2) << usage->seconds << "s" << defaultfloat << endl;
+        }
+        if (usage->hardlinksSkipped) cout << "Hard links counted once: " << usage->hardlinksSkipped << " skipped" << endl;
+        if (usage->mountsSkipped) cout << "Other filesystems not entered: " << usage->mountsSkipped << endl;
+        if (usage->errors) cout << YELLOW << "Entries that could not be read: " << usage->errors << RESET << endl;
+        cout << string(60, '=') << endl;
+        return true;
     }
     
-    // Helper function to format file size
-    string formatSize(off_t size) {
-        const char* units[] = {"B", "KB", "MB", "GB", "TB"};
-        int unitIndex = 0;
-        double dSize = size;
+    // Lists groups of identical files below currentPath, largest waste
+    // first. Returns the groups so a caller can replace the duplicates.
+    vector<DuplicateGroup> findDuplicates(uint64_t minSize = 1, size_t maxGroupsShown = 50) {
+        cout << YELLOW << "\nLooking for duplicate files in " << currentPath << "..." << RESET << endl;
+        DuplicateFinder::Stats stats;
+        vector<DuplicateGroup> groups = DuplicateFinder::find(currentPath, minSize, stats);
         
-        while (dSize >= 1024 && unitIndex < 4) {
-            dSize /= 1024;
-            unitIndex++;
+        uint64_t wasted = 0;
+        for (size_t g = 0; g < groups.size(); g++) {
+            wasted += groups[g].wastedBytes();
+            if (g >= maxGroupsShown) continue;
+            cout << CYAN << "\n" << groups[g].paths.size() << " copies of " << OutputBuffer::sizeString(groups[g].size)
+                 << " (" << OutputBuffer::sizeString(groups[g].wastedBytes()) << " reclaimable)" << RESET << endl;
+            for (const auto& path : groups[g].paths) cout << "  " << path << endl;
+        }
+        if (groups.size() > maxGroupsShown) {
+            cout << "\n... and " << groups.size() - maxGroupsShown << " more group(s)" << endl;
         }
         
-        stringstream ss;
-        ss << fixed << setprecision(2) << dSize << " " << units[unitIndex];
-        return ss.str();
+        cout << string(60, '-') << endl;
+        if (groups.empty()) {
+            cout << GREEN << "No duplicate files found." << RESET << endl;
+        } else {
+            cout << GREEN << groups.size() << " duplicate group(s), " << OutputBuffer::sizeString(wasted)
+                 << " reclaimable" << RESET << endl;
+        }
+        cout << "  " << stats.files << " files, " << stats.sameSize << " share a size, " << stats.samePartial
+             << " also their first/last 4 KiB; " << OutputBuffer::sizeString(stats.hashedBytes) << " fully hashed in "
+             << fixed << setprecision(2) << stats.seconds << "s" << defaultfloat << endl;
+        return groups;
     }
     
-    // Helper function to copy file contents
-    bool copyFileContents(const string& src, const string& dest) {
-        int srcFd = open(src.c_str(), O_RDONLY);
-        if (srcFd < 0) {
-            cerr << RED << "Error: Cannot open source file" << RESET << endl;
+    // Replaces every duplicate but the first path of each group with a hard
+    // link or reflink to that first path. Returns the number replaced.
+    size_t replaceDuplicates(const vector<DuplicateGroup>& groups, DuplicateFinder::Replace how) {
+        size_t replaced = 0;
+        uint64_t freed = 0;
+        for (const auto& g : groups) {
+            for (size_t i = 1; i < g.paths.size(); i++) {
+                const char* error = nullptr;
+                if (DuplicateFinder::replace(g.paths[0], g.paths[i], how, error)) {
+                    replaced++;
+                    freed += g.size;
+                    invalidateListingOf(g.paths[i]);
+                } else {
+                    cerr << RED << "Error: " << g.paths[i] << ": " << error << RESET << endl;
+                }
+            }
+        }
+        cout << GREEN << "Replaced " << replaced << " file(s) with "
+             << (how == DuplicateFinder::Replace::Hardlink ? "hard links" : "reflinks") << ", "
+             << OutputBuffer::sizeString(freed) << " reclaimed" << RESET << endl;
+        return replaced;
+    }
+    
+    // Prints the instrumentation histograms as a table, or as JSON
+    void showMetrics(bool json = false) {
+        if (json) {
+            Metrics::writeJson(cout);
+            return;
+        }
+        cout << BOLD << CYAN << "\nInstrumentation (" << (Metrics::on() ? "recording" : "off") << ", "
+             << Metrics::threads() << " thread(s))" << RESET << endl;
+        cout << string(78, '=') << endl;
+        cout << left << setw(10) << "Probe" << right << setw(10) << "Count" << setw(12) << "Total ms"
+             << setw(11) << "p50 us" << setw(11) << "p90 us" << setw(11) << "p99 us" << setw(13) << "Max us" << endl;
+        cout << string(78, '-') << endl;
+        cout << fixed << setprecision(1);
+        for (unsigned p = 0; p < Metrics::kProbes; p++) {
+            Metrics::Summary sum = Metrics::summary(static_cast<Probe>(p));
+            cout << left << setw(10) << Metrics::name(static_cast<Probe>(p)) << right << setw(10) << sum.count
+                 << setw(12) << sum.totalNs / 1e6 << setw(11) << sum.percentile(50) / 1e3
+                 << setw(11) << sum.percentile(90) / 1e3 << setw(11) << sum.percentile(99) / 1e3
+                 << setw(13) << sum.maxNs / 1e3 << endl;
+        }
+        cout << defaultfloat << string(78, '=') << endl;
+    }
+    
+    // Number of operations batch calls keep in flight
+    void setBatchQueueDepth(unsigned depth) {
+        batchQueueDepth = depth ? depth : 1;
+    }
+    
+    // Encoding used by listFiles and searchFiles; anything but Text drops
+    // the banners and summaries so the output can be piped to other tools
+    void setOutputFormat(OutputFormat format) {
+        outputFormat = format;
+    }
+    
+    OutputFormat getOutputFormat() const {
+        return outputFormat;
+    }
+    
+    // Sorted search output is deterministic; unsorted output streams as found
+    void setOrderedResults(bool ordered) {
+        orderedResults = ordered;
+    }
+    
+    // Builds the search index for currentPath, or rescans only the
+    // directories that changed if an index already exists
+    bool updateIndex() {
+        FileIndex* idx = indexForCurrentPath();
+        if (idx && idx->rootPath() == currentPath) {
+            size_t rescanned = idx->refresh();
+            cout << GREEN << "Index refreshed: " << rescanned << " directories rescanned, "
+                 << idx->entryCount() << " entries" << RESET << endl;
+            return true;
+        }
+        
+        auto fresh = make_unique<FileIndex>(currentPath);
+        if (!fresh->rebuild()) {
+            cerr << RED << "Error: Cannot write index" << RESET << endl;
+            return false;
+        }
+        cout << GREEN << "Index built: " << fresh->dirCount() << " directories, "
+             << fresh->entryCount() << " entries" << RESET << endl;
+        replaceIndex(move(fresh));
+        return true;
+    }
+    
+    // Forces a full rescan of the index for currentPath
+    bool rebuildIndex() {
+        auto fresh = make_unique<FileIndex>(currentPath);
+        if (!fresh->rebuild()) {
+            cerr << RED << "Error: Cannot write index" << RESET << endl;
+            return false;
+        }
+        cout << GREEN << "Index rebuilt: " << fresh->dirCount() << " directories, "
+             << fresh->entryCount() << " entries" << RESET << endl;
+        replaceIndex(move(fresh));
+        return true;
+    }
+    
+    // Starts or stops live index updates from inotify
+    bool toggleIndexWatcher() {
+        if (watcher && watcher->running()) {
+            watcher.reset();
+            cout << GREEN << "Index watcher stopped" << RESET << endl;
+            return true;
+        }
+        if (!indexForCurrentPath()) {
+            cerr << RED << "Error: No index for this directory (build one first)" << RESET << endl;
+            return false;
+        }
+        if (!startWatcher()) {
+            cerr << RED << "Error: Cannot start inotify watcher" << RESET << endl;
+            return false;
+        }
+        cout << GREEN << "Watching " << watcher->watchCount() << " directories under "
+             << index->rootPath() << RESET << endl;
+        return true;
+    }
+    
+    // DAY 5: Change permissions
+    bool changePermissions(const string& name, const string& perms) {
+        // Convert permission string (e.g., "755") to mode_t
+        mode_t mode = 0;
+        if (perms.length() == 3) {
+            mode = ((perms[0] - '0') << 6) | ((perms[1] - '0') << 3) | (perms[2] - '0');
+        } else {
+            cerr << RED << "Error: Invalid permission format (use 3 digits, e.g., 755)" << RESET << endl;
             return false;
         }
         
-        int destFd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (destFd < 0) {
-            close(srcFd);
-            cerr << RED << "Error: Cannot create destination file" << RESET << endl;
+        if (fchmodat(dirFd, name.c_str(), mode, 0) == 0) {
+            invalidateListingOf(name);
+            cout << GREEN << "Permissions changed: " << name << " -> " << perms << RESET << endl;
+            return true;
+        } else {
+            cerr << RED << "Error: Cannot change permissions" << RESET << endl;
             return false;
         }
+    }
+    
+    // DAY 5: View file information
+    void viewFileInfo(const string& name) {
+        struct stat fileStat;
+        
+        if (fstatat(dirFd, name.c_str(), &fileStat, 0) != 0) {
+            cerr << RED << "Error: File not found" << RESET << endl;
+            return;
+        }
         
-        char buffer[4096];
-        ssize_t bytesRead;
+        IdNameCache& ids = IdNameCache::instance();
         
-        while ((bytesRead = read(srcFd, buffer, sizeof(buffer))) > 0) {
-            if (write(destFd, buffer, bytesRead) != bytesRead) {
-                close(srcFd);
-                close(destFd);
-                return false;
+        cout << BOLD << CYAN << "\nFile Information: " << name << RESET << endl;
+        cout << string(60, '=') << endl;
+        cout << "Type:        " << (S_ISDIR(fileStat.st_mode) ? "Directory" : "File") << endl;
+        cout << "Size:        " << OutputBuffer::sizeString(fileStat.st_size) << " (" << fileStat.st_size
+             << " bytes)" << endl;
+        if (S_ISDIR(fileStat.st_mode) && usage && usage->covers(usagePath(name))) {
+            cout << "Disk usage:  " << OutputBuffer::sizeString(usage->subtrees.at(usagePath(name)).diskBytes)
+                 << " (from last disk usage analysis)" << endl;
+        }
+        cout << "Permissions: " << OutputBuffer::permissionString(fileStat.st_mode) << " (";
+        cout << oct << (fileStat.st_mode & 0777) << dec << ")" << endl;
+        cout << "Owner:       " << ids.userName(fileStat.st_uid) << endl;
+        cout << "Group:       " << ids.groupName(fileStat.st_gid) << endl;
+        
+        char timeStr[100];
+        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_mtime));
+        cout << "Modified:    " << timeStr << endl;
+        
+        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_atime));
+        cout << "Accessed:    " << timeStr << endl;
+        
+        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_ctime));
+        cout << "Changed:     " << timeStr << endl;
+        cout << string(60, '=') << endl;
+    }
+    
+    // Prints count lines of a file starting at a 1-based line
+    bool printFileLines(const string& name, uint64_t line = 1, size_t count = 40) {
+        FileViewer viewer;
+        if (!viewer.open(dirFd, name.c_str())) {
+            cerr << RED << "Error: Cannot open file: " << strerror(errno) << RESET << endl;
+            return false;
+        }
+        uint64_t offset;
+        if (!viewer.lineOffset(line, offset)) {
+            cerr << RED << "Error: File has fewer than " << line << " lines" << RESET << endl;
+            return false;
+        }
+        OutputBuffer out;
+        viewer.render(out, offset, line, count);
+        return true;
+    }
+    
+    // Prints the last count lines, then with follow keeps printing lines as
+    // they are appended until Enter is pressed. Following needs stdin to be
+    // a terminal: from a script, the next script line would stop it.
+    bool tailFile(const string& name, size_t count = 10, bool follow = false) {
+        if (follow && !isatty(STDIN_FILENO)) {
+            cerr << RED << "Error: Following needs a terminal to stop it" << RESET << endl;
+            return false;
+        }
+        FileViewer viewer;
+        if (!viewer.open(dirFd, name.c_str(), follow)) {
+            cerr << RED << "Error: Cannot open file: " << strerror(errno) << RESET << endl;
+            return false;
+        }
+        OutputBuffer out;
+        uint64_t shownLines = viewer.completeLines();
+        uint64_t first = shownLines > count ? shownLines - count + 1 : 1;
+        uint64_t offset;
+        // A trailing line without its newline yet is shown now only when
+        // not following; a follower prints it once the newline arrives
+        if (viewer.lineOffset(first, offset)) viewer.render(out, offset, first, follow ? shownLines - first + 1 : count + 1);
+        out.flush();
+        if (!follow) return true;
+        
+        cout << CYAN << "Following " << name << " (press Enter to stop)" << RESET << endl;
+        while (true) {
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&pfd, 1, 250) > 0) {
+                string ignored;
+                getline(cin, ignored);
+                break;
+            }
+            uint64_t old = viewer.refresh();
+            if (old > viewer.size()) {
+                cout << YELLOW << name << ": file truncated" << RESET << endl;
+                shownLines = 0;
+            }
+            uint64_t lines = viewer.completeLines();
+            if (lines > shownLines && viewer.lineOffset(shownLines + 1, offset)) {
+                viewer.render(out, offset, shownLines + 1, lines - shownLines);
+                out.flush();
+            }
+            shownLines = max(shownLines, lines);
+        }
+        return true;
+    }
+    
+    // Pager over a file of any size. Lines come from the mapped file
+    // (or pread windows) through the background line index, so jumps to a
+    // line or byte offset cost the same anywhere in the file.
+    bool viewFile(const string& name, size_t pageLines = 30) {
+        FileViewer viewer;
+        if (!viewer.open(dirFd, name.c_str())) {
+            cerr << RED << "Error: Cannot open file: " << strerror(errno) << RESET << endl;
+            return false;
+        }
+        cout << BOLD << CYAN << "\nViewing: " << name << RESET << " (" << OutputBuffer::sizeString(viewer.size())
+             << ", " << (viewer.mapped() ? "mapped" : "pread windows") << ")" << endl;
+        
+        OutputBuffer out;
+        uint64_t line = 1, offset = 0;
+        string cmd;
+        while (true) {
+            cout << string(60, '-') << endl;
+            uint64_t next = viewer.render(out, offset, line, pageLines);
+            out.flush();
+            bool complete;
+            uint64_t known = viewer.lineCount(complete);
+            cout << string(60, '-') << endl;
+            cout << CYAN << "Line " << line << " of " << (complete ? "" : "at least ") << known;
+            if (!complete) cout << " (indexing " << static_cast<int>(viewer.indexedFraction() * 100) << "%)";
+            cout << RESET << endl;
+            cout << "[Enter] next  b back  g LINE  o OFFSET  G end  f follow  q quit: ";
+            if (!getline(cin, cmd) || cmd == "q") break;
+            
+            uint64_t target = cmd.size() > 1 ? strtoull(cmd.c_str() + 1, nullptr, 10) : 0;
+            if (cmd.empty() || cmd == "n") {
+                if (next < viewer.size()) {
+                    line += pageLines;
+                    offset = next;
+                }
+            } else if (cmd == "b") {
+                line = line > pageLines ? line - pageLines : 1;
+                viewer.lineOffset(line, offset);
+            } else if (cmd[0] == 'g') {
+                if (viewer.lineOffset(target, offset)) {
+                    line = max<uint64_t>(target, 1);
+                } else {
+                    cerr << RED << "Error: No line " << target << RESET << endl;
+                }
+            } else if (cmd[0] == 'o') {
+                if (target < viewer.size()) {
+                    offset = viewer.lineStart(target);
+                    line = viewer.lineAt(offset);
+                } else {
+                    cerr << RED << "Error: Offset past end of file" << RESET << endl;
+                }
+            } else if (cmd == "G") {
+                viewer.completeLines();
+                uint64_t total = viewer.lineCount(complete);
+                line = total > pageLines ? total - pageLines + 1 : 1;
+                viewer.lineOffset(line, offset);
+            } else if (cmd == "f") {
+                return tailFile(name, pageLines, true);
+            } else {
+                cerr << RED << "Error: Unknown command" << RESET << endl;
+            }
+        }
+        return true;
+    }
+};
+
+// Benchmark suite behind --bench. Builds synthetic trees (one wide
+// directory, a deep chain, a bushy tree of tiny files, a few large files)
+// and times the FileExplorer operations over them, warm and, where
+// /proc/sys/vm/drop_caches is writable, cold. Regular output of the timed
+// calls is sent to /dev/null. Results are written as one JSON document
+// with ops/s, files/s, MB/s and p50/p99 latency per case.
+class BenchmarkSuite {
+public:
+    struct Options {
+        string root;                // parent of the scratch directory; $TMPDIR if empty
+        bool quick = false;
+        unsigned iterations = 5;
+        bool keepTree = false;
+    };
+    
+private:
+    struct Result {
+        string name;
+        bool cold;
+        vector<double> latencies;   // seconds per iteration
+        uint64_t filesPerOp = 0;
+        uint64_t bytesPerOp = 0;
+        uint64_t opsPerIteration = 1;
+    };
+    
+    // Points stdout at /dev/null for its lifetime
+    class Silence {
+    private:
+        int saved = -1;
+        
+    public:
+        Silence() {
+            cout.flush();
+            saved = dup(STDOUT_FILENO);
+            int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            if (null >= 0) {
+                dup2(null, STDOUT_FILENO);
+                close(null);
+            }
+        }
+        
+        ~Silence() {
+            cout.flush();
+            if (saved >= 0) {
+                dup2(saved, STDOUT_FILENO);
+                close(saved);
+            }
+        }
+    };
+    
+    Options opts;
+    vector<Result> results;
+    bool coldSupported = false;
+    
+    string wideDir, deepDir, tinyDir, hugeDir;
+    size_t wideFiles = 0, deepFiles = 0, tinyFiles = 0;
+    uint64_t tinyBytes = 0, hugeBytes = 0;
+    
+    static bool writeFile(const string& path, const char* data, size_t len, uint64_t total) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        uint64_t done = 0;
+        bool ok = true;
+        while (ok && done < total) {
+            size_t n = min<uint64_t>(len, total - done);
+            ok = pwrite(fd, data, n, done) == static_cast<ssize_t>(n);
+            done += n;
+        }
+        return close(fd) == 0 && ok;
+    }
+    
+    bool buildTrees() {
+        size_t wide = opts.quick ? 5000 : 50000;
+        unsigned depth = opts.quick ? 32 : 128;
+        unsigned fanout = opts.quick ? 4 : 8;
+        uint64_t huge = opts.quick ? (32ULL << 20) : (256ULL << 20);
+        
+        wideDir = opts.root + "/wide";
+        deepDir = opts.root + "/deep";
+        tinyDir = opts.root + "/tiny";
+        hugeDir = opts.root + "/huge";
+        for (const string& d : {wideDir, deepDir, tinyDir, hugeDir}) {
+            if (mkdir(d.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        }
+        
+        char small[512];
+        for (size_t i = 0; i < sizeof(small); i++) small[i] = 'a' + i % 26;
+        
+        for (size_t i = 0; i < wide; i++) {
+            if (!writeFile(wideDir + "/file_" + to_string(i) + ".dat", small, 64, 64)) return false;
+        }
+        wideFiles = wide;
+        
+        string path = deepDir;
+        for (unsigned d = 0; d < depth; d++) {
+            path += "/level_" + to_string(d);
+            if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) return false;
+            for (int f = 0; f < 4; f++) {
+                if (!writeFile(path + "/note_" + to_string(f) + ".txt", small, 128, 128)) return false;
+                deepFiles++;
+            }
+        }
+        
+        // Three levels of fanout, a handful of tiny files in every directory
+        vector<string> level = {tinyDir};
+        for (int l = 0; l < 3; l++) {
+            vector<string> next;
+            for (const auto& dir : level) {
+                for (unsigned k = 0; k < fanout; k++) {
+                    string child = dir + "/d" + to_string(k);
+                    if (mkdir(child.c_str(), 0755) != 0 && errno != EEXIST) return false;
+                    next.push_back(child);
+                }
+            }
+            level.swap(next);
+        }
+        for (const auto& dir : level) {
+            for (int f = 0; f < 16; f++) {
+                size_t len = 1 + (tinyFiles * 37) % sizeof(small);
+                if (!writeFile(dir + "/tiny_" + to_string(f) + ".txt", small, len, len)) return false;
+                tinyFiles++;
+                tinyBytes += len;
+            }
+        }
+        
+        vector<char> block(1 << 20);
+        for (size_t i = 0; i < block.size(); i++) block[i] = static_cast<char>(i * 131 + (i >> 12));
+        for (int h = 0; h < 2; h++) {
+            if (!writeFile(hugeDir + "/big_" + to_string(h) + ".bin", block.data(), block.size(), huge)) return false;
+        }
+        hugeBytes = huge;
+        sync();
+        return true;
+    }
+    
+    void dropCaches() {
+        if (!coldSupported) return;
+        sync();
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        if (write(fd, "3", 1) != 1) coldSupported = false;
+        close(fd);
+    }
+    
+    // Times body once per iteration; setup and teardown run untimed
+    void measure(const string& name, bool cold, uint64_t files, uint64_t bytes,
+                 const function<void()>& body, const function<void()>& setup = nullptr,
+                 const function<void()>& teardown = nullptr) {
+        if (cold && !coldSupported) return;
+        Result r{name, cold, {}, files, bytes, 1};
+        for (unsigned i = 0; i < opts.iterations; i++) {
+            if (setup) setup();
+            if (cold) dropCaches();
+            auto start = chrono::steady_clock::now();
+            {
+                Silence quiet;
+                body();
+            }
+            r.latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            if (teardown) teardown();
+        }
+        results.push_back(move(r));
+    }
+    
+    // Per-call statx latency over every entry of the wide directory
+    void measureStat(bool cold) {
+        if (cold && !coldSupported) return;
+        if (cold) dropCaches();
+        int fd = open(wideDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return;
+        MetaFetcher meta(MetaFetcher::Mode | MetaFetcher::Owner | MetaFetcher::Size | MetaFetcher::MTime);
+        Result r{"stat", cold, {}, 1, 0, 1};
+        DirReader reader;
+        vector<string> names;
+        if (reader.open(wideDir)) {
+            DirReader::Entry e;
+            while (reader.next(e)) names.emplace_back(e.name);
+        }
+        for (const auto& n : names) {
+            EntryMeta info;
+            auto start = chrono::steady_clock::now();
+            meta.fetch(fd, n.c_str(), DT_UNKNOWN, info);
+            r.latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        }
+        close(fd);
+        results.push_back(move(r));
+    }
+    
+    void runCases(bool cold) {
+        Silence quiet;
+        FileExplorer fe;
+        
+        fe.changeDirectory(wideDir);
+        fe.setListingCacheBudget(0);
+        measure("list_simple", cold, wideFiles, 0, [&] { fe.listFiles(false); });
+        measure("list_detailed", cold, wideFiles, 0, [&] { fe.listFiles(true); });
+        measure("list_streaming", cold, wideFiles, 0, [&] { fe.listFilesStreaming(false); });
+        if (!cold) {
+            fe.setListingCacheBudget(512 << 20);
+            fe.listFiles(true);
+            measure("list_cached", false, wideFiles, 0, [&] { fe.listFiles(false); });
+        }
+        measureStat(cold);
+        
+        fe.changeDirectory(tinyDir);
+        measure("search_name", cold, tinyFiles, 0, [&] { fe.searchFiles("tiny_7"); });
+        measure("search_glob", cold, tinyFiles, 0, [&] {
+            fe.searchFiles("*_1?.txt", NameMatcher::Syntax::Glob);
+        });
+        ContentQuery query;
+        query.text = "xyz";
+        measure("search_content", cold, tinyFiles, tinyBytes, [&] { fe.searchContents(query); });
+        measure("disk_usage", cold, tinyFiles, 0, [&] { fe.analyzeUsage(".", 10, true); });
+        
+        fe.changeDirectory(deepDir);
+        measure("search_deep", cold, deepFiles, 0, [&] { fe.searchFiles("note_3"); });
+        
+        fe.changeDirectory(opts.root);
+        string treeCopy = opts.root + "/tiny_copy";
+        measure("copy_tree", cold, tinyFiles, tinyBytes, [&] { fe.copyFile("tiny", "tiny_copy"); },
+                [&] { TreeOps::removeTree(treeCopy, nullptr); });
+        measure("delete_tree", cold, tinyFiles, 0, [&] { fe.deleteRecursive("tiny_copy"); },
+                [&] { TreeOps::copyTree(tinyDir, treeCopy, nullptr); });
+        
+        measure("copy_large", cold, 1, hugeBytes, [&] { fe.copyFile("huge/big_0.bin", "huge/big_copy.bin"); },
+                nullptr, [&] { unlink((hugeDir + "/big_copy.bin").c_str()); });
+        
+        fe.changeDirectory(wideDir);
+        vector<pair<string, string>> batch;
+        for (size_t i = 0; i < min<size_t>(wideFiles, 2000); i++) {
+            batch.emplace_back("file_" + to_string(i) + ".dat", "copy_" + to_string(i) + ".dat");
+        }
+        vector<string> copies;
+        for (const auto& b : batch) copies.push_back(b.second);
+        measure("copy_batch", cold, batch.size(), batch.size() * 64, [&] { fe.copyFile(batch); },
+                nullptr, [&] { Silence quiet; fe.deleteItem(copies); });
+    }
+    
+    static double percentile(vector<double> v, double p) {
+        if (v.empty()) return 0;
+        sort(v.begin(), v.end());
+        size_t rank = static_cast<size_t>(ceil(p / 100.0 * v.size()));
+        return v[rank == 0 ? 0 : rank - 1];
+    }
+    
+    void writeJson(ostream& out) const {
+        struct utsname host;
+        uname(&host);
+        out << "{\n  \"version\": 1,\n  \"timestamp\": " << time(nullptr) << ",\n"
+            << "  \"host\": {\"kernel\": \"" << host.release << "\", \"cpus\": " << thread::hardware_concurrency() << "},\n"
+            << "  \"config\": {\"quick\": " << (opts.quick ? "true" : "false") << ", \"iterations\": " << opts.iterations
+            << ", \"cold_cache\": " << (coldSupported ? "true" : "false") << "},\n"
+            << "  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            double total = 0;
+            for (double l : r.latencies) total += l;
+            double ops = r.latencies.size();
+            out << fixed << setprecision(3)
+                << "    {\"name\": \"" << r.name << "\", \"cache\": \"" << (r.cold ? "cold" : "warm") << "\""
+                << ", \"iterations\": " << r.latencies.size()
+                << ", \"total_s\": " << setprecision(6) << total
+                << ", \"ops_per_sec\": " << setprecision(3) << (total > 0 ? ops / total : 0)
+                << ", \"files_per_sec\": " << (total > 0 ? ops * r.filesPerOp / total : 0)
+                << ", \"mb_per_sec\": " << (total > 0 ? ops * r.bytesPerOp / total / 1048576.0 : 0)
+                << ", \"p50_ms\": " << percentile(r.latencies, 50) * 1000
+                << ", \"p99_ms\": " << percentile(r.latencies, 99) * 1000 << "}"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << defaultfloat << "  ]\n}\n";
+    }
+    
+public:
+    explicit BenchmarkSuite(const Options& options) : opts(options) {}
+    
+    // Builds the trees, runs every case and writes the JSON report
+    bool run(ostream& out) {
+        // The trees always go in a fresh directory, so removing it afterwards
+        // cannot touch anything that was already under --root
+        string parent = opts.root;
+        if (parent.empty()) {
+            const char* tmp = getenv("TMPDIR");
+            parent = tmp ? tmp : "/tmp";
+        } else if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << RED << "Error: Cannot create " << parent << RESET << endl;
+            return false;
+        }
+        string templ = parent + "/fe-bench-XXXXXX";
+        vector<char> buf(templ.begin(), templ.end());
+        buf.push_back('\0');
+        if (!mkdtemp(buf.data())) {
+            cerr << RED << "Error: Cannot create benchmark directory in " << parent << RESET << endl;
+            return false;
+        }
+        opts.root = buf.data();
+        
+        // Keep any saved search index out of the measurements
+        const char* oldCache = getenv("XDG_CACHE_HOME");
+        bool hadCache = oldCache != nullptr;
+        string savedCache = hadCache ? oldCache : "";
+        setenv("XDG_CACHE_HOME", (opts.root + "/.cache").c_str(), 1);
+        auto finish = [&](bool ok) {
+            if (hadCache) setenv("XDG_CACHE_HOME", savedCache.c_str(), 1);
+            else unsetenv("XDG_CACHE_HOME");
+            if (!opts.keepTree) TreeOps::removeTree(opts.root, nullptr);
+            return ok;
+        };
+        
+        cerr << YELLOW << "Building benchmark trees in " << opts.root << "..." << RESET << endl;
+        if (!buildTrees()) {
+            cerr << RED << "Error: Cannot build benchmark trees" << RESET << endl;
+            return finish(false);
+        }
+        coldSupported = access("/proc/sys/vm/drop_caches", W_OK) == 0;
+        // The listing cache ignores directories changed within the current second
+        sleep(1);
+        
+        cerr << YELLOW << "Running warm-cache cases..." << RESET << endl;
+        runCases(false);
+        if (coldSupported) {
+            cerr << YELLOW << "Running cold-cache cases..." << RESET << endl;
+            runCases(true);
+        } else {
+            cerr << YELLOW << "Cold-cache cases skipped (drop_caches not writable)" << RESET << endl;
+        }
+        
+        writeJson(out);
+        return finish(true);
+    }
+};
+
+// Non-interactive front end: runs shell-like command lines against a
+// FileExplorer, from a script, stdin or the program arguments. Arguments
+// of file commands are glob-expanded in the current directory, and
+// commands with several operands go through the batch APIs in one call.
+class CommandRunner {
+private:
+    FileExplorer& explorer;
+    size_t lineNumber = 0;
+    
+public:
+    // Splits a line into words; quotes group, backslash escapes
+    static bool tokenize(const string& line, vector<string>& words) {
+        words.clear();
+        string word;
+        bool inWord = false;
+        char quote = 0;
+        for (size_t i = 0; i < line.size(); i++) {
+            char c = line[i];
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                } else if (c == '\\' && quote == '"' && i + 1 < line.size()) {
+                    word += line[++i];
+                } else {
+                    word += c;
+                }
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+                inWord = true;
+            } else if (c == '\\' && i + 1 < line.size()) {
+                word += line[++i];
+                inWord = true;
+            } else if (c == '#' && !inWord) {
+                break;
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                if (inWord) words.push_back(move(word));
+                word.clear();
+                inWord = false;
+            } else {
+                word += c;
+                inWord = true;
             }
         }
-        
-        close(srcFd);
-        close(destFd);
-        return bytesRead == 0;
+        if (quote) return false;
+        if (inWord) words.push_back(move(word));
+        return true;
     }
     
-    // Recursive search function
-    void searchInDirectory(const string& path, const string& pattern, vector<string>& results) {
-        DIR* dir = opendir(path.c_str());
-        if (!dir) return;
-        
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            string name = entry->d_name;
-            if (name == "." || name == "..") continue;
-            
-            string fullPath = path + "/" + name;
-            
-            // Check if name matches pattern
-            if (name.find(pattern) != string::npos) {
-                results.push_back(fullPath);
+    // "N", "N/s" or the same with a K, M or G multiplier (powers of 1024)
+    static bool parseRate(string text, uint64_t& rate) {
+        if (text.size() > 2 && text.compare(text.size() - 2, 2, "/s") == 0) text.resize(text.size() - 2);
+        char* end;
+        errno = 0;
+        unsigned long long n = strtoull(text.c_str(), &end, 10);
+        if (end == text.c_str() || errno != 0) return false;
+        unsigned shift = 0;
+        if (*end) {
+            static const char units[] = "kKmMgG";
+            const char* u = strchr(units, *end);
+            if (!u || end[1]) return false;
+            shift = 10 * (1 + (u - units) / 2);
+        }
+        rate = static_cast<uint64_t>(n) << shift;
+        return true;
+    }
+    
+private:
+    // Replaces wildcard operands by the names they match, in sorted order.
+    // A pattern that matches nothing is kept as written, like the shell.
+    static vector<string> expand(vector<string>::const_iterator first, vector<string>::const_iterator last) {
+        vector<string> out;
+        for (auto it = first; it != last; ++it) {
+            if (it->find_first_of("*?[") == string::npos) {
+                out.push_back(*it);
+                continue;
             }
-            
-            // Recursively search in subdirectories
-            if (entry->d_type == DT_DIR) {
-                searchInDirectory(fullPath, pattern, results);
+            glob_t g;
+            if (glob(it->c_str(), GLOB_NOCHECK, nullptr, &g) == 0) {
+                for (size_t i = 0; i < g.gl_pathc; i++) out.emplace_back(g.gl_pathv[i]);
+            } else {
+                out.push_back(*it);
             }
+            globfree(&g);
         }
-        closedir(dir);
+        return out;
     }
     
-public:
-    FileExplorer() {
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
-            currentPath = cwd;
-        } else {
-            currentPath = "/";
-        }
+    static string baseName(const string& path) {
+        string p = path;
+        while (p.size() > 1 && p.back() == '/') p.pop_back();
+        size_t slash = p.find_last_of('/');
+        return slash == string::npos ? p : p.substr(slash + 1);
     }
     
-    // DAY 1: List files in current directory
-    void listFiles(bool detailed = false) {
-        DIR* dir = opendir(currentPath.c_str());
-        if (!dir) {
-            cerr << RED << "Error: Cannot open directory" << RESET << endl;
-            return;
-        }
-        
-        cout << BOLD << CYAN << "\nCurrent Directory: " << currentPath << RESET << endl;
-        cout << string(80, '=') << endl;
-        
-        if (detailed) {
-            cout << left << setw(12) << "Permissions" 
-                 << setw(10) << "Owner" 
-                 << setw(10) << "Group"
-                 << setw(12) << "Size" 
-                 << setw(20) << "Modified" 
-                 << "Name" << endl;
-            cout << string(80, '-') << endl;
-        }
-        
-        struct dirent* entry;
-        vector<string> files, directories;
-        
-        while ((entry = readdir(dir)) != nullptr) {
-            string name = entry->d_name;
-            if (name == ".") continue;
-            
-            string fullPath = currentPath + "/" + name;
-            struct stat fileStat;
-            
-            if (stat(fullPath.c_str(), &fileStat) == 0) {
-                if (detailed) {
-                    // Get owner and group names
-                    struct passwd* pw = getpwuid(fileStat.st_uid);
-                    struct group* gr = getgrgid(fileStat.st_gid);
-                    
-                    // Format modified time
-                    char timeStr[20];
-                    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M", localtime(&fileStat.st_mtime));
-                    
-                    string color = S_ISDIR(fileStat.st_mode) ? BLUE : (fileStat.st_mode & S_IXUSR ? GREEN : RESET);
-                    
-                    cout << left << setw(12) << getPermissions(fileStat.st_mode)
-                         << setw(10) << (pw ? pw->pw_name : to_string(fileStat.st_uid))
-                         << setw(10) << (gr ? gr->gr_name : to_string(fileStat.st_gid))
-                         << setw(12) << (S_ISDIR(fileStat.st_mode) ? "<DIR>" : formatSize(fileStat.st_size))
-                         << setw(20) << timeStr
-                         << color << name << RESET << endl;
-                } else {
-                    if (S_ISDIR(fileStat.st_mode)) {
-                        directories.push_back(name);
-                    } else {
-                        files.push_back(name);
-                    }
-                }
-            }
+    bool fail(const string& message) {
+        cerr << RED << "Error: ";
+        if (lineNumber) cerr << "line " << lineNumber << ": ";
+        cerr << message << RESET << endl;
+        return false;
+    }
+    
+    // cp and mv: "src dest", or "src... dir"
+    bool transfer(const vector<string>& args, bool move) {
+        if (args.size() < 2) return fail(string(move ? "mv" : "cp") + ": need a source and a destination");
+        const string& dest = args.back();
+        if (args.size() == 2 && !explorer.isDirectory(dest)) {
+            return move ? explorer.moveFile(args[0], dest) : explorer.copyFile(args[0], dest);
         }
+        if (!explorer.isDirectory(dest)) return fail("target '" + dest + "' is not a directory");
         
-        if (!detailed) {
-            // Sort and display
-            sort(directories.begin(), directories.end());
-            sort(files.begin(), files.end());
-            
-            for (const auto& d : directories) {
-                cout << BLUE << "[DIR]  " << d << RESET << endl;
-            }
-            for (const auto& f : files) {
-                cout << "       " << f << endl;
+        vector<pair<string, string>> files;
+        bool ok = true;
+        for (size_t i = 0; i + 1 < args.size(); i++) {
+            string target = dest + "/" + baseName(args[i]);
+            if (!move && explorer.isDirectory(args[i])) {
+                ok = explorer.copyFile(args[i], target) && ok;
+            } else {
+                files.emplace_back(args[i], target);
             }
         }
-        
-        closedir(dir);
-        cout << string(80, '=') << endl;
+        if (files.empty()) return ok;
+        size_t done = move ? explorer.moveFile(files) : explorer.copyFile(files);
+        return ok && done == files.size();
     }
     
-    // DAY 2: Navigate to directory
-    bool changeDirectory(const string& path) {
-        string newPath;
+    bool remove(vector<string> args) {
+        bool recursive = !args.empty() && (args[0] == "-r" || args[0] == "-rf");
+        if (recursive) args.erase(args.begin());
+        if (args.empty()) return fail("rm: missing operand");
         
-        if (path == "..") {
-            size_t pos = currentPath.find_last_of('/');
-            if (pos != string::npos && pos != 0) {
-                newPath = currentPath.substr(0, pos);
+        vector<string> plain;
+        bool ok = true;
+        for (const auto& name : args) {
+            if (explorer.isDirectory(name)) {
+                ok = (recursive ? explorer.deleteRecursive(name) : explorer.deleteItem(name)) && ok;
             } else {
-                newPath = "/";
+                plain.push_back(name);
             }
-        } else if (path[0] == '/') {
-            newPath = path;
-        } else {
-            newPath = currentPath + "/" + path;
         }
-        
-        if (chdir(newPath.c_str()) == 0) {
-            currentPath = newPath;
-            cout << GREEN << "Changed to: " << currentPath << RESET << endl;
+        if (plain.size() == 1) return explorer.deleteItem(plain[0]) && ok;
+        if (!plain.empty()) ok = explorer.deleteItem(plain) == plain.size() && ok;
+        return ok;
+    }
+    
+    // limit | limit off | limit RATE [OPS]
+    bool limit(const vector<string>& args) {
+        if (args.empty()) {
+            explorer.showBulkLimits();
             return true;
-        } else {
-            cerr << RED << "Error: Cannot change to directory" << RESET << endl;
-            return false;
         }
+        if (args.size() == 1 && args[0] == "off") {
+            explorer.setBulkLimits(0, 0);
+            return true;
+        }
+        uint64_t bytes, ops = 0;
+        if (args.size() > 2 || !parseRate(args[0], bytes) || (args.size() == 2 && !parseRate(args[1], ops))) {
+            return fail("limit: expected BYTES[K|M|G][/s] [OPS], or off");
+        }
+        explorer.setBulkLimits(bytes, ops);
+        return true;
     }
     
-    string getCurrentPath() const {
-        return currentPath;
+    // find -name ... / -type ... / ( ... ): a predicate expression rather
+    // than one pattern
+    static bool isPredicateSearch(const vector<string>& args) {
+        if (args.empty()) return true;
+        const string& a = args[0];
+        return a == "(" || a == "!" || (a.size() > 2 && a[0] == '-' && a != "-g" && a != "-r" && a != "-i");
     }
     
-    // DAY 3: Create directory
-    bool createDirectory(const string& name) {
-        string fullPath = currentPath + "/" + name;
-        if (mkdir(fullPath.c_str(), 0755) == 0) {
-            cout << GREEN << "Directory created: " << name << RESET << endl;
-            return true;
-        } else {
-            cerr << RED << "Error: Cannot create directory" << RESET << endl;
-            return false;
+    bool find(const vector<string>& args) {
+        if (isPredicateSearch(args)) return explorer.searchByPredicates(args);
+        NameMatcher::Syntax syntax = NameMatcher::Syntax::Substring;
+        bool ignoreCase = false;
+        size_t i = 0;
+        for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; i++) {
+            if (args[i] == "-g") syntax = NameMatcher::Syntax::Glob;
+            else if (args[i] == "-r") syntax = NameMatcher::Syntax::Regex;
+            else if (args[i] == "-i") ignoreCase = true;
+            else return fail("find: unknown option " + args[i]);
         }
+        if (i + 1 != args.size()) return fail("find: usage: find [-g|-r] [-i] pattern, or find EXPRESSION");
+        explorer.searchFiles(args[i], syntax, ignoreCase);
+        return true;
     }
     
-    // DAY 3: Create file
-    bool createFile(const string& name) {
-        string fullPath = currentPath + "/" + name;
-        int fd = open(fullPath.c_str(), O_CREAT | O_WRONLY, 0644);
-        if (fd >= 0) {
-            close(fd);
-            cout << GREEN << "File created: " << name << RESET << endl;
-            return true;
-        } else {
-            cerr << RED << "Error: Cannot create file" << RESET << endl;
-            return false;
+    bool tail(const vector<string>& args) {
+        size_t count = 10;
+        bool follow = false;
+        size_t i = 0;
+        for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; i++) {
+            if (args[i] == "-f") follow = true;
+            else if (args[i] == "-n" && i + 1 < args.size()) count = strtoul(args[++i].c_str(), nullptr, 10);
+            else return fail("tail: unknown option " + args[i]);
         }
+        if (i + 1 != args.size()) return fail("tail: need exactly one file");
+        return explorer.tailFile(args[i], count, follow);
     }
     
-    // DAY 3: Delete file or directory
-    bool deleteItem(const string& name) {
-        string fullPath = currentPath + "/" + name;
-        struct stat fileStat;
-        
-        if (stat(fullPath.c_str(), &fileStat) != 0) {
-            cerr << RED << "Error: Item not found" << RESET << endl;
-            return false;
-        }
-        
-        if (S_ISDIR(fileStat.st_mode)) {
-            if (rmdir(fullPath.c_str()) == 0) {
-                cout << GREEN << "Directory deleted: " << name << RESET << endl;
-                return true;
-            } else {
-                cerr << RED << "Error: Cannot delete directory (may not be empty)" << RESET << endl;
-                return false;
-            }
-        } else {
-            if (unlink(fullPath.c_str()) == 0) {
-                cout << GREEN << "File deleted: " << name << RESET << endl;
-                return true;
-            } else {
-                cerr << RED << "Error: Cannot delete file" << RESET << endl;
-                return false;
-            }
+    bool grep(const vector<string>& args) {
+        ContentQuery query;
+        size_t i = 0;
+        for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; i++) {
+            if (args[i] == "-i") query.ignoreCase = true;
+            else if (args[i] == "-a") query.includeBinary = true;
+            else if (args[i] == "-n" && i + 1 < args.size()) query.nameGlob = args[++i];
+            else if (args[i] == "-s" && i + 1 < args.size()) query.maxSize = strtoull(args[++i].c_str(), nullptr, 10) << 20;
+            else return fail("grep: unknown option " + args[i]);
         }
+        if (i + 1 != args.size()) return fail("grep: usage: grep [-i] [-a] [-n glob] [-s maxMB] text");
+        query.text = args[i];
+        explorer.searchContents(query);
+        return true;
     }
     
-    // DAY 3: Copy file
-    bool copyFile(const string& src, const string& dest) {
-        string srcPath = currentPath + "/" + src;
-        string destPath = currentPath + "/" + dest;
+public:
+    explicit CommandRunner(FileExplorer& fe) : explorer(fe) {}
+    
+    static void usage(ostream& out) {
+        out << "Commands:\n"
+            << "  ls [-l|-S|-s|-p] [TEXT]   list (detailed, by size, streaming, paged);\n"
+            << "                            TEXT keeps names containing it,\n"
+            << "                            or matching it if it has wildcards\n"
+            << "  cd DIR | pwd\n"
+            << "  mkdir NAME... | touch NAME...\n"
+            << "  rm [-r] NAME...           delete; -r for directory trees\n"
+            << "  cp [--verify] SRC... DEST | mv SRC... DEST\n"
+            << "  cp --resume SRC DEST      journaled copy; re-run to continue or sync\n"
+            << "  limit [RATE [OPS] | off]  pace bulk copies/deletes (e.g. 20M 500)\n"
+            << "  sum FILE...               parallel tree checksum\n"
+            << "  chmod MODE NAME...        e.g. chmod 644 *.txt\n"
+            << "  info NAME...\n"
+            << "  find [-g|-r] [-i] PATTERN search names (glob, regex)\n"
+            << "  find EXPRESSION           e.g. find -name '*.core' -size +1G -mtime -1\n"
+            << "                            (-name -iname -type -size -mtime -mmin -user\n"
+            << "                            -group -perm -mindepth -maxdepth ! -o ( ))\n"
+            << "  grep [-i] [-a] [-n GLOB] [-s MB] TEXT\n"
+            << "  view FILE [LINE [COUNT]]  print lines of a file\n"
+            << "  tail [-n N] [-f] FILE     last lines; -f follows until Enter\n"
+            << "  du [DIR] [N] | dups [MINKB]\n"
+            << "  index update|rebuild|watch | cache\n"
+            << "  prefetch on|off           warm the cache with listed subdirectories\n"
+            << "  metrics on|off|show|json|reset\n"
+            << "  format text|nul|json|binary  encoding for ls and find\n"
+            << "  help | exit\n"
+            << "Wildcards in file operands are expanded; '#' starts a comment.\n";
+    }
+    
+    // Runs one command; returns false if it failed
+    bool run(const vector<string>& words) {
+        if (words.empty()) return true;
+        const string& cmd = words[0];
+        // ls, find and grep take patterns and text, not file operands
+        vector<string> args = (cmd == "ls" || cmd == "find" || cmd == "grep")
+            ? vector<string>(words.begin() + 1, words.end())
+            : expand(words.begin() + 1, words.end());
         
-        struct stat srcStat;
-        if (stat(srcPath.c_str(), &srcStat) != 0 || S_ISDIR(srcStat.st_mode)) {
-            cerr << RED << "Error: Source is not a file or doesn't exist" << RESET << endl;
-            return false;
+        if (cmd == "ls") {
+            string opt = args.empty() ? "" : args[0];
+            string filter = args.size() > 1 ? args[1] : "";
+            if (opt == "-l") explorer.listFiles(true, filter);
+            else if (opt == "-S") explorer.listFilesBySize(filter);
+            else if (opt == "-s") explorer.listFilesStreaming(false);
+            else if (opt == "-p") explorer.listFilesPaged(40, [] { return true; });
+            else if (opt.empty()) explorer.listFiles(false);
+            else if (opt[0] != '-') explorer.listFiles(false, opt);
+            else return fail("ls: unknown option " + opt);
+            return true;
         }
-        
-        if (copyFileContents(srcPath, destPath)) {
-            chmod(destPath.c_str(), srcStat.st_mode);
-            cout << GREEN << "File copied: " << src << " -> " << dest << RESET << endl;
+        if (cmd == "cd") return args.size() == 1 ? explorer.changeDirectory(args[0]) : fail("cd: need one directory");
+        if (cmd == "pwd") {
+            cout << explorer.getCurrentPath() << endl;
             return true;
-        } else {
-            cerr << RED << "Error: Cannot copy file" << RESET << endl;
-            return false;
         }
-    }
-    
-    // DAY 3: Move/Rename file
-    bool moveFile(const string& src, const string& dest) {
-        string srcPath = currentPath + "/" + src;
-        string destPath = currentPath + "/" + dest;
-        
-        if (rename(srcPath.c_str(), destPath.c_str()) == 0) {
-            cout << GREEN << "Moved/Renamed: " << src << " -> " << dest << RESET << endl;
+        if (cmd == "mkdir" || cmd == "touch") {
+            if (args.empty()) return fail(cmd + ": missing operand");
+            bool ok = true;
+            for (const auto& a : args) ok = (cmd == "mkdir" ? explorer.createDirectory(a) : explorer.createFile(a)) && ok;
+            return ok;
+        }
+        if (cmd == "rm") return remove(args);
+        if (cmd == "cp") {
+            if (!args.empty() && (args[0] == "--verify" || args[0] == "--resume")) {
+                if (args.size() != 3) return fail("cp " + args[0] + ": need one source and one destination");
+                return explorer.copyFile(args[1], args[2], args[0] == "--verify", args[0] == "--resume");
+            }
+            return transfer(args, false);
+        }
+        if (cmd == "limit") return limit(args);
+        if (cmd == "sum") return args.empty() ? fail("sum: missing operand") : explorer.checksumFiles(args);
+        if (cmd == "mv") return transfer(args, true);
+        if (cmd == "chmod") {
+            if (args.size() < 2) return fail("chmod: need a mode and at least one name");
+            bool ok = true;
+            for (size_t i = 1; i < args.size(); i++) ok = explorer.changePermissions(args[i], args[0]) && ok;
+            return ok;
+        }
+        if (cmd == "info") {
+            if (args.empty()) return fail("info: missing operand");
+            for (const auto& a : args) explorer.viewFileInfo(a);
             return true;
-        } else {
-            cerr << RED << "Error: Cannot move/rename" << RESET << endl;
-            return false;
         }
-    }
-    
-    // DAY 4: Search for files
-    void searchFiles(const string& pattern) {
-        cout << YELLOW << "\nSearching for '" << pattern << "' in " << currentPath << "..." << RESET << endl;
-        vector<string> results;
-        searchInDirectory(currentPath, pattern, results);
-        
-        if (results.empty()) {
-            cout << "No files found matching pattern." << endl;
-        } else {
-            cout << GREEN << "Found " << results.size() << " result(s):" << RESET << endl;
-            for (const auto& result : results) {
-                cout << "  " << result << endl;
+        if (cmd == "view") {
+            if (args.empty()) return fail("view: missing file operand");
+            uint64_t line = args.size() > 1 ? strtoull(args[1].c_str(), nullptr, 10) : 1;
+            size_t count = args.size() > 2 ? strtoul(args[2].c_str(), nullptr, 10) : 40;
+            return explorer.printFileLines(args[0], line ? line : 1, count);
+        }
+        if (cmd == "tail") return tail(args);
+        if (cmd == "find") return find(args);
+        if (cmd == "grep") return grep(args);
+        if (cmd == "du") {
+            string dir = args.empty() ? "." : args[0];
+            size_t topN = args.size() > 1 ? strtoul(args[1].c_str(), nullptr, 10) : 10;
+            return explorer.analyzeUsage(dir, topN ? topN : 10);
+        }
+        if (cmd == "dups") {
+            uint64_t minSize = args.empty() ? 1 : max<uint64_t>(1, strtoull(args[0].c_str(), nullptr, 10) << 10);
+            explorer.findDuplicates(minSize);
+            return true;
+        }
+        if (cmd == "index") {
+            string what = args.empty() ? "update" : args[0];
+            if (what == "update") return explorer.updateIndex();
+            if (what == "rebuild") return explorer.rebuildIndex();
+            if (what == "watch") return explorer.toggleIndexWatcher();
+            return fail("index: expected update, rebuild or watch");
+        }
+        if (cmd == "format") {
+            OutputFormat format;
+            if (args.size() != 1 || !RecordFormat::parse(args[0], format)) {
+                return fail("format: expected text, nul, json or binary");
             }
+            explorer.setOutputFormat(format);
+            return true;
         }
-    }
-    
-    // DAY 5: Change permissions
-    bool changePermissions(const string& name, const string& perms) {
-        string fullPath = currentPath + "/" + name;
-        
-        // Convert permission string (e.g., "755") to mode_t
-        mode_t mode = 0;
-        if (perms.length() == 3) {
-            mode = ((perms[0] - '0') << 6) | ((perms[1] - '0') << 3) | (perms[2] - '0');
-        } else {
-            cerr << RED << "Error: Invalid permission format (use 3 digits, e.g., 755)" << RESET << endl;
-            return false;
+        if (cmd == "prefetch") {
+            if (args.size() != 1 || (args[0] != "on" && args[0] != "off")) return fail("prefetch: expected on or off");
+            if ((args[0] == "on") != explorer.prefetching()) explorer.togglePrefetch();
+            return true;
         }
-        
-        if (chmod(fullPath.c_str(), mode) == 0) {
-            cout << GREEN << "Permissions changed: " << name << " -> " << perms << RESET << endl;
+        if (cmd == "cache") {
+            explorer.showListingCacheStats();
             return true;
-        } else {
-            cerr << RED << "Error: Cannot change permissions" << RESET << endl;
-            return false;
         }
+        if (cmd == "metrics") {
+            string what = args.empty() ? "show" : args[0];
+            if (what == "on" || what == "off") Metrics::setEnabled(what == "on");
+            else if (what == "reset") Metrics::reset();
+            else if (what == "show" || what == "json") explorer.showMetrics(what == "json");
+            else return fail("metrics: expected on, off, show, json or reset");
+            return true;
+        }
+        if (cmd == "help") {
+            usage(cout);
+            return true;
+        }
+        return fail("unknown command '" + cmd + "' (try help)");
     }
     
-    // DAY 5: View file information
-    void viewFileInfo(const string& name) {
-        string fullPath = currentPath + "/" + name;
-        struct stat fileStat;
-        
-        if (stat(fullPath.c_str(), &fileStat) != 0) {
-            cerr << RED << "Error: File not found" << RESET << endl;
-            return;
+    bool runLine(const string& line) {
+        vector<string> words;
+        if (!tokenize(line, words)) return fail("unterminated quote");
+        return run(words);
+    }
+    
+    // Runs every line of a script; stops at "exit". Returns the number of
+    // commands that failed.
+    size_t runScript(istream& in) {
+        size_t failures = 0;
+        string line;
+        lineNumber = 0;
+        while (getline(in, line)) {
+            lineNumber++;
+            vector<string> words;
+            if (!tokenize(line, words)) {
+                fail("unterminated quote");
+                failures++;
+                continue;
+            }
+            if (!words.empty() && (words[0] == "exit" || words[0] == "quit")) break;
+            if (!run(words)) failures++;
         }
-        
-        struct passwd* pw = getpwuid(fileStat.st_uid);
-        struct group* gr = getgrgid(fileStat.st_gid);
-        
-        cout << BOLD << CYAN << "\nFile Information: " << name << RESET << endl;
-        cout << string(60, '=') << endl;
-        cout << "Type:        " << (S_ISDIR(fileStat.st_mode) ? "Directory" : "File") << endl;
-        cout << "Size:        " << formatSize(fileStat.st_size) << " (" << fileStat.st_size << " bytes)" << endl;
-        cout << "Permissions: " << getPermissions(fileStat.st_mode) << " (";
-        cout << oct << (fileStat.st_mode & 0777) << dec << ")" << endl;
-        cout << "Owner:       " << (pw ? pw->pw_name : to_string(fileStat.st_uid)) << endl;
-        cout << "Group:       " << (gr ? gr->gr_name : to_string(fileStat.st_gid)) << endl;
-        
-        char timeStr[100];
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_mtime));
-        cout << "Modified:    " << timeStr << endl;
-        
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_atime));
-        cout << "Accessed:    " << timeStr << endl;
-        
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&fileStat.st_ctime));
-        cout << "Changed:     " << timeStr << endl;
-        cout << string(60, '=') << endl;
+        lineNumber = 0;
+        return failures;
     }
 };
 
+#ifndef FILE_EXPLORER_NO_MAIN
+
 void displayMenu() {
     cout << BOLD << MAGENTA << "\n╔═══════════════════════════════════════╗" << endl;
     cout << "║     LINUX FILE EXPLORER MENU         ║" << endl;
@@ -410,24 +9310,104 @@ void displayMenu() {
     cout << "  2.  List files (detailed)" << endl;
     cout << "  3.  Change directory" << endl;
     cout << "  4.  Show current path" << endl;
+    cout << "  16. List files (streaming, unsorted)" << endl;
+    cout << "  17. List files (paged)" << endl;
+    cout << "  18. Sort/filter last detailed listing" << endl;
+    cout << "  19. Listing cache statistics" << endl;
+    cout << "  27. Start/stop directory prefetch" << endl;
     cout << CYAN << "\nFile/Directory Operations:" << RESET << endl;
     cout << "  5.  Create directory" << endl;
     cout << "  6.  Create file" << endl;
     cout << "  7.  Delete file/directory" << endl;
-    cout << "  8.  Copy file" << endl;
+    cout << "  8.  Copy file/directory" << endl;
     cout << "  9.  Move/Rename file" << endl;
+    cout << "  28. Bulk operation limits" << endl;
     cout << CYAN << "\nSearch & Information:" << RESET << endl;
     cout << "  10. Search files" << endl;
     cout << "  11. View file information" << endl;
+    cout << "  20. Search file contents" << endl;
+    cout << "  21. Disk usage" << endl;
+    cout << "  22. Find duplicate files" << endl;
+    cout << "  24. View file contents" << endl;
+    cout << "  25. Checksum file(s)" << endl;
+    cout << "  26. Search by metadata (find-style expression)" << endl;
     cout << CYAN << "\nPermissions:" << RESET << endl;
     cout << "  12. Change permissions" << endl;
+    cout << CYAN << "\nIndexing:" << RESET << endl;
+    cout << "  13. Update search index" << endl;
+    cout << "  14. Rebuild search index" << endl;
+    cout << "  15. Start/stop index watcher" << endl;
+    cout << CYAN << "\nDiagnostics:" << RESET << endl;
+    cout << "  23. Instrumentation (toggle/show/reset)" << endl;
     cout << CYAN << "\nOther:" << RESET << endl;
     cout << "  0.  Exit" << endl;
     cout << string(40, '-') << endl;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     FileExplorer explorer;
+    
+    // Batch mode: --exec FILE (or - for stdin), or a single command line
+    if (argc > 1) {
+        string first = argv[1];
+        CommandRunner runner(explorer);
+        if (first == "--help" || first == "-h") {
+            cout << "Usage: " << argv[0] << " [--exec SCRIPT|-] [COMMAND ARGS...]" << endl;
+            cout << "       " << argv[0] << " --format text|nul|json|binary COMMAND ARGS..." << endl;
+            cout << "       " << argv[0] << " --bench [--quick] [--iterations N] [--root DIR] [--out FILE] [--keep]" << endl;
+            CommandRunner::usage(cout);
+            return 0;
+        }
+        if (first == "--bench") {
+            BenchmarkSuite::Options opts;
+            string outPath;
+            for (int i = 2; i < argc; i++) {
+                string a = argv[i];
+                if (a == "--quick") opts.quick = true;
+                else if (a == "--keep") opts.keepTree = true;
+                else if (a == "--root" && i + 1 < argc) opts.root = argv[++i];
+                else if (a == "--out" && i + 1 < argc) outPath = argv[++i];
+                else if (a == "--iterations" && i + 1 < argc) opts.iterations = max(1, atoi(argv[++i]));
+                else {
+                    cerr << RED << "Error: Unknown benchmark option " << a << RESET << endl;
+                    return 2;
+                }
+            }
+            BenchmarkSuite bench(opts);
+            if (outPath.empty()) return bench.run(cout) ? 0 : 1;
+            ofstream out(outPath);
+            if (!out) {
+                cerr << RED << "Error: Cannot write " << outPath << RESET << endl;
+                return 2;
+            }
+            return bench.run(out) ? 0 : 1;
+        }
+        if (first == "--format") {
+            OutputFormat format;
+            if (argc < 4 || !RecordFormat::parse(argv[2], format)) {
+                cerr << RED << "Error: --format needs text, nul, json or binary and a command" << RESET << endl;
+                return 2;
+            }
+            explorer.setOutputFormat(format);
+            return runner.run(vector<string>(argv + 3, argv + argc)) ? 0 : 1;
+        }
+        if (first == "--exec") {
+            if (argc != 3) {
+                cerr << RED << "Error: --exec needs a script file, or - for stdin" << RESET << endl;
+                return 2;
+            }
+            string script = argv[2];
+            if (script == "-") return runner.runScript(cin) == 0 ? 0 : 1;
+            ifstream in(script);
+            if (!in) {
+                cerr << RED << "Error: Cannot open script " << script << RESET << endl;
+                return 2;
+            }
+            return runner.runScript(in) == 0 ? 0 : 1;
+        }
+        return runner.run(vector<string>(argv + 1, argv + argc)) ? 0 : 1;
+    }
+    
     int choice;
     string input, src, dest;
     
@@ -475,15 +9455,31 @@ int main() {
             case 7:
                 cout << "Enter file/directory name: ";
                 getline(cin, input);
+                if (explorer.isDirectory(input)) {
+                    cout << "Delete directory and all its contents? (y/N): ";
+                    getline(cin, dest);
+                    if (dest == "y" || dest == "Y") {
+                        explorer.deleteRecursive(input);
+                        break;
+                    }
+                }
                 explorer.deleteItem(input);
                 break;
                 
             case 8:
-                cout << "Enter source file name: ";
+                cout << "Enter source file/directory name: ";
                 getline(cin, src);
                 cout << "Enter destination file name: ";
                 getline(cin, dest);
-                explorer.copyFile(src, dest);
+                if (explorer.isDirectory(src)) {
+                    cout << "Journal the copy so it can resume, skipping unchanged files? (y/N): ";
+                    getline(cin, input);
+                    explorer.copyFile(src, dest, false, input == "y" || input == "Y");
+                    break;
+                }
+                cout << "Verify the copy with a checksum? (y/N): ";
+                getline(cin, input);
+                explorer.copyFile(src, dest, input == "y" || input == "Y");
                 break;
                 
             case 9:
@@ -497,7 +9493,14 @@ int main() {
             case 10:
                 cout << "Enter search pattern: ";
                 getline(cin, input);
-                explorer.searchFiles(input);
+                cout << "Match as (s)ubstring, (g)lob, (r)egex [s]: ";
+                getline(cin, src);
+                cout << "Ignore case? (y/N): ";
+                getline(cin, dest);
+                explorer.searchFiles(input,
+                    src == "g" ? NameMatcher::Syntax::Glob
+                    : src == "r" ? NameMatcher::Syntax::Regex : NameMatcher::Syntax::Substring,
+                    dest == "y" || dest == "Y");
                 break;
                 
             case 11:
@@ -514,6 +9517,162 @@ int main() {
                 explorer.changePermissions(src, dest);
                 break;
                 
+            case 13:
+                explorer.updateIndex();
+                break;
+                
+            case 14:
+                explorer.rebuildIndex();
+                break;
+                
+            case 15:
+                explorer.toggleIndexWatcher();
+                break;
+                
+            case 16:
+                explorer.listFilesStreaming(false);
+                break;
+                
+            case 17:
+                explorer.listFilesPaged(40, [&input]() {
+                    cout << YELLOW << "-- Enter for more, q to stop -- " << RESET;
+                    if (!getline(cin, input)) return false;
+                    return input != "q" && input != "Q";
+                });
+                break;
+                
+            case 18: {
+                cout << "Sort by (n)ame, (s)ize, (t)ime, (o)wner, (g)roup: ";
+                getline(cin, input);
+                DirSnapshot::Key key = DirSnapshot::Key::Name;
+                char k = input.empty() ? 'n' : input[0];
+                if (k == 's') key = DirSnapshot::Key::Size;
+                else if (k == 't') key = DirSnapshot::Key::MTime;
+                else if (k == 'o') key = DirSnapshot::Key::Owner;
+                else if (k == 'g') key = DirSnapshot::Key::Group;
+                cout << "Descending? (y/N): ";
+                getline(cin, src);
+                cout << "Name filter (empty for all): ";
+                getline(cin, dest);
+                explorer.sortListing(key, src == "y" || src == "Y", dest);
+                break;
+            }
+                
+            case 19:
+                explorer.showListingCacheStats();
+                break;
+                
+            case 20: {
+                ContentQuery query;
+                cout << "Enter text to find: ";
+                getline(cin, query.text);
+                cout << "Ignore case? (y/N): ";
+                getline(cin, input);
+                query.ignoreCase = input == "y" || input == "Y";
+                cout << "Only file names matching (glob, empty for all): ";
+                getline(cin, query.nameGlob);
+                cout << "Maximum file size in MB (empty for no limit): ";
+                getline(cin, input);
+                if (!input.empty()) query.maxSize = strtoull(input.c_str(), nullptr, 10) << 20;
+                explorer.searchContents(query);
+                break;
+            }
+                
+            case 21: {
+                cout << "Enter directory name (empty for current): ";
+                getline(cin, input);
+                cout << "How many largest entries to show [10]: ";
+                getline(cin, src);
+                cout << "Rescan even if already analysed? (y/N): ";
+                getline(cin, dest);
+                size_t topN = src.empty() ? 10 : strtoul(src.c_str(), nullptr, 10);
+                explorer.analyzeUsage(input, topN ? topN : 10, dest == "y" || dest == "Y");
+                break;
+            }
+                
+            case 22: {
+                cout << "Minimum file size in KB [0]: ";
+                getline(cin, input);
+                uint64_t minSize = max<uint64_t>(1, strtoull(input.c_str(), nullptr, 10) << 10);
+                vector<DuplicateGroup> groups = explorer.findDuplicates(minSize);
+                if (groups.empty()) break;
+                cout << "Replace duplicates with (h)ard links, (r)eflinks, or (n)othing [n]: ";
+                getline(cin, input);
+                if (input != "h" && input != "r") break;
+                cout << "Keep the first path of each group and replace the rest? (y/N): ";
+                getline(cin, dest);
+                if (dest == "y" || dest == "Y") {
+                    explorer.replaceDuplicates(groups, input == "h" ? DuplicateFinder::Replace::Hardlink
+                                                                    : DuplicateFinder::Replace::Reflink);
+                }
+                break;
+            }
+                
+            case 23:
+                cout << "Instrumentation is " << (Metrics::on() ? "on" : "off")
+                     << ". (t)oggle, (s)how, (j)son, (r)eset [s]: ";
+                getline(cin, input);
+                if (input == "t") {
+                    Metrics::setEnabled(!Metrics::on());
+                    cout << GREEN << "Instrumentation " << (Metrics::on() ? "enabled" : "disabled") << RESET << endl;
+                } else if (input == "r") {
+                    Metrics::reset();
+                    cout << GREEN << "Counters reset" << RESET << endl;
+                } else {
+                    explorer.showMetrics(input == "j");
+                }
+                break;
+                
+            case 24:
+                cout << "Enter file name: ";
+                getline(cin, input);
+                explorer.viewFile(input);
+                continue;
+                
+            case 25: {
+                cout << "Enter file name(s), separated by spaces: ";
+                getline(cin, input);
+                istringstream names(input);
+                vector<string> files;
+                for (string name; names >> name;) files.push_back(name);
+                explorer.checksumFiles(files);
+                break;
+            }
+                
+            case 26: {
+                cout << "Enter expression (e.g. -name '*.log' -size +10M -mtime -1): ";
+                getline(cin, input);
+                vector<string> words;
+                if (!CommandRunner::tokenize(input, words)) {
+                    cerr << RED << "Error: Unterminated quote" << RESET << endl;
+                    break;
+                }
+                explorer.searchByPredicates(words);
+                break;
+            }
+                
+            case 27:
+                explorer.togglePrefetch();
+                break;
+                
+            case 28: {
+                uint64_t bytes, ops;
+                cout << "Bytes per second (e.g. 20M, 0 = unlimited): ";
+                getline(cin, input);
+                if (!CommandRunner::parseRate(input, bytes)) {
+                    cerr << RED << "Error: Invalid rate" << RESET << endl;
+                    break;
+                }
+                cout << "Operations per second (0 = unlimited): ";
+                getline(cin, input);
+                if (!CommandRunner::parseRate(input, ops)) {
+                    cerr << RED << "Error: Invalid rate" << RESET << endl;
+                    break;
+                }
+                explorer.setBulkLimits(bytes, ops);
+                break;
+            }
+                
             case 0:
                 cout << BOLD << GREEN << "Thank you for using File Explorer!" << RESET << endl;
                 return 0;
@@ -528,3 +9687,4 @@ int main() {
     
     return 0;
 }
+#endif